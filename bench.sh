@@ -0,0 +1,51 @@
+#!/bin/sh
+# Runs the same load against the epoll and io_uring backends.
+# Environment: PORT, THREADS (server), NODES, WORKERS (per node), DURATION, TARGETS,
+# ZIPF (exponent of target popularity, 0 - uniform), WRITES (fraction of WRIT),
+# WRITE_MS (mean time to generate a file), CRASHES (fraction of writers that die),
+# BATCH (targets per BTCH request, 1 - single requests), BINARY (1 - binary protocol instead of text),
+# LOCAL (1 - Unix domain socket instead of TCP), SHM (1 - shared memory over the Unix domain socket),
+# PIPELINE (requests in flight per connection, 1 - wait for every answer).
+# Journal is off, so every run starts with the same empty state.
+PORT=${PORT:-19870}
+THREADS=${THREADS:-1}
+NODES=${NODES:-4}
+WORKERS=${WORKERS:-8}
+DURATION=${DURATION:-5}
+TARGETS=${TARGETS:-1000}
+ZIPF=${ZIPF:-0}
+WRITES=${WRITES:-0.1}
+WRITE_MS=${WRITE_MS:-0}
+CRASHES=${CRASHES:-0}
+BATCH=${BATCH:-1}
+BINARY=${BINARY:-0}
+LOCAL=${LOCAL:-0}
+SHM=${SHM:-0}
+PIPELINE=${PIPELINE:-1}
+[ "$BINARY" = 1 ] && PROTOCOL=-B || PROTOCOL=
+SOCKET=/tmp/file_scheduler_bench.$$
+TRANSPORT=
+[ "$LOCAL" = 1 ] || [ "$SHM" = 1 ] && TRANSPORT="-U $SOCKET"
+[ "$SHM" = 1 ] && TRANSPORT="$TRANSPORT -M"
+
+run() {
+	./file_scheduler -n -t "$THREADS" -p "$PORT" -U "$SOCKET" "$@" > /dev/null 2>&1 &
+	server=$!
+	sleep 1
+	out=$(./load_generator -p "$PORT" -n "$NODES" -c "$WORKERS" -d "$DURATION" -t "$TARGETS" \
+		-z "$ZIPF" -w "$WRITES" -W "$WRITE_MS" -x "$CRASHES" -b "$BATCH" -P "$PIPELINE" $PROTOCOL $TRANSPORT)
+	status=$?
+	echo "$out"
+	# CPU time of the server per request: parsing, deciding and answering, without the clients
+	ticks=$(awk '{print $14 + $15}' /proc/$server/stat)
+	echo "$out" | awk -v ticks="$ticks" -v hz="$(getconf CLK_TCK)" \
+		'/^requests:/ && $2 > 0 { printf "server cpu: %.2f us per request\n", ticks / hz * 1e6 / $2 }'
+	kill -INT "$server"
+	wait "$server"
+	return $status
+}
+
+echo "epoll:"
+run || exit 1
+echo "io_uring:"
+run -u || exit 1
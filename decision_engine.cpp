@@ -0,0 +1,956 @@
+/** @file decision_engine.cpp*/
+/** Decisions on targets: who writes a file, who reads it and who waits.
+**
+** If file does not exist and is not being generated - the requested operation is granted.
+** If it is being generated - WAIT, the answer comes when the writer is done (READ)
+** or gone (WRIT to the first waiter). Otherwise - READ.
+** With read tokens, waiters of a finished target get READ a few at a time: either when earlier
+** readers send DONE, or in waves every 'wave_us'. Until the queue is empty, newcomers wait behind it.
+** Hosts that wrote or read a target are remembered, so workers can ask where its file is cached.
+** A target with inputs is answered WAIT until every input is ready, then its first waiter gets WRIT.
+** Targets of the graph that nobody writes and whose inputs are ready are queued for WORK requests.
+** Inputs may be kept by other engines (shards): their changes come through engine_input().
+** Every writer takes a slot from its owner first (engine_hooks::admit). A worker that gets none is told WAIT
+** and keeps the first place among waiters of the target until engine_promote() finds a free slot.
+** Ready targets are kept in the order of their last use, engine_evict() hands the coldest one to a worker to delete.
+** Nothing here touches sockets, the journal or the clock: answers and transitions
+** are reported through engine_hooks, time is taken from 'now_us'.
+ */
+#include <string.h>
+#include <algorithm>
+#include "decision_engine.h"
+
+static const char *const op_names[] = {"", "READ", "WRIT", "WAIT", "DONE", "BEAT", "EXIT", "HINT", "BTCH", "SHMR", "SUBS", "PREF", "NTFY", "DEPS", "WORK", "IDLE", "EVCT", ""};
+
+/*!
+64-bit FNV-1a hash of target name. Decides which shard owns the target, workers of the binary protocol may refer to the target by it.
+\param[in] target Target name.
+\returns hash value
+*/
+uint64_t target_hash(string_view target)
+{
+	uint64_t h = TARGET_HASH_BASIS;
+	for(char c : target)
+		h = target_hash_step(h, c);
+	return h;
+}
+
+/*!
+\returns code of the operation in a request
+*/
+op_code op_parse(string_view text)
+{
+	if(text.size() != 4)
+		return text.empty() ? OP_NONE : OP_OTHER;
+	for(uint8_t op = OP_READ; op < OP_OTHER; ++op)
+		if(memcmp(text.data(), op_names[op], 4) == 0)
+			return (op_code)op;
+	return OP_OTHER;
+}
+
+/*!
+\returns text of the operation or answer, four characters, empty for OP_NONE and OP_OTHER
+*/
+const char *op_name(op_code op)
+{
+	return op_names[op <= OP_OTHER ? op : OP_OTHER];
+}
+
+static void report(decision_engine *e, engine_event_type type, const holder &h, target_entry *target,
+	op_code answer = OP_NONE, bool queued = false)
+{
+	engine_event ev = {type, h.conn, h.pid, answer, queued, h.since, h.tag, target, 0};
+	e->hooks.event(e->hooks.ctx, ev);
+}
+
+static void add_holding(decision_engine *e, target_entry *target, const holder &h)
+{
+	e->hooks.holdings(e->hooks.ctx, h.conn)->push_back({target->second.id, h.pid});
+}
+
+static void drop_holding(decision_engine *e, target_entry *target, const holder &h)
+{
+	auto holdings = e->hooks.holdings(e->hooks.ctx, h.conn);
+	for(size_t k = 0; k < holdings->size(); ++k)
+	{
+		if((*holdings)[k].target == target->second.id && (*holdings)[k].pid == h.pid)
+		{
+			(*holdings)[k] = holdings->back();
+			holdings->pop_back();
+			break;
+		}
+	}
+}
+
+/*!
+Remembers that the host has the file of the target in its cache.
+*/
+static void note_node(target_state *ts, uint32_t node)
+{
+	if(node == 0)
+		return;
+	uint32_t *end = ts->nodes + ts->node_count;
+	uint32_t *found = std::find(ts->nodes, end, node);
+	if(found == end)
+	{
+		if(ts->node_count < LOCALITY_NODES)
+		{
+			ts->nodes[ts->node_count++] = node;
+			return;
+		}
+		found = ts->nodes; // the oldest one is forgotten
+	}
+	std::copy(found + 1, end, found);
+	ts->nodes[ts->node_count - 1] = node;
+}
+
+static void erase_if_idle(decision_engine *e, target_entry *target)
+{
+	auto &ts = target->second;
+	// Targets of the graph are kept, their edges are not known anywhere else; deferred ones until engine_promote() takes them
+	if(!ts.ready && !ts.writing && !ts.deferred && ts.waiters.empty() && ts.readers.empty() && ts.inputs.empty() && ts.dependents.empty())
+	{
+		auto hashed = e->hashes.find(ts.hash);
+		if(hashed != e->hashes.end() && hashed->second == ts.id)
+			e->hashes.erase(hashed);
+		e->symbols[ts.id] = nullptr;
+		e->free_symbols.push_back(ts.id);
+		e->targets.erase(e->targets.find(target->first));
+	}
+}
+
+/*!
+Makes ready target the most recently used one.
+*/
+static void list_hottest(decision_engine *e, target_state &ts)
+{
+	ts.newer = nullptr;
+	ts.older = e->hottest;
+	if(e->hottest != nullptr)
+		e->hottest->newer = &ts;
+	else
+		e->coldest = &ts;
+	e->hottest = &ts;
+}
+
+static void unlist(decision_engine *e, target_state &ts)
+{
+	if(ts.newer != nullptr)
+		ts.newer->older = ts.older;
+	else
+		e->hottest = ts.older;
+	if(ts.older != nullptr)
+		ts.older->newer = ts.newer;
+	else
+		e->coldest = ts.newer;
+	ts.newer = ts.older = nullptr;
+}
+
+/*!
+The file of the target is gone, or is going to be deleted.
+*/
+static void make_unready(decision_engine *e, target_state &ts)
+{
+	ts.ready = false;
+	e->ready_bytes -= ts.size;
+	ts.size = 0;
+	unlist(e, ts);
+}
+
+/*!
+The file of the target exists now. 'size' is 0 if not known.
+*/
+static void make_ready(decision_engine *e, target_state &ts, uint64_t size)
+{
+	if(ts.ready)
+		make_unready(e, ts);
+	ts.ready = true;
+	ts.size = size;
+	e->ready_bytes += size;
+	list_hottest(e, ts);
+}
+
+/*!
+Creates table entry for the target and gives it a symbol.
+\param[in] e Engine.
+\param[in] name Target name, may point into receive buffer.
+\returns new entry
+*/
+static target_entry *add_target(decision_engine *e, string_view name)
+{
+	// Key has to refer to the string owned by the table entry, not to the receive buffer
+	auto node = e->targets.extract(e->targets.emplace(std::piecewise_construct, std::forward_as_tuple(name), std::forward_as_tuple(&e->pool)).first);
+	node.mapped().name.assign(name);
+	node.key() = node.mapped().name;
+	target_entry *target = &*e->targets.insert(std::move(node)).position;
+
+	if(e->free_symbols.empty())
+	{
+		target->second.id = (uint32_t)e->symbols.size();
+		e->symbols.push_back(target);
+	}
+	else
+	{
+		target->second.id = e->free_symbols.back();
+		e->free_symbols.pop_back();
+		e->symbols[target->second.id] = target;
+	}
+	target->second.hash = target_hash(name);
+	e->hashes.emplace(target->second.hash, target->second.id);
+	return target;
+}
+
+static void start_lease(decision_engine *e, target_state &ts)
+{
+	if(e->lease_ticks == 0)
+		return;
+	ts.lease.owner = &ts;
+	ts.lease_deadline = wheel_tick(e->now_us) + e->lease_ticks;
+	wheel_add(&e->wheel, &ts.lease, ts.lease_deadline, wheel_tick(e->now_us));
+}
+
+/*!
+Makes worker the writer of the target. Writer has to send BEAT before its lease runs out, otherwise WRIT is given to somebody else.
+'admitted' tells that the writer took a writer slot, which is given back when it stops writing.
+*/
+static void grant(decision_engine *e, target_entry *target, const holder &h, bool admitted)
+{
+	auto &ts = target->second;
+	ts.writing = true;
+	ts.admitted = admitted;
+	ts.writer = h;
+	ts.writer.since = e->now_us;
+	ts.writer_node = h.node;
+	note_node(&ts, h.node);
+	report(e, ENGINE_GRANTED, ts.writer, target);
+	start_lease(e, ts);
+}
+
+/*!
+Ends the role of the writer: its lease is cancelled and its writer slot is free again.
+*/
+static void stop_writing(decision_engine *e, target_state &ts)
+{
+	ts.writing = false;
+	wheel_remove(&e->wheel, &ts.lease);
+	if(ts.admitted)
+		e->hooks.leave(e->hooks.ctx, ts.writer.node);
+	ts.admitted = false;
+	ts.evicting = false;
+}
+
+/*!
+Queues the target for engine_promote(): its next writer waits for a writer slot.
+*/
+static void defer(decision_engine *e, target_entry *target)
+{
+	if(target->second.deferred)
+		return;
+	target->second.deferred = true;
+	e->deferred.push_back(target->second.id);
+}
+
+/*!
+Gives WRIT to the first waiter that is still connected. Without a free writer slot the waiter keeps its place
+and the target is deferred.
+\returns false if nobody waits
+*/
+static bool grant_next_waiter(decision_engine *e, target_entry *target)
+{
+	auto &ts = target->second;
+	while(!ts.waiters.empty())
+	{
+		holder next = ts.waiters.front();
+		if(!e->hooks.alive(e->hooks.ctx, next.conn))
+		{
+			ts.waiters.pop_front();
+			--e->waiters;
+			drop_holding(e, target, next);
+			continue;
+		}
+		if(!e->hooks.admit(e->hooks.ctx, next.node))
+		{
+			defer(e, target);
+			return true;
+		}
+		ts.waiters.pop_front();
+		--e->waiters;
+		report(e, ENGINE_ANSWER, next, target, OP_WRIT, true);
+		grant(e, target, next, true);
+		return true;
+	}
+	return false;
+}
+
+/*!
+Gives READ to waiters of a ready target: to all of them, or as many as read tokens allow.
+In wave mode the next wave is scheduled while somebody still waits.
+\param[in] e Engine.
+\param[in] target Ready target.
+*/
+static void release_readers(decision_engine *e, target_entry *target)
+{
+	auto &ts = target->second;
+	size_t released = 0;
+	while(!ts.waiters.empty())
+	{
+		if(e->read_tokens != 0 && (e->wave_us != 0 ? released == e->read_tokens : ts.readers.size() >= e->read_tokens))
+			break;
+		holder next = ts.waiters.front();
+		ts.waiters.pop_front();
+		--e->waiters;
+		if(!e->hooks.alive(e->hooks.ctx, next.conn))
+		{
+			drop_holding(e, target, next);
+			continue;
+		}
+		report(e, ENGINE_ANSWER, next, target, OP_READ, true);
+		note_node(&ts, next.node);
+		ts.readers.push_back(next);
+		++released;
+	}
+	if(e->wave_us != 0 && !ts.waiters.empty())
+	{
+		ts.wave_due = e->now_us + e->wave_us;
+		e->waves.push_back({ts.wave_due, ts.id});
+	}
+}
+
+/*!
+A reader is gone: with read tokens, its token goes to the next waiter.
+*/
+static void reader_left(decision_engine *e, target_entry *target)
+{
+	auto &ts = target->second;
+	if(e->read_tokens != 0 && e->wave_us == 0 && ts.ready && !ts.writing)
+		release_readers(e, target);
+}
+
+/*!
+\returns true if the target belongs to the graph, nobody writes or waits for it and all its inputs are ready
+*/
+static bool can_produce(const target_state &ts)
+{
+	return !ts.ready && !ts.writing && ts.inputs_missing == 0 && ts.waiters.empty() && (!ts.inputs.empty() || !ts.dependents.empty());
+}
+
+/*!
+Queues the target for WORK if it can be written now.
+*/
+static void check_producible(decision_engine *e, target_entry *target)
+{
+	auto &ts = target->second;
+	if(ts.producible || !can_produce(ts))
+		return;
+	ts.producible = true;
+	e->producible.push_back(ts.id);
+}
+
+/*!
+One input of the target became ready, or is not ready anymore. When the last missing input is ready,
+the first waiter gets WRIT, or the target is queued for WORK if nobody waits.
+*/
+static void input_changed(decision_engine *e, target_entry *target, bool ready)
+{
+	auto &ts = target->second;
+	if(!ready)
+		++ts.inputs_missing;
+	else if(ts.inputs_missing != 0)
+		--ts.inputs_missing;
+	if(ts.inputs_missing == 0 && !ts.ready && !ts.writing && !grant_next_waiter(e, target))
+		check_producible(e, target);
+}
+
+/*!
+Tells a dependent target about its input: directly if this engine keeps it, through the owner otherwise.
+*/
+static void tell_dependent(decision_engine *e, target_entry *input, uint64_t dependent, bool ready)
+{
+	auto found = e->hashes.find(dependent);
+	if(found != e->hashes.end())
+	{
+		input_changed(e, e->symbols[found->second], ready);
+		return;
+	}
+	engine_event ev = {ready ? ENGINE_INPUT_READY : ENGINE_INPUT_GONE, 0, 0, OP_NONE, false, 0, 0, input, dependent};
+	e->hooks.event(e->hooks.ctx, ev);
+}
+
+static void tell_dependents(decision_engine *e, target_entry *target, bool ready)
+{
+	for(uint64_t dependent : target->second.dependents)
+		tell_dependent(e, target, dependent, ready);
+}
+
+/*!
+Hands the target over to the first waiter after its writer is gone.
+If nobody waits - target is forgotten, unless it belongs to the graph: then it can be handed out by WORK again.
+A worker that deleted an evicted file is done with it the same way, that is reported as ENGINE_EVICTED.
+\param[in] e Engine.
+\param[in] target Target whose writer is gone.
+\param[in] why ENGINE_LOST or ENGINE_EXPIRED.
+*/
+static void promote_waiter(decision_engine *e, target_entry *target, engine_event_type why)
+{
+	auto &ts = target->second;
+	bool evicting = ts.evicting;
+	stop_writing(e, ts);
+	report(e, evicting ? ENGINE_EVICTED : why, ts.writer, target);
+	if(ts.inputs_missing != 0 || !grant_next_waiter(e, target))
+		check_producible(e, target);
+	erase_if_idle(e, target);
+}
+
+/*!
+Prepares empty engine, forgetting all targets it had.
+\param[out] e Engine.
+\param[in] hooks Services of the owner.
+\param[in] lease_ticks Writer lease in timer ticks, 0 - no leases.
+\param[in] now_us Current time.
+*/
+void engine_init(decision_engine *e, const engine_hooks &hooks, uint64_t lease_ticks, uint64_t now_us)
+{
+	e->hooks = hooks;
+	e->lease_ticks = lease_ticks;
+	e->read_tokens = 0;
+	e->wave_us = 0;
+	e->now_us = now_us;
+	e->waiters = 0;
+	e->targets.clear();
+	e->symbols.clear();
+	e->free_symbols.clear();
+	e->hashes.clear();
+	e->waves.clear();
+	e->producible.clear();
+	e->deferred.clear();
+	e->hottest = e->coldest = nullptr;
+	e->ready_bytes = 0;
+	wheel_init(&e->wheel, wheel_tick(now_us));
+}
+
+/*!
+Fills the table with ready targets restored from journal or found on disk.
+\param[in] e Engine.
+\param[in] ready Target names.
+*/
+void engine_preload(decision_engine *e, const vector <string> &ready)
+{
+	e->targets.reserve(e->targets.size() + ready.size());
+	for(auto &name : ready)
+	{
+		// Journal and reuse directory may both know the target
+		auto found = e->targets.find(name);
+		auto &ts = (found == e->targets.end() ? *add_target(e, name) : *found).second;
+		if(!ts.ready)
+			make_ready(e, ts, 0);
+	}
+}
+
+/*!
+Restores targets that were being written when the former primary scheduler was lost.
+Their writers are not connected yet (conn 0), so nobody else gets WRIT until they send DONE,
+or their lease runs out. A writer becomes connected again with its next request or BEAT.
+A worker that was deleting the file of an evicted target holds it the same way, its DONE does not make the target ready.
+\param[in] e Engine.
+\param[in] writers Target names and writer process ids.
+*/
+void engine_preload_writers(decision_engine *e, const vector <taken_writer> &writers)
+{
+	for(auto &w : writers)
+	{
+		auto found = e->targets.find(w.target);
+		target_entry *target = found == e->targets.end() ? add_target(e, w.target) : &*found;
+		if(target->second.writing)
+			continue;
+		target->second.evicting = w.evicting;
+		grant(e, target, {0, w.pid, 0, e->now_us, 0}, false);
+	}
+}
+
+/*!
+Gives the writer taken over from the former primary its new connection.
+\returns true if 'pid' is such a writer of the target
+*/
+static bool adopt_writer(decision_engine *e, target_entry *target, uint64_t conn, int pid, uint64_t tag, uint32_t node)
+{
+	auto &ts = target->second;
+	if(!ts.writing || ts.writer.conn != 0 || ts.writer.pid != pid)
+		return false;
+	ts.writer.conn = conn;
+	ts.writer.tag = tag;
+	if(node != 0)
+	{
+		ts.writer.node = ts.writer_node = node;
+		note_node(&ts, node);
+	}
+	add_holding(e, target, ts.writer);
+	return true;
+}
+
+/*!
+Makes decision on READ or WRIT request.
+If file is being generated - WAIT, if it is readable - READ, otherwise requested operation is granted.
+\param[in] e Engine.
+\param[in] conn Connection id.
+\param[in] pid Worker process id.
+\param[in] operation OP_READ or OP_WRIT.
+\param[in] target Target name.
+\param[in] tag Owner's data, given back with every answer to this request.
+\param[in] node Host of the worker, 0 if unknown.
+*/
+void engine_request(decision_engine *e, uint64_t conn, int pid, op_code operation, string_view target_name, uint64_t tag, uint32_t node)
+{
+	// Nobody is going to read the answer, so do not grant anything to closed connection
+	if(!e->hooks.alive(e->hooks.ctx, conn))
+		return;
+
+	auto found = e->targets.find(target_name);
+	target_entry *target;
+	op_code answer;
+	if(found == e->targets.end())
+	{
+		target = add_target(e, target_name);
+		answer = operation == OP_WRIT ? OP_WRIT : OP_READ;
+	}
+	else
+	{
+		target = &*found;
+		// Writer of the former primary asks again after reconnecting: it still holds WRIT
+		if(adopt_writer(e, target, conn, pid, tag, node))
+		{
+			report(e, ENGINE_ANSWER, target->second.writer, target, OP_WRIT);
+			return;
+		}
+		// Readers of a finished target that still wait for their token are not overtaken,
+		// a target of the graph waits for its inputs and is decided as unknown one when they are ready
+		auto &ts = target->second;
+		if(ts.writing || !ts.waiters.empty() || (!ts.ready && ts.inputs_missing != 0))
+			answer = OP_WAIT;
+		else if(!ts.ready && (!ts.inputs.empty() || !ts.dependents.empty()))
+			answer = operation == OP_WRIT ? OP_WRIT : OP_READ;
+		else
+			answer = OP_READ;
+	}
+
+	// Writer without a free slot waits as if somebody else was writing, and gets WRIT when a slot is free
+	bool deferred = answer == OP_WRIT && !e->hooks.admit(e->hooks.ctx, node);
+	if(deferred)
+		answer = OP_WAIT;
+	holder h = {conn, pid, node, e->now_us, tag};
+	report(e, ENGINE_ANSWER, h, target, answer);
+	auto &ts = target->second;
+	if(answer == OP_WRIT)
+		grant(e, target, h, true);
+	else if(answer == OP_WAIT)
+	{
+		ts.waiters.push_back(h);
+		++e->waiters;
+		if(deferred)
+			defer(e, target);
+	}
+	else
+	{
+		note_node(&ts, node);
+		ts.readers.push_back(h);
+		if(ts.ready && e->hottest != &ts)
+		{
+			unlist(e, ts);
+			list_hottest(e, ts);
+		}
+	}
+	add_holding(e, target, h);
+}
+
+/*!
+Releases everything worker 'pid' holds on the target. When it was the writer - all waiters are advised to READ.
+When it was deleting the file of an evicted target - the first waiter gets WRIT.
+\param[in] e Engine.
+\param[in] pid Worker process id.
+\param[in] target_name Target name.
+\param[in] size Bytes of the written file, 0 if not known.
+*/
+void engine_done(decision_engine *e, int pid, string_view target_name, uint64_t size)
+{
+	auto found = e->targets.find(target_name);
+	if(found == e->targets.end())
+		return;
+
+	target_entry *target = &*found;
+	auto &ts = target->second;
+
+	size_t readers = ts.readers.size();
+	for(auto iter = ts.readers.begin(); iter != ts.readers.end();)
+	{
+		if(iter->pid == pid)
+		{
+			drop_holding(e, target, *iter);
+			iter = ts.readers.erase(iter);
+		}
+		else
+			++iter;
+	}
+
+	for(auto iter = ts.waiters.begin(); iter != ts.waiters.end();)
+	{
+		if(iter->pid == pid)
+		{
+			drop_holding(e, target, *iter);
+			iter = ts.waiters.erase(iter);
+			--e->waiters;
+		}
+		else
+			++iter;
+	}
+
+	if(ts.writing && ts.writer.pid == pid && ts.evicting)
+	{
+		drop_holding(e, target, ts.writer);
+		promote_waiter(e, target, ENGINE_LOST);
+		return;
+	}
+	if(ts.writing && ts.writer.pid == pid)
+	{
+		drop_holding(e, target, ts.writer);
+		stop_writing(e, ts);
+		make_ready(e, ts, size);
+		report(e, ENGINE_FINISHED, ts.writer, target);
+		release_readers(e, target);
+		tell_dependents(e, target, true);
+	}
+	else if(ts.readers.size() < readers)
+		reader_left(e, target);
+
+	erase_if_idle(e, target);
+}
+
+/*!
+Renews lease of the writer. Heartbeat of anybody else is ignored.
+\param[in] e Engine.
+\param[in] conn Connection id.
+\param[in] pid Worker process id.
+\param[in] target_name Target name.
+*/
+void engine_beat(decision_engine *e, uint64_t conn, int pid, string_view target_name)
+{
+	auto found = e->targets.find(target_name);
+	if(found == e->targets.end())
+		return;
+	auto &ts = found->second;
+	adopt_writer(e, &*found, conn, pid, 0, 0);
+	// Timer is not moved: when it fires it is scheduled again for the new deadline
+	if(ts.writing && ts.writer.pid == pid && ts.writer.conn == conn)
+		ts.lease_deadline = wheel_tick(e->now_us) + e->lease_ticks;
+}
+
+/*!
+Takes WRIT away from writers that stopped sending BEAT and hands it over to the next waiter.
+\param[in] e Engine.
+*/
+void engine_expire(decision_engine *e)
+{
+	while(!e->waves.empty() && e->waves.front().due_us <= e->now_us)
+	{
+		// Target may be gone or written again since the wave was scheduled
+		reader_wave wave = e->waves.front();
+		e->waves.pop_front();
+		target_entry *target = e->symbols[wave.target];
+		if(target == nullptr || target->second.wave_due != wave.due_us || target->second.writing || !target->second.ready)
+			continue;
+		release_readers(e, target);
+		erase_if_idle(e, target);
+	}
+
+	wheel_advance(&e->wheel, wheel_tick(e->now_us), &e->expired);
+	for(auto lease : e->expired)
+	{
+		auto &ts = *lease->owner;
+		if(ts.lease_deadline > e->wheel.now)
+		{
+			wheel_add(&e->wheel, lease, ts.lease_deadline, e->wheel.now);
+			continue;
+		}
+		target_entry *target = e->symbols[ts.id];
+		drop_holding(e, target, ts.writer);
+		promote_waiter(e, target, ENGINE_EXPIRED);
+	}
+	e->expired.clear();
+}
+
+/*!
+Drops every role held by the connection. Targets whose writer was lost are handed over to the next waiter.
+\param[in] e Engine.
+\param[in] conn Closed connection id.
+*/
+void engine_disconnect(decision_engine *e, uint64_t conn)
+{
+	auto holdings = e->hooks.holdings(e->hooks.ctx, conn);
+
+	while(!holdings->empty())
+	{
+		holding hd = holdings->back();
+		holdings->pop_back();
+		target_entry *target = e->symbols[hd.target];
+		auto &ts = target->second;
+
+		if(ts.writing && ts.writer.conn == conn && ts.writer.pid == hd.pid)
+		{
+			promote_waiter(e, target, ENGINE_LOST);
+			continue;
+		}
+
+		bool removed = false;
+		for(auto iter = ts.readers.begin(); iter != ts.readers.end(); ++iter)
+		{
+			if(iter->conn == conn && iter->pid == hd.pid)
+			{
+				ts.readers.erase(iter);
+				removed = true;
+				reader_left(e, target);
+				break;
+			}
+		}
+		if(!removed)
+		{
+			for(auto iter = ts.waiters.begin(); iter != ts.waiters.end(); ++iter)
+			{
+				if(iter->conn == conn && iter->pid == hd.pid)
+				{
+					ts.waiters.erase(iter);
+					--e->waiters;
+					break;
+				}
+			}
+		}
+		erase_if_idle(e, target);
+	}
+}
+
+/*!
+Applies change on disk to the target. A target that is being written is left to its writer.
+\param[in] e Engine.
+\param[in] name Target name.
+\param[in] exists File appeared (true) or was deleted (false).
+*/
+void engine_file(decision_engine *e, string_view name, bool exists)
+{
+	auto found = e->targets.find(name);
+	holder nobody = {0, 0, 0, 0, 0};
+	if(exists)
+	{
+		target_entry *target = found == e->targets.end() ? add_target(e, name) : &*found;
+		if(target->second.ready || target->second.writing)
+			return;
+		make_ready(e, target->second, 0);
+		report(e, ENGINE_FOUND, nobody, target);
+		// Deferred writers and targets waiting for inputs have nothing to write now
+		release_readers(e, target);
+		tell_dependents(e, target, true);
+	}
+	else if(found != e->targets.end() && found->second.ready && !found->second.writing)
+	{
+		make_unready(e, found->second);
+		report(e, ENGINE_FORGOTTEN, nobody, &*found);
+		// Readers still waiting for a token have nothing to read now, so one of them generates it again
+		if(found->second.inputs_missing != 0 || !grant_next_waiter(e, &*found))
+			check_producible(e, &*found);
+		tell_dependents(e, &*found, false);
+		erase_if_idle(e, &*found);
+	}
+}
+
+/*!
+Adds an input to the target: the target is not written before the input is ready. The input is counted as missing
+until the engine that keeps it says otherwise: the owner passes the edge on to it, see engine_add_dependent().
+\param[in] e Engine.
+\param[in] target_name Target name.
+\param[in] input target_hash() of the input.
+\returns false if the target had this input already
+*/
+bool engine_add_input(decision_engine *e, string_view target_name, uint64_t input)
+{
+	auto found = e->targets.find(target_name);
+	auto &ts = (found == e->targets.end() ? add_target(e, target_name) : &*found)->second;
+	if(std::find(ts.inputs.begin(), ts.inputs.end(), input) != ts.inputs.end())
+		return false;
+	ts.inputs.push_back(input);
+	++ts.inputs_missing;
+	return true;
+}
+
+/*!
+Remembers that the input is needed by the dependent target, which is told at once if the input is ready.
+An input that is not ready and not written can be handed out by WORK.
+\param[in] e Engine.
+\param[in] input_name Name of the input.
+\param[in] dependent target_hash() of the dependent target.
+*/
+void engine_add_dependent(decision_engine *e, string_view input_name, uint64_t dependent)
+{
+	auto found = e->targets.find(input_name);
+	target_entry *input = found == e->targets.end() ? add_target(e, input_name) : &*found;
+	auto &dependents = input->second.dependents;
+	if(std::find(dependents.begin(), dependents.end(), dependent) != dependents.end())
+		return;
+	dependents.push_back(dependent);
+	if(input->second.ready)
+		tell_dependent(e, input, dependent, true);
+	else
+		check_producible(e, input);
+}
+
+/*!
+Applies change of an input kept by another engine, see ENGINE_INPUT_READY.
+\param[in] e Engine.
+\param[in] target target_hash() of the dependent target.
+\param[in] ready Input is ready (true) or not anymore (false).
+*/
+void engine_input(decision_engine *e, uint64_t target, bool ready)
+{
+	auto found = e->hashes.find(target);
+	if(found != e->hashes.end())
+		input_changed(e, e->symbols[found->second], ready);
+}
+
+/*!
+Makes worker the writer of a target of the graph that can be written now, the oldest one queued.
+\param[in] e Engine.
+\param[in] conn Connection id.
+\param[in] pid Worker process id.
+\param[in] tag Owner's data, given back with the answer.
+\param[in] node Host of the worker, 0 if unknown.
+\returns false if there is nothing to write or no writer slot for the node, no answer is given then
+*/
+bool engine_work(decision_engine *e, uint64_t conn, int pid, uint64_t tag, uint32_t node)
+{
+	if(!e->hooks.alive(e->hooks.ctx, conn))
+		return true;
+	while(!e->producible.empty())
+	{
+		target_entry *target = e->symbols[e->producible.front()];
+		e->producible.pop_front();
+		// Symbol may belong to another target by now, or the target was written meanwhile
+		if(target == nullptr)
+			continue;
+		target->second.producible = false;
+		if(!can_produce(target->second))
+			continue;
+		if(!e->hooks.admit(e->hooks.ctx, node))
+		{
+			// Stays first for the next worker
+			target->second.producible = true;
+			e->producible.push_front(target->second.id);
+			return false;
+		}
+		holder h = {conn, pid, node, e->now_us, tag};
+		report(e, ENGINE_ANSWER, h, target, OP_WORK);
+		grant(e, target, h, true);
+		add_holding(e, target, h);
+		return true;
+	}
+	return false;
+}
+
+/*!
+Gives WRIT to deferred writers while writer slots are free, oldest first. The owner calls it when slots were given back,
+by this engine or by another one.
+\param[in] e Engine.
+*/
+void engine_promote(decision_engine *e)
+{
+	for(size_t n = e->deferred.size(); n != 0 && !e->deferred.empty(); --n)
+	{
+		target_entry *target = e->symbols[e->deferred.front()];
+		e->deferred.pop_front();
+		if(target == nullptr)
+			continue;
+		auto &ts = target->second;
+		ts.deferred = false;
+		// Found on disk or waiting for inputs again meanwhile
+		if(ts.writing || ts.ready || ts.inputs_missing != 0)
+			continue;
+		if(!grant_next_waiter(e, target))
+			check_producible(e, target);
+		erase_if_idle(e, target);
+	}
+}
+
+/*!
+Hands the least recently used ready target that nobody reads or waits for to a worker that deletes its file.
+The target is forgotten at once, the worker holds it as its writer until DONE tells that the file is gone,
+so nobody writes the file again meanwhile. The owner decides when files take too much space.
+\param[in] e Engine.
+\param[in] conn Connection id.
+\param[in] pid Worker process id.
+\param[in] tag Owner's data, given back with the answer.
+\param[in] node Host of the worker, 0 if unknown.
+\returns false if every ready target is in use, no answer is given then
+*/
+bool engine_evict(decision_engine *e, uint64_t conn, int pid, uint64_t tag, uint32_t node)
+{
+	if(!e->hooks.alive(e->hooks.ctx, conn))
+		return true;
+	// Targets in use were moved to the other end by their READ, so only a few are skipped
+	target_state *ts = e->coldest;
+	while(ts != nullptr && (!ts->readers.empty() || !ts->waiters.empty()))
+		ts = ts->newer;
+	if(ts == nullptr)
+		return false;
+
+	target_entry *target = e->symbols[ts->id];
+	holder nobody = {0, 0, 0, 0, 0};
+	make_unready(e, *ts);
+	report(e, ENGINE_FORGOTTEN, nobody, target);
+	holder h = {conn, pid, node, e->now_us, tag};
+	report(e, ENGINE_ANSWER, h, target, OP_EVCT);
+	ts->writing = true;
+	ts->evicting = true;
+	ts->writer = h;
+	// Journal and standby hold the target for the worker, not as a file being written
+	report(e, ENGINE_GRANTED, h, target);
+	start_lease(e, *ts);
+	add_holding(e, target, h);
+	tell_dependents(e, target, false);
+	return true;
+}
+
+/*!
+Finds a target named before by its hash.
+\param[in] e Engine.
+\param[in] hash target_hash() of the name.
+\returns name, empty if no such target is known
+*/
+string_view engine_name(const decision_engine *e, uint64_t hash)
+{
+	auto found = e->hashes.find(hash);
+	return found == e->hashes.end() ? string_view() : e->symbols[found->second]->first;
+}
+
+/*!
+Tells where the file of the target is: whether the asking host has it cached and which host wrote it.
+\param[in] e Engine.
+\param[in] name Target name.
+\param[in] node Host of the asking worker.
+\returns hint, all fields are empty for unknown target
+*/
+locality_hint engine_locality(const decision_engine *e, string_view name, uint32_t node)
+{
+	auto found = e->targets.find(name);
+	if(found == e->targets.end())
+		return {false, false, 0};
+	auto &ts = found->second;
+	bool local = node != 0 && ts.ready && std::find(ts.nodes, ts.nodes + ts.node_count, node) != ts.nodes + ts.node_count;
+	return {ts.ready, local, ts.writer_node};
+}
+
+/*!
+\returns milliseconds until the engine has something to do on its own: next lease tick or wave of readers, -1 if nothing
+*/
+int engine_timeout(const decision_engine *e)
+{
+	int lease = wheel_timeout(&e->wheel);
+	if(e->waves.empty())
+		return lease;
+	uint64_t due = e->waves.front().due_us;
+	int wave = due <= e->now_us ? 0 : (int)((due - e->now_us + 999) / 1000);
+	return lease < 0 ? wave : std::min(lease, wave);
+}
@@ -0,0 +1,264 @@
+/** @file decision_engine.h*/
+/** READ/WRIT/WAIT decisions on targets, independent of sockets, threads and clocks.
+**
+** The engine keeps the table of targets and writer leases. Its owner feeds it with requests,
+** disconnects and file changes, and gets answers and state transitions back through engine_hooks.
+** Time is whatever the owner puts into 'now_us', so the same input always gives the same decisions.
+** Targets, their names and queues are allocated from a pool of the engine: blocks of forgotten targets
+** are reused by new ones, so a busy engine does not go to the heap for every request.
+ */
+#ifndef DECISION_ENGINE_H
+#define DECISION_ENGINE_H
+
+#include <stdint.h>
+#include <deque>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using std::string;
+using std::string_view;
+using std::vector;
+using std::deque;
+
+// Hosts remembered per target for locality hints
+#define LOCALITY_NODES 8
+// Writer leases: one tick of timer wheel and its geometry
+#define TIMER_TICK_MS 100
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+// target_hash() of the empty name
+#define TARGET_HASH_BASIS 14695981039346656037ull
+
+/*! Operations of requests and answers, resolved once when a request is parsed.
+Codes up to OP_EXIT are the ones kept in trace records.*/
+enum op_code : uint8_t
+{
+	OP_NONE,
+	OP_READ,
+	OP_WRIT,
+	OP_WAIT, ///answer only
+	OP_DONE,
+	OP_BEAT,
+	OP_EXIT, ///answer only
+	OP_HINT,
+	OP_BTCH,
+	OP_SHMR, ///connection only: switch to shared memory, see shm_channel.h
+	OP_SUBS, ///tell when the target, or any target with the prefix, becomes ready
+	OP_PREF, ///SUBS, and may be asked to warm the page cache of its node; as the answer: do it now
+	OP_NTFY, ///answer only: subscribed target is ready
+	OP_DEPS, ///inputs of a target, see engine_add_input()
+	OP_WORK, ///give WRIT on any target that can be produced now; as the answer: the target granted
+	OP_IDLE, ///answer only: nothing can be produced now
+	OP_EVCT, ///answer only to WORK: delete the file of this cold target, then send DONE, see engine_evict()
+	OP_OTHER ///unknown operation
+};
+
+//! Connection and worker process that hold a role on a target.
+struct holder
+{
+	uint64_t conn; ///0 - writer taken over from the former primary, not connected yet
+	int pid;
+	uint32_t node; ///IPv4 address of the worker's host, 0 - unknown
+	uint64_t since; ///engine time when WAIT or WRIT was given
+	uint64_t tag; ///owner's data of the request, see engine_request()
+};
+
+//! Timer in a slot of timer wheel, see timer_wheel.cpp. Not scheduled when 'next' is null.
+struct wheel_timer
+{
+	wheel_timer *prev;
+	wheel_timer *next;
+	uint64_t expires; ///tick
+	struct target_state *owner; ///target whose writer lease it is
+};
+
+//! Timers of one engine.
+struct timer_wheel
+{
+	wheel_timer slots[WHEEL_LEVELS][WHEEL_SIZE]; ///list heads
+	uint64_t now; ///last processed tick
+	size_t count; ///scheduled timers
+};
+
+/*! State of a single target.
+While 'writing' is set, 'writer' generates the file and everybody else is queued in 'waiters'.
+Otherwise the file is readable and 'readers' keep their READ answers until DONE.
+Target is erased from the table as soon as nobody holds it, unless its file was generated ('ready').
+Ready targets are listed from the most recently used one to the least recently used one.*/
+struct target_state
+{
+	explicit target_state(std::pmr::memory_resource *pool) : name(pool), waiters(pool), readers(pool), inputs(pool), dependents(pool) {}
+
+	std::pmr::string name; ///storage for the key of the table
+	uint32_t id = 0; ///symbol of the target, see decision_engine::symbols
+	uint64_t hash = 0; ///target_hash() of the name
+	bool ready = false; ///writer reported DONE, file exists
+	bool writing = false;
+	holder writer = {};
+	wheel_timer lease = {}; ///expires when writer stops sending BEAT
+	uint64_t lease_deadline = 0; ///tick, moved forward by BEAT
+	std::pmr::deque <holder> waiters;
+	std::pmr::vector <holder> readers;
+	uint64_t wave_due = 0; ///engine time of the next wave of readers, see reader_wave
+	uint32_t writer_node = 0; ///host of the last writer, 0 - unknown
+	uint32_t node_count = 0;
+	uint32_t nodes[LOCALITY_NODES] = {}; ///hosts that wrote or read the file, so have it cached, most recent last
+	uint64_t requests = 0; ///READ and WRIT requests while the target is in the table, for metrics
+	uint64_t waits = 0; ///WAIT answers given
+	std::pmr::vector <uint64_t> inputs; ///target_hash() of targets that have to be ready before this one is written
+	std::pmr::vector <uint64_t> dependents; ///target_hash() of targets that have this one as input, of any engine
+	uint32_t inputs_missing = 0; ///inputs that are not ready
+	bool producible = false; ///listed in decision_engine::producible
+	bool admitted = false; ///writer holds a writer slot, see engine_hooks::admit
+	bool deferred = false; ///listed in decision_engine::deferred
+	bool evicting = false; ///'writer' deletes the file, see engine_evict()
+	uint64_t size = 0; ///bytes of the file as told by DONE of its writer, 0 - unknown
+	target_state *newer = nullptr; ///list of ready targets, see decision_engine::coldest
+	target_state *older = nullptr;
+};
+
+typedef std::pmr::unordered_map <string_view, target_state> target_table;
+typedef target_table::value_type target_entry;
+
+//! Back reference from a connection to the target it holds a role on.
+struct holding
+{
+	uint32_t target; ///symbol of the target
+	int pid;
+};
+
+enum engine_event_type
+{
+	ENGINE_ANSWER, ///'answer' has to be sent to the connection
+	ENGINE_GRANTED, ///worker became the writer, or deletes the file of an evicted target if the target is 'evicting'
+	ENGINE_FINISHED, ///writer reported DONE, file is ready
+	ENGINE_LOST, ///writer disconnected before DONE
+	ENGINE_EXPIRED, ///writer did not renew its lease in time
+	ENGINE_FOUND, ///file appeared on disk, target is ready
+	ENGINE_FORGOTTEN, ///file was deleted, target is not ready anymore
+	ENGINE_EVICTED, ///worker deleting the file of an evicted target sent DONE or is gone, nobody holds the target now
+	ENGINE_INPUT_READY, ///target is ready and it is an input of 'dependent', which is not in this engine
+	ENGINE_INPUT_GONE ///target is not ready anymore, see ENGINE_INPUT_READY
+};
+
+//! Worker holding a target when the former primary scheduler was lost, see engine_preload_writers().
+struct taken_writer
+{
+	string target;
+	int pid;
+	bool evicting; ///deletes the file, see engine_evict()
+};
+
+//! Where the file of a target is, see engine_locality().
+struct locality_hint
+{
+	bool ready; ///file exists
+	bool local; ///the asking host wrote or read it
+	uint32_t writer_node; ///host of the last writer, 0 - unknown
+};
+
+//! Decision or state transition reported to the owner of the engine.
+struct engine_event
+{
+	engine_event_type type;
+	uint64_t conn; ///connection of the worker, 0 for file changes
+	int pid;
+	op_code answer; ///OP_READ, OP_WRIT, OP_WAIT, OP_WORK or OP_EVCT, ENGINE_ANSWER only
+	bool queued; ///answer to a worker that was told WAIT before
+	uint64_t since; ///WAIT of the queued worker or WRIT of the finished / lost writer, engine time
+	uint64_t tag; ///of the request that is answered
+	target_entry *target; ///valid during the callback only
+	uint64_t dependent; ///target_hash() of the dependent target, ENGINE_INPUT_READY and ENGINE_INPUT_GONE only
+};
+
+/*! What the engine needs from its owner. Connection state stays with the owner:
+the engine only asks whether an answer can still be delivered and where the roles of a connection are kept.
+Writer slots are counted by the owner too, they may be shared by engines of all shards.*/
+struct engine_hooks
+{
+	void *ctx; ///passed to every hook
+	bool (*alive)(void *ctx, uint64_t conn);
+	vector <holding> *(*holdings)(void *ctx, uint64_t conn);
+	void (*event)(void *ctx, const engine_event &e);
+	bool (*admit)(void *ctx, uint32_t node); ///takes a writer slot of the node, false if there is none free
+	void (*leave)(void *ctx, uint32_t node); ///gives the slot back when the writer is done or gone
+};
+
+/*! Next wave of READ answers on a target with many waiters.
+Symbol may be reused by another target meanwhile, the wave is valid only while it matches target_state::wave_due.*/
+struct reader_wave
+{
+	uint64_t due_us; ///engine time
+	uint32_t target; ///symbol
+};
+
+//! Targets of one shard.
+struct decision_engine
+{
+	std::pmr::unsynchronized_pool_resource pool; ///targets and their queues, destroyed after them
+	target_table targets{&pool};
+	vector <target_entry *> symbols; ///targets by their 32-bit ids, nullptr for free ones
+	vector <uint32_t> free_symbols;
+	std::pmr::unordered_map <uint64_t, uint32_t> hashes{&pool}; ///symbols by target_hash(), the first of colliding names wins
+	timer_wheel wheel; ///writer leases
+	uint64_t lease_ticks; ///0 - writer keeps WRIT until it disconnects
+	size_t read_tokens; ///waiters that get READ at once after DONE, 0 - all of them
+	uint64_t wave_us; ///0 - next waiter gets READ when a reader sends DONE, otherwise read_tokens more every wave_us
+	deque <reader_wave> waves; ///ordered by time, one interval apart
+	deque <uint32_t> producible; ///symbols of targets that can be written now, checked again when taken
+	deque <uint32_t> deferred; ///symbols of targets whose next writer waits for a writer slot, oldest first
+	target_state *hottest; ///ready target used last
+	target_state *coldest; ///ready target not used for the longest time
+	uint64_t ready_bytes; ///sizes of the files of ready targets, as far as they are known
+	uint64_t now_us; ///current time, set by the owner before calls
+	size_t waiters; ///workers told WAIT that did not get their answer yet
+	engine_hooks hooks;
+	vector <wheel_timer *> expired;
+};
+
+//! One character of target_hash(), the hash of every beginning of a name comes on the way.
+static inline uint64_t target_hash_step(uint64_t h, char c)
+{
+	return (h ^ (unsigned char)c) * 1099511628211ull;
+}
+
+// decision_engine.cpp
+void engine_init(decision_engine *e, const engine_hooks &hooks, uint64_t lease_ticks, uint64_t now_us);
+void engine_preload(decision_engine *e, const vector <string> &ready);
+void engine_preload_writers(decision_engine *e, const vector <taken_writer> &writers);
+uint64_t target_hash(string_view target);
+op_code op_parse(string_view text);
+const char *op_name(op_code op);
+void engine_request(decision_engine *e, uint64_t conn, int pid, op_code operation, string_view target, uint64_t tag = 0, uint32_t node = 0);
+string_view engine_name(const decision_engine *e, uint64_t hash);
+locality_hint engine_locality(const decision_engine *e, string_view target, uint32_t node);
+void engine_done(decision_engine *e, int pid, string_view target, uint64_t size = 0);
+void engine_beat(decision_engine *e, uint64_t conn, int pid, string_view target);
+void engine_expire(decision_engine *e);
+void engine_disconnect(decision_engine *e, uint64_t conn);
+void engine_file(decision_engine *e, string_view target, bool exists);
+bool engine_add_input(decision_engine *e, string_view target, uint64_t input);
+void engine_add_dependent(decision_engine *e, string_view input, uint64_t dependent);
+void engine_input(decision_engine *e, uint64_t target, bool ready);
+bool engine_work(decision_engine *e, uint64_t conn, int pid, uint64_t tag, uint32_t node);
+bool engine_evict(decision_engine *e, uint64_t conn, int pid, uint64_t tag, uint32_t node);
+void engine_promote(decision_engine *e);
+int engine_timeout(const decision_engine *e);
+
+// timer_wheel.cpp
+static inline uint64_t wheel_tick(uint64_t us)
+{
+	return us / (TIMER_TICK_MS * 1000);
+}
+void wheel_init(timer_wheel *w, uint64_t now);
+void wheel_add(timer_wheel *w, wheel_timer *t, uint64_t expires, uint64_t now);
+void wheel_remove(timer_wheel *w, wheel_timer *t);
+void wheel_advance(timer_wheel *w, uint64_t now, vector <wheel_timer *> *expired);
+int wheel_timeout(const timer_wheel *w);
+
+#endif
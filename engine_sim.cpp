@@ -0,0 +1,534 @@
+/** @file engine_sim.cpp*/
+/** Runs the decision engine without sockets, on a recorded trace or on synthetic load.
+**
+** Usage: engine_sim [-l lease_seconds] [-k read_tokens [-K wave_ms]] [-Q max_writers] [-B disk_budget] [-v] trace_file
+**        engine_sim -s events [-w workers] [-t targets] [-z zipf] [-W write_fraction]
+**                   [-h hold_steps] [-x crash_rate] [-S seed] [-g fanout] [-O work_fraction] [-f file_bytes]
+**                   [-l lease_seconds] [-k read_tokens [-K wave_ms]] [-Q max_writers] [-B disk_budget] [-v]
+**
+** A trace has to be recorded with -T 2, so that every request is in it. Target names longer
+** than the 24 bytes kept in a record are told apart by their hash.
+** WORK finds nothing to write and files take more than -B bytes: a cold target is evicted, as the server does.
+** Synthetic load is a set of workers that ask for targets (uniform or Zipf popularity),
+** write files for a random number of steps and sometimes crash instead of DONE.
+** With -g every target but the first one has a more popular target as its input, each target is an input
+** of that many others. Idle workers send WORK instead of asking for a target with probability -O.
+** Writers tell -f as the size of their files. The run stops early when all workers wait for inputs nobody writes.
+** Random numbers are seeded, so runs with the same options make the same decisions.
+**
+** Prints the rate of engine calls, answers by kind and a digest of all answers:
+** the same digest on the same input means the decisions did not change. -v prints every answer.
+ */
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <unordered_set>
+#include "decision_engine.h"
+#include "trace.h"
+
+typedef std::chrono::steady_clock steady;
+
+enum worker_state
+{
+	WORKER_IDLE,
+	WORKER_READING,
+	WORKER_WRITING,
+	WORKER_WAITING
+};
+
+//! Synthetic worker, one connection each.
+struct sim_worker
+{
+	uint64_t conn;
+	int pid;
+	worker_state state;
+	unsigned target;
+	vector <holding> holdings;
+};
+
+//! Everything the simulator knows.
+struct simulation
+{
+	decision_engine engine;
+	bool verbose;
+	uint64_t digest;
+	uint64_t calls; ///engine calls
+	uint64_t answers[6]; ///READ, WRIT, WAIT, WORK, EVCT, IDLE
+	uint64_t lost;
+	uint64_t expired;
+	size_t read_tokens; ///wake-up policy after DONE, see decision_engine
+	uint64_t wave_us;
+	size_t max_writers; ///writer slots, 0 - unlimited
+	size_t writers; ///slots taken
+	bool slot_freed; ///deferred writers may be promoted
+	uint64_t disk_budget; ///bytes of ready files before WORK evicts, 0 - no limit
+	// Trace replay
+	std::unordered_map <uint64_t, vector <holding>> holdings;
+	std::unordered_set <uint64_t> open; ///connections seen and not closed yet
+	std::unordered_map <uint64_t, uint64_t> renamed; ///target_hash() of traced names by the hash of the name given to the engine
+	// Synthetic load
+	vector <sim_worker> workers;
+	std::unordered_map <string, unsigned> numbers; ///target numbers by name, for WORK and EVCT answers
+};
+
+static simulation sim;
+
+static uint64_t fnv(uint64_t h, const void *data, size_t len)
+{
+	auto bytes = (const unsigned char *)data;
+	for(size_t i = 0; i < len; ++i)
+	{
+		h ^= bytes[i];
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+static bool trace_alive(void *, uint64_t conn)
+{
+	return sim.open.count(conn) != 0;
+}
+
+static vector <holding> *trace_holdings(void *, uint64_t conn)
+{
+	return &sim.holdings[conn];
+}
+
+static bool worker_alive(void *, uint64_t conn)
+{
+	return sim.workers[conn & 0xFFFFFF].conn == conn;
+}
+
+static vector <holding> *worker_holdings(void *, uint64_t conn)
+{
+	return &sim.workers[conn & 0xFFFFFF].holdings;
+}
+
+static bool sim_admit(void *, uint32_t)
+{
+	if(sim.max_writers != 0 && sim.writers >= sim.max_writers)
+		return false;
+	++sim.writers;
+	return true;
+}
+
+static void sim_leave(void *, uint32_t)
+{
+	--sim.writers;
+	sim.slot_freed = true;
+}
+
+//! Promotes deferred writers after a writer slot was given back, as the server does at the end of an iteration.
+static void promote_deferred()
+{
+	if(!sim.slot_freed)
+		return;
+	sim.slot_freed = false;
+	engine_promote(&sim.engine);
+}
+
+static void digest_answer(uint64_t conn, int pid, op_code answer, string_view target)
+{
+	sim.digest = fnv(sim.digest, &conn, sizeof conn);
+	sim.digest = fnv(sim.digest, &pid, sizeof pid);
+	sim.digest = fnv(sim.digest, op_name(answer), 4);
+	sim.digest = fnv(sim.digest, target.data(), target.size());
+	if(sim.verbose)
+		printf("%" PRIu64 " %d %s %.*s\n", conn, pid, op_name(answer), (int)target.size(), target.data());
+}
+
+/*!
+Answers WORK as the server does: a target that can be written now, a cold target to evict when files take more
+than the disk budget, IDLE otherwise.
+\returns true if the worker got WORK or EVCT
+*/
+static bool sim_work(uint64_t conn, int pid)
+{
+	if(engine_work(&sim.engine, conn, pid, 0, 0))
+		return true;
+	if(sim.disk_budget != 0 && sim.engine.ready_bytes > sim.disk_budget && engine_evict(&sim.engine, conn, pid, 0, 0))
+		return true;
+	++sim.answers[5];
+	digest_answer(conn, pid, OP_IDLE, "");
+	return false;
+}
+
+/*!
+Counts and digests answers, passes them to synthetic workers.
+*/
+static void on_event(void *, const engine_event &e)
+{
+	if(e.type == ENGINE_LOST)
+		++sim.lost;
+	else if(e.type == ENGINE_EXPIRED)
+		++sim.expired;
+	if(e.type != ENGINE_ANSWER)
+		return;
+
+	size_t kind = e.answer == OP_READ ? 0 : e.answer == OP_WRIT ? 1 : e.answer == OP_WORK ? 3 : e.answer == OP_EVCT ? 4 : 2;
+	++sim.answers[kind];
+	digest_answer(e.conn, e.pid, e.answer, e.target->first);
+
+	if(!sim.workers.empty())
+	{
+		auto &w = sim.workers[e.conn & 0xFFFFFF];
+		w.state = kind == 0 ? WORKER_READING : kind == 2 ? WORKER_WAITING : WORKER_WRITING;
+		// WORK and EVCT name a target the worker did not ask for
+		if(kind >= 3)
+			w.target = sim.numbers[string(e.target->first)];
+	}
+}
+
+/*!
+Replays every request of a trace written by the server with -T 2.
+Runs of the server appended to the same file are replayed one after another, each from an empty engine.
+\param[in] path Trace file.
+\param[in] lease_ticks Writer lease in ticks, 0 - none.
+\returns 0 on success
+*/
+static int replay_trace(const char *path, uint64_t lease_ticks)
+{
+	FILE *file = fopen(path, "rb");
+	if(file == nullptr)
+	{
+		perror(path);
+		return -1;
+	}
+	vector <trace_record> records;
+	trace_record r;
+	while(fread(&r, sizeof r, 1, file) == 1)
+		records.push_back(r);
+	fclose(file);
+
+	engine_hooks hooks = {nullptr, trace_alive, trace_holdings, on_event, sim_admit, sim_leave};
+	auto start = steady::now();
+	for(size_t run = 0; run < records.size();)
+	{
+		if(records[run].type != TRACE_HEADER || strncmp(records[run].text, TRACE_MAGIC, sizeof r.text) != 0 || records[run].op != TRACE_VERSION)
+		{
+			fprintf(stderr, "Unknown trace format\n");
+			return -1;
+		}
+		uint64_t shards = std::max(records[run].conn, (uint64_t)1);
+		size_t end = run + 1;
+		while(end < records.size() && records[end].type != TRACE_HEADER)
+			++end;
+		// Every shard is written out separately, but targets of different shards do not depend on each other
+		std::stable_sort(records.begin() + (long)run + 1, records.begin() + (long)end,
+			[](const trace_record &a, const trace_record &b) { return a.time_ns < b.time_ns; });
+
+		sim.holdings.clear();
+		sim.open.clear();
+		sim.renamed.clear();
+		sim.writers = 0;
+		engine_init(&sim.engine, hooks, lease_ticks, records[run].time_ns / 1000);
+		sim.engine.read_tokens = sim.read_tokens;
+		sim.engine.wave_us = sim.wave_us;
+		for(size_t i = run + 1; i < end; ++i)
+		{
+			auto &rec = records[i];
+			sim.engine.now_us = rec.time_ns / 1000;
+			if(lease_ticks != 0 || sim.wave_us != 0)
+				engine_expire(&sim.engine);
+			promote_deferred();
+			if(rec.type == TRACE_CLOSE)
+			{
+				engine_disconnect(&sim.engine, rec.conn);
+				sim.holdings.erase(rec.conn);
+				sim.open.erase(rec.conn);
+				++sim.calls;
+				continue;
+			}
+			// WORK names no target, it is traced by every shard it visits: the first one is the shard of the connection
+			if(rec.type == TRACE_REQUEST && rec.op == OP_WORK)
+			{
+				if(rec.arg != 0)
+					continue;
+				sim.open.insert(rec.conn);
+				++sim.calls;
+				sim_work(rec.conn, rec.pid);
+				continue;
+			}
+			// Forwarded request is traced by the shard of the connection and by the owner of the target
+			if(rec.type < TRACE_REQUEST || rec.hash % shards != rec.shard)
+				continue;
+
+			string target(rec.text, std::min((size_t)rec.text_len, sizeof rec.text));
+			if(rec.text_len > sizeof rec.text)
+			{
+				char hash[24];
+				snprintf(hash, sizeof hash, "#%016" PRIx64, rec.hash);
+				target += hash;
+			}
+			// Dependencies refer to targets by hash, the engine knows shortened names by theirs
+			sim.renamed.emplace(rec.hash, target_hash(target));
+			auto other = sim.renamed.find(rec.arg);
+			uint64_t other_hash = other == sim.renamed.end() ? rec.arg : other->second;
+			++sim.calls;
+			if(rec.type == TRACE_INPUT)
+			{
+				engine_add_input(&sim.engine, target, other_hash);
+				continue;
+			}
+			if(rec.type == TRACE_DEPENDENT)
+			{
+				engine_add_dependent(&sim.engine, target, other_hash);
+				continue;
+			}
+			sim.open.insert(rec.conn);
+			switch(rec.op)
+			{
+				case OP_READ:
+				case OP_WRIT:
+					engine_request(&sim.engine, rec.conn, rec.pid, (op_code)rec.op, target);
+					break;
+				case OP_DONE:
+					engine_done(&sim.engine, rec.pid, target, rec.arg);
+					break;
+				case OP_BEAT:
+					engine_beat(&sim.engine, rec.conn, rec.pid, target);
+					break;
+				default:
+					--sim.calls;
+			}
+		}
+		run = end;
+	}
+	double seconds = std::chrono::duration <double>(steady::now() - start).count();
+	if(sim.calls == 0)
+		fprintf(stderr, "No requests in the trace, record it with -T 2\n");
+	printf("calls: %" PRIu64 "  time: %.3f s  rate: %.0f calls/s\n", sim.calls, seconds, seconds > 0 ? (double)sim.calls / seconds : 0.0);
+	return 0;
+}
+
+//! Options of synthetic load.
+struct load_options
+{
+	uint64_t events;
+	size_t workers;
+	unsigned targets;
+	double zipf;
+	double write_fraction;
+	double hold_steps; ///mean number of steps a writer needs for a file
+	double crash_rate; ///probability that a writer disconnects instead of DONE
+	unsigned seed;
+	unsigned fanout; ///targets that have the same target as their input, 0 - no dependencies
+	double work_fraction; ///probability that an idle worker sends WORK
+	uint64_t file_bytes; ///size told by DONE of a writer
+};
+
+/*!
+Runs synthetic workers. Every step one random worker moves on: asks for a target, finishes reading or writes a bit more.
+\param[in] opt Load.
+\param[in] lease_ticks Writer lease in ticks, 0 - none.
+*/
+static void run_synthetic(const load_options &opt, uint64_t lease_ticks)
+{
+	std::mt19937_64 rng(opt.seed);
+	std::uniform_real_distribution <double> chance(0.0, 1.0);
+
+	vector <string> names(opt.targets);
+	for(unsigned k = 0; k < opt.targets; ++k)
+	{
+		names[k] = "/reuse/target_" + std::to_string(k);
+		sim.numbers[names[k]] = k;
+	}
+	vector <double> popularity;
+	if(opt.zipf > 0)
+	{
+		double total = 0;
+		for(unsigned k = 0; k < opt.targets; ++k)
+		{
+			total += 1.0 / pow((double)k + 1.0, opt.zipf);
+			popularity.push_back(total);
+		}
+		for(auto &p : popularity)
+			p /= total;
+	}
+
+	sim.workers.resize(opt.workers);
+	for(size_t i = 0; i < opt.workers; ++i)
+	{
+		sim.workers[i].conn = (1ull << 24) | i;
+		sim.workers[i].pid = 100000 + (int)i;
+		sim.workers[i].state = WORKER_IDLE;
+	}
+	engine_hooks hooks = {nullptr, worker_alive, worker_holdings, on_event, sim_admit, sim_leave};
+	engine_init(&sim.engine, hooks, lease_ticks, 0);
+	sim.engine.read_tokens = sim.read_tokens;
+	sim.engine.wave_us = sim.wave_us;
+	// Input of a target comes before it, so the graph is a tree with the most popular target at its root
+	for(unsigned k = 1; opt.fanout != 0 && k < opt.targets; ++k)
+	{
+		const string &input = names[(k - 1) / opt.fanout];
+		engine_add_input(&sim.engine, names[k], target_hash(input));
+		engine_add_dependent(&sim.engine, input, target_hash(names[k]));
+	}
+
+	auto start = steady::now();
+	bool stalled = false;
+	for(uint64_t step = 0; sim.calls < opt.events && !stalled; ++step)
+	{
+		// Every step is 10 microseconds of simulated time
+		sim.engine.now_us = step * 10;
+		if((lease_ticks != 0 || sim.wave_us != 0) && step % 1000 == 0)
+			engine_expire(&sim.engine);
+		promote_deferred();
+
+		auto &w = sim.workers[rng() % opt.workers];
+		switch(w.state)
+		{
+			case WORKER_IDLE:
+			{
+				// Worker that got WORK or EVCT writes, one that got IDLE asks again later
+				if(opt.work_fraction > 0 && chance(rng) < opt.work_fraction)
+				{
+					sim_work(w.conn, w.pid);
+					break;
+				}
+				if(popularity.empty())
+					w.target = (unsigned)(rng() % opt.targets);
+				else
+					w.target = (unsigned)std::min((size_t)(std::lower_bound(popularity.begin(), popularity.end(), chance(rng)) - popularity.begin()), (size_t)opt.targets - 1);
+				engine_request(&sim.engine, w.conn, w.pid, chance(rng) < opt.write_fraction ? OP_WRIT : OP_READ, names[w.target]);
+				break;
+			}
+			case WORKER_READING:
+				engine_done(&sim.engine, w.pid, names[w.target]);
+				w.state = WORKER_IDLE;
+				break;
+			case WORKER_WRITING:
+				if(chance(rng) * opt.hold_steps >= 1.0)
+				{
+					if(lease_ticks == 0)
+						continue;
+					engine_beat(&sim.engine, w.conn, w.pid, names[w.target]);
+					break;
+				}
+				if(chance(rng) < opt.crash_rate)
+				{
+					// Worker is gone, its replacement comes with a new connection
+					engine_disconnect(&sim.engine, w.conn);
+					w.conn += 1ull << 24;
+				}
+				else
+					engine_done(&sim.engine, w.pid, names[w.target], opt.file_bytes);
+				w.state = WORKER_IDLE;
+				break;
+			case WORKER_WAITING:
+				// No lease or wave is going to end and nobody is left to write the inputs
+				if(opt.fanout != 0 && step % 1000 == 0 && engine_timeout(&sim.engine) < 0
+					&& std::all_of(sim.workers.begin(), sim.workers.end(), [](const sim_worker &x) { return x.state == WORKER_WAITING; }))
+					stalled = true;
+				continue;
+		}
+		++sim.calls;
+	}
+	double seconds = std::chrono::duration <double>(steady::now() - start).count();
+	if(stalled)
+		fprintf(stderr, "All workers wait for inputs that nobody writes, stopped\n");
+	printf("calls: %" PRIu64 "  time: %.3f s  rate: %.0f calls/s\n", sim.calls, seconds, seconds > 0 ? (double)sim.calls / seconds : 0.0);
+}
+
+int main(int argc, char *argv[])
+{
+	load_options load = {0, 1000, 100000, 1.0, 0.1, 50, 0.01, 1, 0, 0, 0};
+	uint64_t lease_ticks = 0;
+	int opt;
+	while((opt = getopt(argc, argv, "s:w:t:z:W:h:x:S:g:O:f:l:k:K:Q:B:v")) != -1)
+	{
+		switch(opt)
+		{
+			case 's':
+				load.events = strtoull(optarg, nullptr, 10);
+				break;
+			case 'w':
+				load.workers = strtoul(optarg, nullptr, 10);
+				break;
+			case 't':
+				load.targets = (unsigned)strtoul(optarg, nullptr, 10);
+				break;
+			case 'z':
+				load.zipf = atof(optarg);
+				break;
+			case 'W':
+				load.write_fraction = atof(optarg);
+				break;
+			case 'h':
+				load.hold_steps = atof(optarg);
+				break;
+			case 'x':
+				load.crash_rate = atof(optarg);
+				break;
+			case 'S':
+				load.seed = (unsigned)strtoul(optarg, nullptr, 10);
+				break;
+			case 'g':
+				load.fanout = (unsigned)strtoul(optarg, nullptr, 10);
+				break;
+			case 'O':
+				load.work_fraction = atof(optarg);
+				break;
+			case 'f':
+				load.file_bytes = strtoull(optarg, nullptr, 10);
+				break;
+			case 'l':
+				lease_ticks = strtoull(optarg, nullptr, 10) * 1000 / TIMER_TICK_MS;
+				break;
+			case 'k':
+				sim.read_tokens = strtoul(optarg, nullptr, 10);
+				break;
+			case 'K':
+				sim.wave_us = strtoull(optarg, nullptr, 10) * 1000;
+				break;
+			case 'Q':
+				sim.max_writers = strtoul(optarg, nullptr, 10);
+				break;
+			case 'B':
+				sim.disk_budget = strtoull(optarg, nullptr, 10);
+				break;
+			case 'v':
+				sim.verbose = true;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-l lease_seconds] [-k read_tokens [-K wave_ms]] [-Q max_writers] [-B disk_budget] [-v] trace_file\n"
+					"       %s -s events [-w workers] [-t targets] [-z zipf] [-W write_fraction] [-h hold_steps] [-x crash_rate] [-S seed]"
+					" [-g inputs] [-O work_fraction] [-f file_bytes]"
+					" [-l lease_seconds] [-k read_tokens [-K wave_ms]] [-Q max_writers] [-B disk_budget] [-v]\n", argv[0], argv[0]);
+				return 1;
+		}
+	}
+
+	sim.digest = 14695981039346656037ull;
+	if(load.events > 0)
+	{
+		if(load.workers < 1 || load.workers > 0xFFFFFF || load.targets < 1 || load.hold_steps < 1)
+		{
+			fprintf(stderr, "Workers, targets and hold steps should be positive\n");
+			return 1;
+		}
+		run_synthetic(load, lease_ticks);
+	}
+	else if(optind < argc)
+	{
+		if(replay_trace(argv[optind], lease_ticks) != 0)
+			return 1;
+	}
+	else
+	{
+		fprintf(stderr, "Give a trace file or -s number of events\n");
+		return 1;
+	}
+
+	printf("READ: %" PRIu64 "  WRIT: %" PRIu64 "  WAIT: %" PRIu64 "  WORK: %" PRIu64 "  EVCT: %" PRIu64 "  IDLE: %" PRIu64
+		"  lost: %" PRIu64 "  expired: %" PRIu64 "\n",
+		sim.answers[0], sim.answers[1], sim.answers[2], sim.answers[3], sim.answers[4], sim.answers[5], sim.lost, sim.expired);
+	printf("digest: %016" PRIx64 "\n", sim.digest);
+	return 0;
+}
@@ -14,10 +14,25 @@
 ** done in parallel, anyway file will be cached into RAM.
 ** If file is being generated - WAIT for a next READ message.
 ** 
-** Communication is done by epoll. It is possible to add any reasonable number 
-** of threads if needed, but for the environment it was codded for - 
-** two threads is more than enough.
-** First thread accepts connections, second communicates with clients.
+** Communication is done by epoll. Number of processing threads is set with -t
+** (one by default, which is enough for a few nodes). Every thread owns its epoll,
+** listening socket (SO_REUSEPORT) and a part of targets, chosen by hash of the name.
+** Requests for targets of another thread are passed through lock-free mailboxes,
+** so every target is always decided by one thread only.
+** Port is set with -p (1987 by default). Workers on the same node may connect to a Unix domain
+** socket (-U) instead and move their requests to shared memory, see shm_channel.h.
+** Finished targets are kept in a journal (-j directory, -n to disable),
+** so they are answered READ after restart as well.
+** Files already present in the reuse directory (-r) are ready targets too.
+** Workers may subscribe to targets or name prefixes and are told when they become ready, see subscriptions.cpp.
+** Targets may have inputs (DEPS): they are written only after the inputs are ready, and WORK hands
+** an idle worker any target that can be written now.
+** Writers per node (-q) and on all nodes (-Q) may be limited, workers over the limit wait for a free slot.
+** DONE may tell the size of the file. When files take more than -B bytes, idle workers asking for WORK
+** are told to delete the least recently used ones (EVCT).
+** Metrics for Prometheus are served on localhost with -m port.
+** Another instance started with -S host:port follows the one started with -R port
+** as hot standby and takes over when it is lost.
 ** 
 ** 
 ** This server should be launched on one of the nodes. Other clients should
@@ -40,11 +55,15 @@
 //============================================================================
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 #include <stddef.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <cerrno>
 #include <cstdio>
@@ -52,67 +71,36 @@
 #include <iostream>
 #include <iterator>
 #include <string>
+#include <string_view>
+#include <charconv>
 #include <vector>
 #include <sstream>
-#include <queue>
 #include <deque>
+#include <algorithm>
+#include <unordered_map>
 #include <fstream>
 #include <ctime>
 #include <iomanip>
 #include <arpa/inet.h>
 #include <csignal>
+#include <atomic>
+#include <memory>
+#include "file_scheduler.h"
 
-using std::string;
 using std::cerr;
 using std::cout;
 using std::cin;
 using std::endl;
-using std::vector;
-using std::queue;
-using std::deque;
-using std::put_time;
 
-// enables log files
-//#define DEBUG
-// One server generates around 20-25 events.
-// For 4 nodes I expect 100 events for cluster
-#define MAXEVENTS 500
-
-//just wrapper for better understanding.
-struct fd_struct
-{
-	int fd; ///just wrapper for better understanding.
-};
-
-struct thread_data
-{
-	queue <fd_struct> file_descriptors;
-};
-
-struct client_buffer
-{
-	int pid;
-	int fd;
-	string operation;
-	string target;
-	string answer;
-};
-
-struct read_add
-{
-	int fd;
-	string buf;
-};
-
-size_t parse_buffer(string str, deque <client_buffer> *client_buf, int fd);
-int secure_send(client_buffer* client_buf);
-void check_client_errors(deque <client_buffer> *processed_client_buf, deque <client_buffer> *client_buf, const ssize_t fd);
-void *read_and_respond(void * threadarg);
-int accept_connections(uint16_t port, queue <fd_struct> *clients);
-
-pthread_mutex_t lock;
+shard *shards = nullptr;
+size_t shard_count = 1;
 bool time_to_exit = false;
 int exit_code = 0;
+int shutdown_fd = -1; ///eventfd that wakes up every processing thread on exit
+uint64_t lease_ticks = 0; ///writer lease in timer ticks, 0 - writer keeps WRIT until it disconnects
+size_t read_tokens = 0; ///waiters woken at once by DONE, 0 - all of them
+uint64_t wave_ms = 0; ///0 - read tokens are passed on by DONE of readers, otherwise new ones are given every wave_ms
+uint64_t disk_budget = 0; ///bytes the files of ready targets may take before idle workers are asked to delete some, 0 - no limit
 
 void signalHandler( int signum )
 {
@@ -120,565 +108,1323 @@ void signalHandler( int signum )
    cerr << "Programm has 30 seconds to finish or it will be forced to exit.\n";
    exit_code = signum;
    time_to_exit = true;
-   sleep(30);
+   uint64_t one = 1;
+   if(write(shutdown_fd, &one, sizeof one) < 0)
+      cerr << "Can not wake up processing threads.\n";
+   alarm(30);
+}
+
+void alarmHandler( int )
+{
    cerr << "Looks like program does not respond. Killing.\n";
-   exit(signum);
+   _exit(exit_code);
+}
+
+/*!
+Parses complete binary messages: wire_request header followed by the target name. Request id goes to 'tag'.
+\returns 0 on success, -1 if a header is broken or READ / WRIT does not name its target
+*/
+static int parse_wire(recv_buffer *in, vector <client_buffer> *client_buf, uint64_t conn)
+{
+	const char *data = in->data.data();
+
+	while(in->tail - in->head >= sizeof(wire_request))
+	{
+		wire_request req;
+		memcpy(&req, data + in->head, sizeof req);
+		if(req.magic != WIRE_MAGIC || (req.flags != 0 && !(req.op == OP_DONE && req.flags == WIRE_DONE_SIZE)))
+			return -1;
+		size_t size_len = req.flags == WIRE_DONE_SIZE ? sizeof(uint64_t) : 0;
+		if(in->tail - in->head - sizeof req < req.name_len + size_len)
+			break;
+
+		client_buffer temp = {};
+		temp.pid = req.pid;
+		bool known = req.op < OP_BTCH || req.op == OP_SHMR || req.op == OP_SUBS || req.op == OP_PREF || req.op == OP_DEPS || req.op == OP_WORK;
+		temp.op = known ? (op_code)req.op : OP_OTHER;
+		temp.conn = conn;
+		temp.operation = op_name(temp.op);
+		temp.target = string_view(data + in->head + sizeof req, req.name_len);
+		temp.tag = req.id;
+		if(req.name_len == 0)
+		{
+			// A target that was never named can not be decided
+			if(temp.op == OP_READ || temp.op == OP_WRIT || temp.op == OP_SUBS || temp.op == OP_PREF || temp.op == OP_DEPS)
+				return -1;
+			// WORK names nothing, its hash means nothing either
+			temp.hash = temp.op == OP_WORK ? 0 : req.hash;
+		}
+		if(size_len != 0)
+			memcpy(&temp.size, data + in->head + sizeof req + req.name_len, size_len);
+		in->head += sizeof req + req.name_len + size_len;
+		client_buf->push_back(temp);
+	}
+
+	return 0;
 }
 
 /*!
-Parses input buffer and stores parsed messages in queue
-It may parse more than one message(stored in str) and if last massage is incomplete - returns how many characters to save in external buffer for future processing.
-\param[in] str Input buffer with data recieved in socket fd.
+Parses complete messages stored in receive buffer. Message format is "len#pid#OP#target", where len is the length of the part after first '#'.
+"len#pid#OP#target#id" carries request id (1 to 2^32 - 1) in 'tag', its answers are framed with the id, see answer_local().
+"len#pid#DONE#target#id#size" tells the size of the written file as well, the id may be empty.
+Batch "len#pid#BTCH#OP#target#target..." keeps everything after BTCH in 'target', so does "len#pid#DEPS#target#input#input...".
+Connection whose first byte is WIRE_MAGIC speaks the binary protocol instead, see parse_wire().
+Parsing is resumable: incomplete message is left in the buffer and bytes already checked are not scanned again when more data arrives.
+Parsed messages refer to the buffer, so it must not be compacted until they are processed.
+\param[in] in Receive buffer of the connection.
 \param[in] client_buf Structure that keeps all parsed messages.
-\param[in] fd file descriptor associated with passed buffer data.
-\return how many characters to save in external buffer for future processing
+\param[in] conn connection id associated with passed buffer data.
+\return 0 on success, -1 if length prefix is malformed and the stream can not be synchronized anymore
 */
-size_t parse_buffer(string str, deque <client_buffer> *client_buf, int fd)
+int parse_buffer(recv_buffer *in, vector <client_buffer> *client_buf, uint64_t conn)
 {
-	bool done = false;
-	bool error = false;
-	client_buffer temp;
-	vector <string> info_block;
-	string current_str;
-	size_t found = 0;
-	string token;
+	const char *data = in->data.data();
+	if(in->protocol == PROTOCOL_UNKNOWN && in->head < in->tail)
+		in->protocol = (unsigned char)data[in->head] == WIRE_MAGIC ? PROTOCOL_BINARY : PROTOCOL_TEXT;
+	if(in->protocol == PROTOCOL_BINARY)
+		return parse_wire(in, client_buf, conn);
 
-	while(str.length() > 0 && !done && !error)
+	while(in->head < in->tail)
 	{
-		found = str.find_first_of("#");
-		if(found == std::string::npos)
+		size_t pos = in->head + in->scan;
+		for(; pos < in->tail && data[pos] >= '0' && data[pos] <= '9'; ++pos)
 		{
-			error = true;
-			continue;
+			in->frame_len = in->frame_len * 10 + (size_t)(data[pos] - '0');
+			if(in->frame_len > MAX_FRAME)
+				return -1;
 		}
+		in->scan = pos - in->head;
 
-		unsigned fut_len = stoi(str.substr(0, found));
-		if(str.length() < found + 1 + fut_len)
+		if(pos == in->tail)
+			break;
+		if(data[pos] != '#' || in->frame_len == 0)
+			return -1;
+		if(in->tail - pos - 1 < in->frame_len)
 			break;
 
-		current_str = str.substr(found+1, fut_len);
-		str = str.substr(found + 1 + fut_len);
-
-		std::istringstream iss(current_str);
-		info_block.clear();
-		while (getline(iss, token, '#'))
-			info_block.push_back(token);
+		string_view body(data + pos + 1, in->frame_len);
+		in->head = pos + 1 + in->frame_len;
+		in->scan = 0;
+		in->frame_len = 0;
 
-		current_str.clear();
+		client_buffer temp = {};
+		temp.conn = conn;
+		size_t first = body.find('#');
+		auto res = std::from_chars(body.data(), body.data() + std::min(first, body.size()), temp.pid);
+		if(res.ec != std::errc() || res.ptr != body.data() + std::min(first, body.size()))
+		{
+			cerr << "Malformed PID in message: " << body << endl;
+			continue;
+		}
 
-		temp = {};
-		if(info_block.size() > 0 )
-			temp.pid = stoi(info_block[0]);
+		if(first != string_view::npos)
+		{
+			body.remove_prefix(first + 1);
+			size_t second = body.find('#');
+			temp.operation = body.substr(0, second);
+			temp.op = op_parse(temp.operation);
+			if(second != string_view::npos)
+			{
+				body.remove_prefix(second + 1);
+				size_t third = temp.op == OP_BTCH || temp.op == OP_DEPS ? string_view::npos : body.find('#');
+				temp.target = body.substr(0, third);
+				if(third != string_view::npos)
+				{
+					// Empty id is no id, fields after the id are ignored except the file size of DONE
+					string_view id = body.substr(third + 1);
+					size_t fourth = id.find('#');
+					string_view size = fourth == string_view::npos ? string_view() : id.substr(fourth + 1);
+					id = id.substr(0, fourth);
+					uint32_t value = 0;
+					res = std::from_chars(id.data(), id.data() + id.size(), value);
+					if(!id.empty() && (res.ec != std::errc() || res.ptr != id.data() + id.size()))
+					{
+						cerr << "Malformed request id in message: " << id << endl;
+						continue;
+					}
+					temp.tag = value;
+					size = size.substr(0, size.find('#'));
+					if(temp.op == OP_DONE && !size.empty())
+					{
+						res = std::from_chars(size.data(), size.data() + size.size(), temp.size);
+						if(res.ec != std::errc() || res.ptr != size.data() + size.size())
+						{
+							cerr << "Malformed file size in message: " << size << endl;
+							continue;
+						}
+					}
+				}
+			}
+		}
 
-		if(info_block.size() > 1 )
-			temp.operation = info_block[1];
+		client_buf->push_back(temp);
+	}
 
-		if(info_block.size() > 2 )
-			temp.target = info_block[2];
+	return 0;
+}
 
-		temp.fd = fd;
+/*!
+Moves unparsed tail of the buffer to its beginning. Invalidates all messages parsed from it.
+\param[in] in Receive buffer of the connection.
+*/
+void compact_buffer(recv_buffer *in)
+{
+	if(in->head == 0)
+		return;
+	if(in->head < in->tail)
+		memmove(in->data.data(), in->data.data() + in->head, in->tail - in->head);
+	in->tail -= in->head;
+	in->head = 0;
+}
 
-		if(temp.operation == "DONE")
-			client_buf->push_front(temp);
-		else
-			client_buf->push_back(temp);
+int secure_send(int fd, const string &answer)
+{
+	for(size_t as = 0; as < answer.length();)
+	{
+		auto sent = send(fd, answer.data() + as, answer.length() - as, MSG_NOSIGNAL);
+		if(sent < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			cerr << "Error on socket " << fd << endl;
+			return -1;
+		}
+		as += (size_t)sent;
+	}
+	return 0;
+}
 
-		if(str.length() < 3)
-			done = true;
+/*!
+Appends answer to the output buffer of the connection. Buffer is sent at the end of event loop iteration.
+\param[in] st Scheduler state.
+\param[in] fd Socket descriptor.
+\param[in] answer Text to send.
+*/
+void queue_answer(scheduler_state *st, int fd, string_view answer)
+{
+	auto &out = get_connection(st, fd)->out;
+	out.data.insert(out.data.end(), answer.begin(), answer.end());
+	if(!out.queued)
+	{
+		out.queued = true;
+		st->to_flush.push_back(fd);
 	}
+}
 
-	return str.length();
+static int set_epoll_out(scheduler_state *st, int fd, bool enable)
+{
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLET | (enable ? (uint32_t)EPOLLOUT : 0u);
+	event.data.fd = fd;
+	get_connection(st, fd)->out.armed = enable;
+	return epoll_ctl(st->efd, EPOLL_CTL_MOD, fd, &event);
 }
 
-int secure_send(client_buffer* client_buf)
+/*!
+Sends everything queued for the connection. If socket is full the rest is kept and EPOLLOUT is enabled to continue later.
+\param[in] st Scheduler state.
+\param[in] fd Socket descriptor.
+\returns 0 on success, -1 if connection is broken or does not read its answers
+*/
+int flush_connection(scheduler_state *st, int fd)
 {
-	for(size_t as = 0; as < client_buf->answer.length();)
+	if(get_connection(st, fd)->shm)
+		return shm_flush(st, fd);
+	if(st->ring)
+		return uring_flush(st, fd);
+	auto &out = get_connection(st, fd)->out;
+
+	while(out.head < out.data.size())
 	{
-		auto sent = send(client_buf->fd, client_buf->answer.substr(as).c_str(), client_buf->answer.substr(as).length(), 0);
+		auto sent = send(fd, out.data.data() + out.head, out.data.size() - out.head, MSG_NOSIGNAL);
 		if(sent < 0)
 		{
-			cerr << "Error on socket " << client_buf->fd << endl;
-			return -1;
+			if(errno == EINTR)
+				continue;
+			if(errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				cerr << "Error on socket " << fd << endl;
+				return -1;
+			}
+			out.blocked = true;
+			break;
 		}
-		as += sent;
+		out.head += (size_t)sent;
+	}
+
+	if(out.head == out.data.size())
+	{
+		out.data.clear();
+		out.head = 0;
+		if(out.armed && set_epoll_out(st, fd, false) != 0)
+			return -1;
+		return 0;
+	}
+
+	out.data.erase(out.data.begin(), out.data.begin() + (ssize_t)out.head);
+	out.head = 0;
+	if(out.data.size() > MAX_OUTPUT)
+	{
+		cerr << "Client on socket " << fd << " does not read answers\n";
+		return -1;
 	}
+	if(!out.armed && set_epoll_out(st, fd, true) != 0)
+		return -1;
 	return 0;
 }
 
-void check_client_errors(deque <client_buffer> *processed_client_buf, deque <client_buffer> *client_buf, const ssize_t fd)
+static inline size_t shard_of(string_view target)
+{
+	return (size_t)(target_hash(target) % shard_count);
+}
+
+/*!
+Returns per-connection data for descriptor fd, growing the index if needed.
+\param[in] st Scheduler state.
+\param[in] fd Socket descriptor.
+\returns pointer to connection data
+*/
+connection *get_connection(scheduler_state *st, int fd)
+{
+	if(st->connections.size() <= (size_t)fd)
+		st->connections.resize((size_t)fd + 1);
+	return &st->connections[(size_t)fd];
+}
+
+static bool conn_alive(scheduler_state *st, uint64_t conn)
 {
-	string error_target = "";
+	if(conn_shard(conn) != st->self->id)
+		return true; // owner shard will drop the answer if it is too late
+	auto c = get_connection(st, conn_fd(conn));
+	return c->open && make_conn_id(st->self->id, conn_fd(conn), c->gen) == conn;
+}
 
-	for(auto iter = client_buf->begin(); iter != client_buf->end(); ++iter)
+static vector <holding> *holdings_of(scheduler_state *st, uint64_t conn)
+{
+	if(conn_shard(conn) == st->self->id)
+		return &get_connection(st, conn_fd(conn))->holdings;
+	return &st->remote_holdings[conn];
+}
+
+static void post_mail(scheduler_state *st, size_t dst, mail &&m)
+{
+	st->outbox[dst].push_back(std::move(m));
+}
+
+/*!
+Appends "len#kind#body" to the output buffer of the connection, without building it elsewhere first.
+*/
+static void queue_frame(scheduler_state *st, int fd, string_view kind, string_view body)
+{
+	auto &out = get_connection(st, fd)->out;
+	char head[24];
+	char *end = std::to_chars(head, head + sizeof head - 1, kind.size() + 1 + body.size()).ptr;
+	*end++ = '#';
+	out.data.insert(out.data.end(), head, end);
+	out.data.insert(out.data.end(), kind.begin(), kind.end());
+	out.data.push_back('#');
+	queue_answer(st, fd, body);
+}
+
+/*!
+Sends batches whose targets are all answered, in the order of requests.
+\param[in] st Scheduler state.
+\param[in] fd Socket descriptor.
+*/
+static void send_batches(scheduler_state *st, int fd)
+{
+	auto c = get_connection(st, fd);
+	while(!c->batches.empty() && c->batches.front().missing == 0)
 	{
-		if(iter->fd == fd)
-			return;
+		queue_frame(st, fd, "BTCH", c->batches.front().answers);
+		c->batches.erase(c->batches.begin());
 	}
+}
 
-	for(auto iter = processed_client_buf->begin(); iter != processed_client_buf->end(); ++iter)
+/*!
+Puts answer on a target of BTCH request into its batch. The batch is sent as "len#BTCH#answers" when all its targets are answered.
+Answers that come after that (READ or WRIT after WAIT) are sent one by one as "len#ANSWER#target".
+\param[in] st Scheduler state.
+\param[in] fd Socket descriptor.
+\param[in] tag Batch and position of the target, see batch_tag().
+\param[in] answer OP_READ, OP_WRIT or OP_WAIT.
+\param[in] target Target name.
+*/
+static void batch_answer(scheduler_state *st, int fd, uint64_t tag, op_code answer, string_view target)
+{
+	auto c = get_connection(st, fd);
+	uint32_t serial = (uint32_t)(tag >> 32);
+	auto batch = std::find_if(c->batches.begin(), c->batches.end(), [serial](const pending_batch &b) { return b.serial == serial; });
+	if(batch == c->batches.end())
 	{
-		if(iter->fd == fd )
+		queue_frame(st, fd, op_name(answer), target);
+		return;
+	}
+	// WAIT that was not sent yet is simply replaced by the final answer
+	size_t position = (uint32_t)tag - 1;
+	if(batch->answers[position * 4] == ' ')
+		--batch->missing;
+	batch->answers.replace(position * 4, 4, op_name(answer), 4);
+	send_batches(st, fd);
+}
+
+/*!
+Appends binary answer to the output buffer of the connection.
+\param[in] st Scheduler state.
+\param[in] fd Socket descriptor.
+\param[in] answer Decision, OP_HINT or OP_EXIT.
+\param[in] id Request id.
+\param[in] payload Text after the header, HINT only.
+*/
+static void queue_wire_answer(scheduler_state *st, int fd, op_code answer, uint32_t id, string_view payload)
+{
+	wire_answer a = {WIRE_MAGIC, answer, (uint16_t)payload.size(), id};
+	queue_answer(st, fd, string_view((const char *)&a, sizeof a));
+	if(!payload.empty())
+		queue_answer(st, fd, payload);
+}
+
+/*!
+Appends "len#kind#id", or "len#kind#id#body" for answers with a body, as the answer to a text request that carried an id.
+*/
+static void queue_tagged_frame(scheduler_state *st, int fd, string_view kind, uint32_t id, string_view body)
+{
+	char text[16];
+	char *end = std::to_chars(text, text + sizeof text, id).ptr;
+	if(body.empty())
+	{
+		queue_frame(st, fd, kind, string_view(text, (size_t)(end - text)));
+		return;
+	}
+	*end++ = '#';
+	string tagged(text, end);
+	tagged += body;
+	queue_frame(st, fd, kind, tagged);
+}
+
+/*!
+Queues answer to a connection of this shard in its protocol. Text answers are four characters,
+or framed when the request carried an id, was a part of BTCH, or the answer has a body (HINT, NTFY, PREF).
+\param[in] st Scheduler state.
+\param[in] conn Connection id.
+\param[in] answer Decision, OP_HINT, OP_NTFY, OP_PREF or OP_EXIT.
+\param[in] tag Tag of the request, see client_buffer.
+\param[in] target Target name for answers to BTCH, NTFY and PREF, body for OP_HINT, unused otherwise.
+*/
+static void answer_local(scheduler_state *st, uint64_t conn, op_code answer, uint64_t tag, string_view target)
+{
+	string_view body = answer_has_body(answer) ? target : string_view();
+	if(get_connection(st, conn_fd(conn))->in.protocol == PROTOCOL_BINARY)
+		queue_wire_answer(st, conn_fd(conn), answer, (uint32_t)tag, body);
+	else if(is_request_id(tag))
+		queue_tagged_frame(st, conn_fd(conn), op_name(answer), (uint32_t)tag, body);
+	else if(answer_has_body(answer))
+		queue_frame(st, conn_fd(conn), op_name(answer), body);
+	else if(tag != 0)
+		batch_answer(st, conn_fd(conn), tag, answer, target);
+	else
+		queue_answer(st, conn_fd(conn), op_name(answer));
+}
+
+/*!
+Sends answer to the connection. Connections of other shards get it through their mailbox.
+\param[in] st Scheduler state.
+\param[in] conn Connection id.
+\param[in] answer Decision, OP_HINT, OP_NTFY or OP_PREF.
+\param[in] tag Tag of the request, answers to BTCH are collected into its batch, request ids are given back.
+\param[in] target Target name for answers to BTCH, NTFY and PREF, body for OP_HINT, unused otherwise.
+\returns 0 on success
+*/
+int deliver(scheduler_state *st, uint64_t conn, op_code answer, uint64_t tag, string_view target)
+{
+	if(conn_shard(conn) != st->self->id)
+	{
+		mail m;
+		m.type = MAIL_ANSWER;
+		m.op = answer;
+		m.conn = conn;
+		m.pid = 0;
+		m.tag = tag;
+		if(answer_has_body(answer) || (tag != 0 && !is_request_id(tag)))
+			m.target = string(target);
+		post_mail(st, conn_shard(conn), std::move(m));
+		return 0;
+	}
+	if(!conn_alive(st, conn))
+		return -1;
+	answer_local(st, conn, answer, tag, target);
+	return 0;
+}
+
+static bool engine_alive(void *ctx, uint64_t conn)
+{
+	return conn_alive((scheduler_state *)ctx, conn);
+}
+
+static vector <holding> *engine_holdings(void *ctx, uint64_t conn)
+{
+	return holdings_of((scheduler_state *)ctx, conn);
+}
+
+/*!
+Carries out decisions of the engine: sends answers, journals transitions, traces and counts them.
+\param[in] ctx Scheduler state.
+\param[in] e Decision or transition.
+*/
+static void engine_event_handler(void *ctx, const engine_event &e)
+{
+	auto st = (scheduler_state *)ctx;
+	auto &m = st->self->metrics;
+	string_view target = e.target->first;
+	switch(e.type)
+	{
+		case ENGINE_ANSWER:
+			trace_event(st, TRACE_DECISION, e.conn, e.pid, e.answer, target);
+			metric_add(m.answers[e.answer]);
+			// Cold targets offered for eviction are not requested by anybody
+			if(!e.queued && e.answer != OP_EVCT)
+				metrics_count_target(st, e.target, e.answer == OP_WAIT);
+			else if(e.queued && e.answer == OP_READ)
+				metrics_observe(&m.wait_read, e.since);
+			else if(e.queued)
+			{
+				metrics_observe(&m.wait_writ, e.since);
+				cerr << "PID " << e.pid << " advised to WRIT\n";
+			}
+			// Standby has to know about WRIT before the worker does, and that an evicted target is forgotten
+			if((e.answer == OP_WRIT || e.answer == OP_WORK || e.answer == OP_EVCT) && replica_hold(st, e.conn, e.answer, e.tag, target))
+				break;
+			if(deliver(st, e.conn, e.answer, e.tag, target) != 0)
+				cerr << "ERROR in secure send";
+			break;
+		case ENGINE_GRANTED:
 		{
-			error_target = iter->target;
-			cerr << "Broken client removing: " << iter->fd << " " << iter->operation << " " << iter->target << endl;
-			processed_client_buf->erase(iter);
+			char type = e.target->second.evicting ? 'E' : 'W';
+			journal_record(st, type, target);
+			replica_record(st, type, e.pid, target);
 			break;
 		}
+		case ENGINE_FINISHED:
+			journal_record(st, 'D', target);
+			replica_record(st, 'D', e.pid, target);
+			metrics_observe(&m.hold_done, e.since);
+			notify_subscribers(st, e.target);
+			break;
+		case ENGINE_LOST:
+			cerr << "Broken client removing: " << conn_fd(e.conn) << " WRIT " << target << endl;
+			journal_record(st, 'L', target);
+			replica_record(st, 'L', e.pid, target);
+			metrics_observe(&m.hold_lost, e.since);
+			break;
+		case ENGINE_EXPIRED:
+			cerr << "Lease of PID " << e.pid << " on " << target << " expired\n";
+			trace_event(st, TRACE_LEASE_EXPIRED, e.conn, e.pid, OP_WRIT, target);
+			journal_record(st, 'L', target);
+			replica_record(st, 'L', e.pid, target);
+			metrics_observe(&m.hold_lost, e.since);
+			break;
+		case ENGINE_FOUND:
+			journal_record(st, 'D', target);
+			replica_record(st, 'D', 0, target);
+			notify_subscribers(st, e.target);
+			break;
+		case ENGINE_FORGOTTEN:
+			journal_record(st, 'F', target);
+			replica_record(st, 'F', 0, target);
+			break;
+		case ENGINE_EVICTED:
+			journal_record(st, 'L', target);
+			replica_record(st, 'L', e.pid, target);
+			break;
+		case ENGINE_INPUT_READY:
+		case ENGINE_INPUT_GONE:
+			// Dependent of this shard that is not in the table was never registered
+			if(e.dependent % shard_count != st->self->id)
+			{
+				mail msg;
+				msg.type = e.type == ENGINE_INPUT_READY ? MAIL_INPUT_READY : MAIL_INPUT_GONE;
+				msg.conn = 0;
+				msg.pid = 0;
+				msg.hash = e.dependent;
+				post_mail(st, e.dependent % shard_count, std::move(msg));
+			}
+			break;
 	}
-	if(error_target.length() > 0)
+}
+
+/*!
+Prepares decision engine of the shard and fills it with ready targets restored from journal or found on disk,
+and with targets that were being written when the former primary was lost.
+\param[in] st Scheduler state.
+*/
+void init_engine(scheduler_state *st)
+{
+	st->replica_seq = 0;
+	st->quota_seen = 0;
+	st->quota_released = false;
+	engine_hooks hooks = {st, engine_alive, engine_holdings, engine_event_handler, quota_admit, quota_leave};
+	engine_init(&st->engine, hooks, lease_ticks, steady_us());
+	st->engine.read_tokens = read_tokens;
+	st->engine.wave_us = wave_ms * 1000;
+	engine_preload(&st->engine, st->self->preload);
+	engine_preload_writers(&st->engine, st->self->preload_writers);
+	st->self->preload.clear();
+	st->self->preload.shrink_to_fit();
+	st->self->preload_writers.clear();
+	st->self->preload_writers.shrink_to_fit();
+}
+
+/*!
+Answers HINT: "len#HINT#LOCL#writer" if the file is cached on the node of the worker, "len#HINT#REMT#writer" if it exists
+elsewhere, "len#HINT#NONE#writer" if it is not generated yet. Writer is the address of the node that generated
+the file or generates it now, empty if unknown.
+\param[in] st Scheduler state.
+\param[in] conn Connection id.
+\param[in] tag Request id of the binary protocol.
+\param[in] target Target name.
+\param[in] node Node of the worker.
+*/
+static void answer_locality(scheduler_state *st, uint64_t conn, uint64_t tag, string_view target, uint32_t node)
+{
+	auto hint = engine_locality(&st->engine, target, node);
+	char body[5 + INET_ADDRSTRLEN];
+	memcpy(body, hint.local ? "LOCL#" : hint.ready ? "REMT#" : "NONE#", 5);
+	body[5] = 0;
+	in_addr addr = {hint.writer_node};
+	if(hint.writer_node != 0)
+		inet_ntop(AF_INET, &addr, body + 5, INET_ADDRSTRLEN);
+	deliver(st, conn, OP_HINT, tag, body);
+}
+
+/*!
+Passes request to another shard. A shard that gets requests of an own connection is told when it is closed.
+\param[in] st Scheduler state.
+\param[in] request Parsed request.
+\param[in] owner Destination shard.
+\param[in] node Node of the worker.
+*/
+static void forward_request(scheduler_state *st, const client_buffer *request, size_t owner, uint32_t node)
+{
+	mail m;
+	m.type = MAIL_REQUEST;
+	m.op = request->op;
+	m.conn = request->conn;
+	m.pid = request->pid;
+	m.target = string(request->target);
+	m.tag = request->tag;
+	m.node = node;
+	m.hash = request->hash;
+	m.size = request->size;
+	m.hops = request->hops;
+	post_mail(st, owner, std::move(m));
+	if(conn_shard(request->conn) == st->self->id)
+		get_connection(st, conn_fd(request->conn))->remote_shards |= 1ull << owner;
+}
+
+/*!
+\returns true if files of ready targets take more than the disk budget (-B), as the shards told at the end of their iterations
+*/
+static bool over_budget(const scheduler_state *st)
+{
+	if(disk_budget == 0)
+		return false;
+	uint64_t total = st->engine.ready_bytes;
+	for(size_t s = 0; s < shard_count; ++s)
+		if(s != st->self->id)
+			total += (uint64_t)std::max(shards[s].metrics.ready_bytes.load(std::memory_order_relaxed), (int64_t)0);
+	return total > disk_budget;
+}
+
+/*!
+Answers WORK: grants WRIT on a target of the graph that can be written now. Shards are asked one after another,
+starting with the shard of the connection. When none of them has anything and files take more than the disk budget,
+they are asked once more for a cold target to evict (EVCT), only those with more than their part of the budget offer one.
+The last one answers IDLE.
+\param[in] st Scheduler state.
+\param[in] request WORK request, 'hops' counts shards asked before, in both rounds.
+\param[in] node Node of the worker.
+*/
+static void dispatch_work(scheduler_state *st, const client_buffer *request, uint32_t node)
+{
+	if(request->hops < shard_count)
 	{
-		for(auto iter = processed_client_buf->begin(); iter != processed_client_buf->end(); ++iter)
+		if(engine_work(&st->engine, request->conn, request->pid, request->tag, node))
+			return;
+	}
+	// Without a budget nothing is ever offered for deletion
+	else if(disk_budget != 0 && st->engine.ready_bytes > disk_budget / shard_count && engine_evict(&st->engine, request->conn, request->pid, request->tag, node))
+		return;
+
+	client_buffer next = *request;
+	next.hops = request->hops + 1;
+	if(next.hops == shard_count && !over_budget(st))
+		next.hops = (uint32_t)(2 * shard_count);
+	if(next.hops >= 2 * shard_count)
+	{
+		trace_event(st, TRACE_DECISION, request->conn, request->pid, OP_IDLE, "");
+		metric_add(st->self->metrics.answers[OP_IDLE]);
+		deliver(st, request->conn, OP_IDLE, request->tag);
+		return;
+	}
+	if(shard_count == 1)
+	{
+		dispatch_work(st, &next, node);
+		return;
+	}
+	// Any shard may grant WRIT now, so all of them have to hear when the connection is closed
+	if(conn_shard(request->conn) == st->self->id)
+		get_connection(st, conn_fd(request->conn))->remote_shards |= (((1ull << (shard_count - 1)) << 1) - 1) & ~(1ull << st->self->id);
+	forward_request(st, &next, (st->self->id + 1) % shard_count, node);
+}
+
+/*!
+Tells the input of this shard which target needs it.
+\param[in] st Scheduler state.
+\param[in] input Name of the input.
+\param[in] dependent target_hash() of the target.
+*/
+static void add_dependent(scheduler_state *st, string_view input, uint64_t dependent)
+{
+	trace_event(st, TRACE_DEPENDENT, 0, 0, OP_DEPS, input, dependent);
+	engine_add_dependent(&st->engine, input, dependent);
+}
+
+/*!
+Registers inputs of "target#input#input...": the target is kept by this shard, every input is passed to the shard that owns it.
+\param[in] st Scheduler state.
+\param[in] list Target and its inputs.
+*/
+static void dispatch_dependencies(scheduler_state *st, string_view list)
+{
+	size_t sep = list.find('#');
+	string_view target = list.substr(0, sep);
+	uint64_t hash = target_hash(target);
+	while(sep != string_view::npos)
+	{
+		list.remove_prefix(sep + 1);
+		sep = list.find('#');
+		string_view input = list.substr(0, sep);
+		if(input.empty())
+			continue;
+		trace_event(st, TRACE_INPUT, 0, 0, OP_DEPS, target, target_hash(input));
+		if(!engine_add_input(&st->engine, target, target_hash(input)))
+			continue;
+		size_t owner = shard_of(input);
+		if(owner == st->self->id)
 		{
-			if(iter->target == error_target && iter->answer == "WAIT")
-			{
-				iter->answer = "WRIT";
-				cerr << "PID " << iter->pid << " advised to WRIT";
-				if(secure_send(&*iter) != 0)
-					cerr << "ERROR in secure send";
+			add_dependent(st, input, hash);
+			continue;
+		}
+		mail m;
+		m.type = MAIL_DEPENDENT;
+		m.conn = 0;
+		m.pid = 0;
+		m.target = string(input);
+		m.hash = hash;
+		post_mail(st, owner, std::move(m));
+	}
+}
+
+/*!
+Passes request to the shard that owns its target. Requests for own targets are decided right away.
+Prefix subscriptions go to every shard, WORK is tried here first.
+\param[in] st Scheduler state.
+\param[in] request Parsed request.
+*/
+void dispatch_request(scheduler_state *st, const client_buffer *request)
+{
+	bool own = conn_shard(request->conn) == st->self->id;
+	uint32_t node = own ? get_connection(st, conn_fd(request->conn))->node : request->node;
+	if(is_prefix_subscription(request))
+	{
+		for(size_t s = 0; own && s < shard_count; ++s)
+			if(s != st->self->id)
+				forward_request(st, request, s, node);
+		subscribe(st, request, request->target, node);
+		return;
+	}
+	if(request->op == OP_WORK)
+	{
+		dispatch_work(st, request, node);
+		return;
+	}
+
+	// DEPS goes to the shard of the target, the first name of the list
+	string_view key = request->op == OP_DEPS ? request->target.substr(0, request->target.find('#')) : request->target;
+	size_t owner = key.empty() && request->hash != 0 ? (size_t)(request->hash % shard_count) : shard_of(key);
+	if(owner != st->self->id)
+	{
+		forward_request(st, request, owner, node);
+		return;
+	}
+
+	string_view target = request->target;
+	if(target.empty() && request->hash != 0)
+		target = engine_name(&st->engine, request->hash);
+	if(request->op == OP_DONE)
+		engine_done(&st->engine, request->pid, target, request->size);
+	else if(request->op == OP_BEAT)
+		engine_beat(&st->engine, request->conn, request->pid, target);
+	else if(request->op == OP_HINT)
+		answer_locality(st, request->conn, request->tag, target, node);
+	else if(request->op == OP_SUBS || request->op == OP_PREF)
+		subscribe(st, request, target, node);
+	else if(request->op == OP_DEPS)
+		dispatch_dependencies(st, target);
+	else
+		engine_request(&st->engine, request->conn, request->pid, request->op, target, request->tag, node);
+}
+
+/*!
+Splits BTCH request "OP#target#target..." into requests for every target. Their answers are collected by batch_answer().
+SUBS and PREF batches subscribe to every target and are not answered themselves.
+\param[in] st Scheduler state.
+\param[in] request Parsed BTCH request of own connection.
+*/
+static void dispatch_batch(scheduler_state *st, const client_buffer *request)
+{
+	string_view rest = request->target;
+	size_t sep = rest.find('#');
+	client_buffer single = {request->pid, op_parse(rest.substr(0, sep)), request->conn, rest.substr(0, sep), {}, 0, 0, 0, 0, 0};
+	if(single.op == OP_SUBS || single.op == OP_PREF)
+	{
+		while(sep != string_view::npos)
+		{
+			rest.remove_prefix(sep + 1);
+			sep = rest.find('#');
+			single.target = rest.substr(0, sep);
+			trace_event(st, TRACE_REQUEST, single.conn, single.pid, single.op, single.target);
+			dispatch_request(st, &single);
+		}
+		return;
+	}
+	if(single.op != OP_READ && single.op != OP_WRIT)
+	{
+		cerr << "Malformed batch: " << rest.substr(0, 64) << endl;
+		return;
+	}
+
+	// Answers may come right away, so the batch has to know its size before the first request
+	auto c = get_connection(st, conn_fd(request->conn));
+	size_t count = (size_t)std::count(rest.begin(), rest.end(), '#');
+	// Serial 0 would make the tags look like request ids
+	if(++c->batch_serial == 0)
+		++c->batch_serial;
+	c->batches.push_back({c->batch_serial, string(count * 4, ' '), count});
+	uint32_t serial = c->batch_serial;
+	for(size_t position = 0; position < count; ++position)
+	{
+		rest.remove_prefix(sep + 1);
+		sep = rest.find('#');
+		single.target = rest.substr(0, sep);
+		single.tag = batch_tag(serial, position);
+		trace_event(st, TRACE_REQUEST, single.conn, single.pid, single.op, single.target);
+		dispatch_request(st, &single);
+	}
+	send_batches(st, conn_fd(request->conn));
+}
+
+/*!
+Passes change in reuse directory to the shard that owns the target.
+\param[in] st Scheduler state.
+\param[in] target Target name.
+\param[in] exists File appeared (true) or was deleted (false).
+*/
+void file_changed(scheduler_state *st, string_view target, bool exists)
+{
+	size_t owner = shard_of(target);
+	if(owner == st->self->id)
+	{
+		engine_file(&st->engine, target, exists);
+		return;
+	}
+	mail m;
+	m.type = exists ? MAIL_FILE_READY : MAIL_FILE_GONE;
+	m.conn = 0;
+	m.pid = 0;
+	m.target = string(target);
+	post_mail(st, owner, std::move(m));
+}
+
+/*!
+Drops every role and subscription the connection has on targets of this shard. Targets whose writer was lost are handed over to the next waiter.
+\param[in] st Scheduler state.
+\param[in] conn Closed connection id.
+*/
+void release_connection(scheduler_state *st, uint64_t conn)
+{
+	engine_disconnect(&st->engine, conn);
+	unsubscribe(st, conn);
+	if(conn_shard(conn) != st->self->id)
+		st->remote_holdings.erase(conn);
+}
+
+/*!
+Releases local socket: drops its roles here, tells other shards it talked to and closes the descriptor.
+\param[in] st Scheduler state.
+\param[in] fd Socket descriptor.
+*/
+void close_connection(scheduler_state *st, int fd)
+{
+	auto c = get_connection(st, fd);
+	uint64_t conn = make_conn_id(st->self->id, fd, c->gen);
+	c->open = false;
+	trace_event(st, TRACE_CLOSE, conn, 0, OP_NONE, "");
+	gauge_add(st->self->metrics.connections, -1);
+	c->in.head = c->in.tail = 0;
+	c->in.scan = c->in.frame_len = 0;
+	c->in.protocol = PROTOCOL_UNKNOWN;
+	c->out.data.clear();
+	c->out.head = 0;
+	c->out.queued = c->out.blocked = c->out.armed = false;
+	c->batches.clear();
+	if(c->shm)
+		shm_detach(st, fd);
+
+	release_connection(st, conn);
+	for(size_t s = 0; s < shard_count; ++s)
+	{
+		if(c->remote_shards & (1ull << s))
+		{
+			mail m;
+			m.type = MAIL_DISCONNECT;
+			m.conn = conn;
+			m.pid = 0;
+			post_mail(st, s, std::move(m));
+		}
+	}
+	c->remote_shards = 0;
+	if(st->ring)
+		uring_release_socket(st, fd);
+	else
+		close(fd); // Closing the descriptor will make epoll remove it from the set of descriptors which are monitored.
+}
+
+/*!
+Moves pending mail into mailboxes of other shards and wakes them up. Mail that does not fit stays in outbox in the original order.
+\param[in] st Scheduler state.
+\returns true if some mail is still pending
+*/
+bool flush_mail(scheduler_state *st)
+{
+	bool pending = false;
+	for(size_t dst = 0; dst < shard_count; ++dst)
+	{
+		auto &out = st->outbox[dst];
+		if(out.empty())
+			continue;
+
+		mailbox *mb = shards[dst].inbox[st->self->id].get();
+		size_t tail = mb->tail.load(std::memory_order_relaxed);
+		size_t head = mb->head.load(std::memory_order_acquire);
+		bool posted = false;
+		while(!out.empty() && tail - head < MAILBOX_SIZE)
+		{
+			mb->slots[tail & (MAILBOX_SIZE - 1)] = std::move(out.front());
+			out.pop_front();
+			++tail;
+			posted = true;
+		}
+		mb->tail.store(tail, std::memory_order_release);
+
+		if(posted)
+		{
+			uint64_t one = 1;
+			if(write(shards[dst].mail_fd, &one, sizeof one) < 0)
+				perror("eventfd write");
+		}
+		pending = pending || !out.empty();
+	}
+	return pending;
+}
+
+/*!
+Takes all mail sent to this shard.
+\param[in] st Scheduler state.
+\param[out] received Mail in order of arrival from every sender.
+*/
+void collect_mail(scheduler_state *st, vector <mail> *received)
+{
+	uint64_t counter;
+	if(read(st->self->mail_fd, &counter, sizeof counter) < 0 && errno != EAGAIN)
+		perror("eventfd read");
+
+	for(size_t src = 0; src < shard_count; ++src)
+	{
+		mailbox *mb = st->self->inbox[src].get();
+		if(mb == nullptr)
+			continue;
+		size_t head = mb->head.load(std::memory_order_relaxed);
+		size_t tail = mb->tail.load(std::memory_order_acquire);
+		for(; head != tail; ++head)
+			received->push_back(std::move(mb->slots[head & (MAILBOX_SIZE - 1)]));
+		mb->head.store(head, std::memory_order_release);
+	}
+}
+
+/*!
+Second half of event loop iteration, common for every I/O backend: decides on parsed requests and mail from other shards,
+closes broken connections, sends queued answers and passes mail to other shards.
+\param[in] st Scheduler state with requests and events collected during the iteration.
+\returns true if some mail is still waiting for space in a mailbox, or answers for space in a shared memory ring
+*/
+bool finish_iteration(scheduler_state *st)
+{
+	st->engine.now_us = steady_us();
+	shm_receive(st);
+	for(unsigned j = 0; j < st->fd_to_remove.size(); ++j)
+		get_connection(st, st->fd_to_remove[j])->open = false;
+
+	// Requests from other shards refer to the strings of received mail, which is not touched until the end of iteration
+	for(auto m = st->received.begin(); m != st->received.end(); ++m)
+	{
+		if(m->type == MAIL_REQUEST)
+			st->client_buf.push_back({m->pid, m->op, m->conn, op_name(m->op), m->target, m->tag, m->node, m->hash, m->size, m->hops});
+		else if(m->type == MAIL_ANSWER)
+		{
+			if(conn_alive(st, m->conn))
+				answer_local(st, m->conn, m->op, m->tag, m->target);
+		}
+		else if(m->type == MAIL_DISCONNECT)
+			st->conn_to_release.push_back(m->conn);
+		else if(m->type == MAIL_DEPENDENT)
+			add_dependent(st, m->target, m->hash);
+		else if(m->type == MAIL_INPUT_READY || m->type == MAIL_INPUT_GONE)
+			engine_input(&st->engine, m->hash, m->type == MAIL_INPUT_READY);
+		else
+			engine_file(&st->engine, m->target, m->type == MAIL_FILE_READY);
+	}
+
+	// DONE messages go first, so waiters are released before new decisions are made
+	for(int pass = 0; pass < 2; ++pass)
+	for(auto request = st->client_buf.begin(); request != st->client_buf.end(); ++request)
+	{
+		if((request->op == OP_DONE) != (pass == 0))
+			continue;
+		trace_event(st, TRACE_REQUEST, request->conn, request->pid, request->op, request->target, request->op == OP_WORK ? request->hops : request->size);
+		// Forwarded requests were counted by the shard of the connection
+		if(conn_shard(request->conn) == st->self->id)
+			metric_add(st->self->metrics.requests[std::min(request->op, OP_OTHER)]);
+		switch(request->op)
+		{
+			case OP_READ:
+			case OP_WRIT:
+				// Nobody is going to read the answer, so do not grant anything to closed connection
+				if(conn_alive(st, request->conn))
+					dispatch_request(st, &*request);
+				break;
+			case OP_BTCH:
+				if(conn_alive(st, request->conn))
+					dispatch_batch(st, &*request);
 				break;
+			case OP_SHMR:
+				if(conn_alive(st, request->conn))
+					shm_attach(st, &*request);
+				break;
+			case OP_SUBS:
+			case OP_PREF:
+			case OP_WORK:
+				if(conn_alive(st, request->conn))
+					dispatch_request(st, &*request);
+				break;
+			case OP_DONE:
+			case OP_BEAT:
+			case OP_HINT:
+			case OP_DEPS:
+				dispatch_request(st, &*request);
+				break;
+			default:
+				cerr << request->operation << endl;
+		}
+	}
+	st->client_buf.clear();
+	engine_expire(&st->engine);
+	quota_promote(st);
+
+	for(unsigned j = 0; j < st->fd_to_compact.size(); ++j)
+		compact_buffer(&get_connection(st, st->fd_to_compact[j])->in);
+	st->fd_to_compact.clear();
+
+	for(unsigned j = 0; j < st->conn_to_release.size(); ++j)
+		release_connection(st, st->conn_to_release[j]);
+	st->conn_to_release.clear();
+	st->received.clear();
+	replica_release(st);
+
+	// Closing connections may wake up waiters and failed sends close connections, so repeat until both are settled
+	while(!st->fd_to_remove.empty() || !st->to_flush.empty())
+	{
+		for(unsigned j = 0; j < st->fd_to_remove.size(); ++j)
+			close_connection(st, st->fd_to_remove[j]);
+		st->fd_to_remove.clear();
+
+		for(unsigned j = 0; j < st->to_flush.size(); ++j)
+		{
+			int fd = st->to_flush[j];
+			auto c = get_connection(st, fd);
+			c->out.queued = false;
+			if(!c->open || c->out.blocked)
+				continue;
+			if(flush_connection(st, fd) != 0)
+			{
+				c->open = false;
+				st->fd_to_remove.push_back(fd);
+			}
+		}
+		st->to_flush.clear();
+	}
+
+	journal_submit(st);
+	replica_submit(st);
+	metrics_publish(st);
+	quota_wake(st);
+	bool shm_pending = shm_idle(st);
+	return flush_mail(st) || shm_pending;
+}
+
+/*!
+\returns milliseconds the processing loop may sleep when nothing happens: until the next lease tick, wave of readers
+or publication of metrics, -1 if there is nothing to wait for
+*/
+int iteration_timeout(const scheduler_state *st)
+{
+	int lease = engine_timeout(&st->engine);
+	int metrics = metrics_timeout(st);
+	if(lease < 0 || metrics < 0)
+		return std::max(lease, metrics);
+	return std::min(lease, metrics);
+}
+
+/*!
+Says EXIT to every client that still holds something and closes all connections of the shard.
+\param[in] st Scheduler state.
+*/
+void shutdown_connections(scheduler_state *st)
+{
+	for(size_t fd = 0; fd < st->connections.size(); ++fd)
+	{
+		auto &c = st->connections[fd];
+		if(!c.open)
+			continue;
+		if(!c.holdings.empty() || c.remote_shards != 0)
+		{
+			wire_answer a = {WIRE_MAGIC, OP_EXIT, 0, 0};
+			string exit = c.in.protocol == PROTOCOL_BINARY ? string((const char *)&a, sizeof a) : string("EXIT");
+			// Worker with shared memory does not read the socket, EXIT follows the answers in the ring
+			if(c.shm)
+			{
+				c.out.data.insert(c.out.data.end(), exit.begin(), exit.end());
+				shm_flush(st, (int)fd);
 			}
+			else
+				secure_send((int)fd, exit);
 		}
+		if(c.shm)
+			shm_detach(st, (int)fd);
+		close((int)fd);
+	}
+	st->connections.clear();
+	st->engine.targets.clear();
+	st->engine.symbols.clear();
+	st->engine.free_symbols.clear();
+	st->engine.hashes.clear();
+}
+
+/*!
+Prepares descriptor returned by accept for the processing loop.
+\param[in] st Scheduler state.
+\param[in] fd Accepted socket.
+\returns connection data
+*/
+connection *register_connection(scheduler_state *st, int fd)
+{
+	auto c = get_connection(st, fd);
+	c->open = true;
+	++c->gen;
+	gauge_add(st->self->metrics.connections, 1);
+
+	// Workers of one node share its address, which identifies the node for locality hints.
+	// Workers on the Unix domain socket run on the scheduler's node.
+	sockaddr_storage peer;
+	socklen_t len = sizeof peer;
+	bool known = getpeername(fd, (sockaddr *)&peer, &len) == 0;
+	auto addr = (const sockaddr_in *)&peer;
+	c->local = known && peer.ss_family == AF_UNIX;
+	known = known && peer.ss_family == AF_INET;
+	c->node = known ? addr->sin_addr.s_addr : c->local ? htonl(INADDR_LOOPBACK) : 0;
+
+	// Answers are coalesced by the server itself, Nagle's algorithm would only delay them
+	int nodelay = 1;
+	if(!c->local && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof nodelay) < 0)
+		perror("setsockopt");
+
+	if(trace_level.load(std::memory_order_relaxed) >= TRACE_DECISIONS)
+	{
+		char text[INET_ADDRSTRLEN + 8] = "";
+		if(c->local)
+			strcpy(text, "unix");
+		else if(known && inet_ntop(AF_INET, &addr->sin_addr, text, INET_ADDRSTRLEN))
+			snprintf(text + strlen(text), 8, ":%u", (unsigned)ntohs(addr->sin_port));
+		trace_event(st, TRACE_CONNECT, make_conn_id(st->self->id, fd, c->gen), 0, OP_NONE, text);
 	}
+	return c;
 }
 
 /*!
 Registers new sockets in epoll function(waits on data in async mode). Reads data from sockets in async mode. Calls parse function and makes decision according to the processed requests.
-\param[in] threadarg Structure that contains address of queue with file descriptors.
+Requests for targets of other shards are forwarded to them, their answers come back through the mailbox.
+\param[in] threadarg Shard served by this thread.
 */
 void *read_and_respond(void * threadarg)
 {
-	auto my_data = (thread_data *) threadarg;
-	queue <fd_struct> *fds = &my_data->file_descriptors;
+	auto my_data = (shard *) threadarg;
 	struct epoll_event event;
 	struct epoll_event *events;
 	auto efd = epoll_create1 (0);
-	vector <int> fd_to_remove;
-//	vector <size_t> local_fd;
-	deque <client_buffer> client_buf;
-	deque <client_buffer> processed_client_buf;
-	vector <read_add> buff_add;
-	read_add ra;
+	scheduler_state st;
+	st.self = my_data;
+	st.efd = efd;
+	st.ring = nullptr;
+	st.outbox.resize(shard_count);
+	st.hot_min = st.hot_published = 0;
+	st.hot_dirty = false;
 	events = (epoll_event*)calloc (MAXEVENTS, sizeof event);
 	event.events = EPOLLIN | EPOLLET;
-	size_t fd_event_counter = 0;
 	int n;
-	std::ofstream log_processing;
-	log_processing.open("processing.log", std::ios::out | std::ios::app);
-	#ifdef DEBUG
-		auto t = time(nullptr);
-	    auto tm = *localtime(&t);
-		log_processing << put_time(&tm, "[%H:%M:%S %d-%m-%Y] ") << "Thread created\n";
-	#endif
+	bool mail_pending = false;
+	init_engine(&st);
+	trace_event(&st, TRACE_START, 0, 0, OP_NONE, "epoll");
+
+	event.data.fd = my_data->mail_fd;
+	int rc = epoll_ctl(efd, EPOLL_CTL_ADD, my_data->mail_fd, &event);
+	// Listening socket and shutdown event are level-triggered: they are not drained completely every time
+	event.events = EPOLLIN;
+	event.data.fd = my_data->listen_fd;
+	if(rc == 0)
+		rc = epoll_ctl(efd, EPOLL_CTL_ADD, my_data->listen_fd, &event);
+	event.data.fd = shutdown_fd;
+	if(rc == 0)
+		rc = epoll_ctl(efd, EPOLL_CTL_ADD, shutdown_fd, &event);
+	event.data.fd = my_data->watch_fd;
+	if(rc == 0 && my_data->watch_fd >= 0)
+		rc = epoll_ctl(efd, EPOLL_CTL_ADD, my_data->watch_fd, &event);
+	// Unix domain listener is shared, only one of the waiting shards is woken up for a connection
+	event.events = EPOLLIN | EPOLLEXCLUSIVE;
+	event.data.fd = my_data->local_fd;
+	if(rc == 0 && my_data->local_fd >= 0)
+		rc = epoll_ctl(efd, EPOLL_CTL_ADD, my_data->local_fd, &event);
+	if(rc == -1)
+	{
+		perror ("epoll_ctl");
+		time_to_exit = true;
+		pthread_exit(NULL);
+	}
 
 	while(!time_to_exit)
 	{
-		#ifdef DEBUG
-			if(fd_to_remove.size() > 0)
+		// Mail that did not fit into a full mailbox is retried soon, otherwise sleep until something happens
+		n = epoll_wait(efd, events, MAXEVENTS, mail_pending ? 1 : iteration_timeout(&st));
+		for(int i = 0; i < n; ++i)
+		{
+			if(events[i].data.fd == my_data->mail_fd)
 			{
-				t = time(nullptr);
-				tm = *localtime(&t);
-				log_processing << put_time(&tm, "[%H:%M:%S %d-%m-%Y] ") << "Descriptors to clean: " << fd_to_remove.size() << "\n";
+				collect_mail(&st, &st.received);
+				continue;
 			}
-		#endif
-		for(unsigned j=0; j < fd_to_remove.size(); ++j)
-		{
-			for(size_t k = 0; k < buff_add.size(); ++k)
+			if(events[i].data.fd == my_data->listen_fd || events[i].data.fd == my_data->local_fd)
 			{
-				if(buff_add[k].fd == fd_to_remove[j])
+				if(accept_connections(&st, efd, events[i].data.fd) != 0)
 				{
-					#ifdef DEBUG
-						t = time(nullptr);
-						tm = *localtime(&t);
-						log_processing << put_time(&tm, "[%H:%M:%S %d-%m-%Y] ") << "Removing " << fd_to_remove[j] << endl;
-					#endif
-					buff_add.erase(buff_add.begin() + k);
-					break;
+					time_to_exit = true;
+					pthread_exit(NULL);
 				}
+				continue;
 			}
-
-			for(auto iter = processed_client_buf.begin(); iter != processed_client_buf.end();)
+			if(events[i].data.fd == shutdown_fd)
+				continue;
+			if(events[i].data.fd == my_data->watch_fd)
 			{
-				if(iter->fd == fd_to_remove[j])
-					iter = processed_client_buf.erase(iter);
-				else
-					iter++;
+				reuse_dir_events(&st);
+				continue;
 			}
-
-		}
-
-		fd_event_counter -= fd_to_remove.size();
-		fd_to_remove.clear();
-
-		#ifdef DEBUG
-			if(!fds->empty())
+			if ((events[i].events & EPOLLERR) || (events[i].events & EPOLLHUP))
 			{
-				t = time(nullptr);
-				tm = *localtime(&t);
-				log_processing << put_time(&tm, "[%H:%M:%S %d-%m-%Y] ") << "Processing new connections\n";
-				if(!fds->empty())
-					log_processing.seekp(-1, std::ios_base::cur);
+				cerr << "epoll error\n";
+				st.fd_to_remove.push_back(events[i].data.fd);
+				continue;
 			}
-		#endif
-
-		while(!fds->empty())
-		{
-			pthread_mutex_lock(&lock);
-			event.data.fd = fds->front().fd;
-			fds->pop();
-			pthread_mutex_unlock(&lock);
-			++fd_event_counter;
-			#ifdef DEBUG
-				log_processing << ".";
-			#endif
-
-			if( epoll_ctl(efd, EPOLL_CTL_ADD, event.data.fd, &event) == -1)
+			if(events[i].events & EPOLLOUT)
 			{
-				perror ("epoll_ctl");
-				cerr << "EPOLL ERROR\n";
-				time_to_exit = true;
-				#ifdef DEBUG
-					log_processing.seekp(0, std::ios_base::end);
-					t = time(nullptr);
-					tm = *localtime(&t);
-					log_processing << put_time(&tm, "[%H:%M:%S %d-%m-%Y] ") << "EPOLL ERROR\n";
-					log_processing.close();
-				#endif
-				pthread_exit(NULL);
-			}
-		}
-
-		#ifdef DEBUG
-			log_processing.seekp(0, std::ios_base::end);
-		#endif
-
-		if(fd_event_counter > 0)
-		{
-			n = epoll_wait(efd, events, MAXEVENTS, 1000);
-			for(int i = 0; i < n; ++i)
-			{
-				if (( &events[i] != NULL) && ((events[i].events & EPOLLERR) || (events[i].events & EPOLLHUP) ||  (!(events[i].events & EPOLLIN))))
+				auto &out = get_connection(&st, events[i].data.fd)->out;
+				out.blocked = false;
+				if(!out.queued)
 				{
-					cerr << "epoll error\n";
-					close (events[i].data.fd);
-					fd_to_remove.push_back(events[i].data.fd);
-					continue;
-				}
-				else
-				{
-					int done = 0;
-					ra.buf = "";
-
-					for(unsigned k = 0; k < buff_add.size(); ++k)
-					{
-						if(buff_add[k].fd == events[i].data.fd)
-						{
-							ra.buf = buff_add[k].buf;
-							break;
-						}
-					}
-					#ifdef DEBUG
-						log_processing << put_time(&tm, "[%H:%M:%S %d-%m-%Y] ") << "Reading from socket " << events[i].data.fd << endl;
-					#endif
-					while (1)
-					{
-						ssize_t count;
-						char buf[512];
-						memset(buf,0, sizeof buf);
-						count = recv(events[i].data.fd, buf, sizeof buf, 0);
-						#ifdef DEBUG
-								t = time(nullptr);
-								tm = *localtime(&t);
-								log_processing << put_time(&tm, "[%H:%M:%S %d-%m-%Y] ") << "Recieved: " << string(buf) << endl;
-						#endif
-						if (count == -1)
-						{ // If errno == EAGAIN, that means we have read all data. So go back to the main loop.
-							if (errno != EAGAIN)
-							{
-								perror ("read");
-								cerr << "Count error";
-								#ifdef DEBUG
-								t = time(nullptr);
-								tm = *localtime(&t);
-								log_processing << put_time(&tm, "[%H:%M:%S %d-%m-%Y] ") << "ERROR: Count error in epoll" << endl;
-								#endif
-								done = 1;
-							}
-							break;
-						}
-						else if (count == 0)
-						{ // End of file. The remote has closed the connection.
-							done = 1;
-							break;
-						}
-						ra.buf += string(buf);
-						#ifdef DEBUG
-							t = time(nullptr);
-							tm = *localtime(&t);
-							log_processing << put_time(&tm, "[%H:%M:%S %d-%m-%Y] ") << "Parsing message of length " << ra.buf.length() << endl;
-							log_processing << "Message: " << string(ra.buf) << endl;
-						#endif
-						size_t char_left = parse_buffer(ra.buf, &client_buf, events[i].data.fd);
-						#ifdef DEBUG
-						t = time(nullptr);
-						tm = *localtime(&t);
-						if(client_buf.size() > 0)
-						{
-							for(auto iter = client_buf.begin(); iter != client_buf.end(); ++iter)
-							{
-								log_processing << "PID " << iter->pid << " on " << iter->fd << " requested " << iter->operation << " " << iter->target << endl;
-							}
-						}
-						else
-							log_processing << put_time(&tm, "[%H:%M:%S %d-%m-%Y] ") << "WARNING: Client buffer is empty\n";
-
-						#endif
-						if(char_left > 0)
-						{
-							#ifdef DEBUG
-								t = time(nullptr);
-								tm = *localtime(&t);
-								log_processing << put_time(&tm, "[%H:%M:%S %d-%m-%Y] ") << "Not all information was received. Missing " << char_left << " chars\n";
-							#endif
-
-							ra.fd = events[i].data.fd;
-							unsigned k = 0;
-							for(; k < buff_add.size(); ++k)
-							{
-								if(buff_add[k].fd == events[i].data.fd)
-								{
-									buff_add[k].buf += ra.buf;
-									break;
-								}
-							}
-							if(k == buff_add.size())
-								buff_add.push_back(ra);
-						}
-						else
-						{
-							#ifdef DEBUG
-								t = time(nullptr);
-								tm = *localtime(&t);
-								log_processing << put_time(&tm, "[%H:%M:%S %d-%m-%Y] ") << "Success in reading full message\n";
-							#endif
-							for(unsigned k = 0; k < buff_add.size(); ++k)
-							{
-								if(buff_add[k].fd == events[i].data.fd)
-								{
-									buff_add.erase(buff_add.begin() + k);
-									break;
-								}
-							}
-						}
-					}
-
-					if (done)
-					{
-						#ifdef DEBUG
-						t = time(nullptr);
-						tm = *localtime(&t);
-						log_processing << put_time(&tm, "[%H:%M:%S %d-%m-%Y] ") << "Closing connection on descriptor " << events[i].data.fd << endl;
-						#endif
-
-						check_client_errors(&processed_client_buf, &client_buf, events[i].data.fd);
-
-						close (events[i].data.fd); // Closing the descriptor will make epoll remove it from the set of descriptors which are monitored.
-						fd_to_remove.push_back(events[i].data.fd);
-					}
+					out.queued = true;
+					st.to_flush.push_back(events[i].data.fd);
 				}
 			}
-
-			#ifdef DEBUG
-			if(!client_buf.empty())
+			if(events[i].events & EPOLLIN)
 			{
-				t = time(nullptr);
-				tm = *localtime(&t);
-				log_processing << put_time(&tm, "[%H:%M:%S %d-%m-%Y] ") << "Begin processing requests.\n";
-			}
-			#endif
-
-			#ifdef DEBUG
-			log_processing << "processed_client_buf before processing new requests \n************\n";
-			for(auto iter = processed_client_buf.begin(); iter != processed_client_buf.end(); ++iter)
-			{
-				log_processing << "PID " << iter->pid << " from socket " << iter->fd << " requested " << iter->operation << " " << iter->target << " advised " << iter->answer << endl;
-			}
-			log_processing << "************\n end\n";
-			#endif
+				int done = 0;
+				auto conn = get_connection(&st, events[i].data.fd);
 
-			while(!client_buf.empty())
-			{
-				if(client_buf.front().operation == "READ")
+				while (1)
 				{
-					#ifdef DEBUG
-						t = time(nullptr);
-						tm = *localtime(&t);
-						log_processing << put_time(&tm, "[%H:%M:%S %d-%m-%Y] ") << "PID: " << client_buf.front().pid << " from socket " << client_buf.front().fd << " wants to read " << client_buf.front().target << endl;
-					#endif
-					client_buf.front().answer = "READ";
-
-					for(auto iter = processed_client_buf.begin(); iter != processed_client_buf.end(); ++iter)
-					{
-						if(iter->target == client_buf.front().target )
+					ssize_t count;
+					if(conn->in.data.size() == conn->in.tail)
+						conn->in.data.resize(std::max(conn->in.data.size() * 2, (size_t)RECV_BUF_SIZE));
+					count = recv(events[i].data.fd, conn->in.data.data() + conn->in.tail, conn->in.data.size() - conn->in.tail, 0);
+					if (count == -1)
+					{ // If errno == EAGAIN, that means we have read all data. So go back to the main loop.
+						if (errno != EAGAIN)
 						{
-							if(iter->answer == "WRIT" || iter->answer == "WAIT")
-							{
-								client_buf.front().answer = "WAIT";
-								break;
-							}
-							else if(iter->answer == "READ")
-							{
-								client_buf.front().answer = "READ";
-								break;
-							}
+							perror ("read");
+							cerr << "Count error";
+							done = 1;
 						}
+						break;
 					}
-
-					if(secure_send(&client_buf.front()) == 0)
-						processed_client_buf.push_back(client_buf.front());
-					else
-						cerr << "ERROR in secure send";
-
-					#ifdef DEBUG
-						t = time(nullptr);
-						tm = *localtime(&t);
-						log_processing << put_time(&tm, "[%H:%M:%S %d-%m-%Y] ") << "RESPONSE to PID: " << client_buf.front().pid << " from socket " << client_buf.front().fd << ": " << client_buf.front().answer << endl;
-					#endif
-				}
-				else if(client_buf.front().operation == "WRIT")
-				{
-					#ifdef DEBUG
-						t = time(nullptr);
-						tm = *localtime(&t);
-						log_processing << put_time(&tm, "[%H:%M:%S %d-%m-%Y] ") << "PID: " << client_buf.front().pid << " from socket " << client_buf.front().fd << " wants to write " << client_buf.front().target << endl;
-					#endif
-					client_buf.front().answer = "WRIT";
-					for(auto iter = processed_client_buf.begin(); iter != processed_client_buf.end(); ++iter)
-					{
-						if(iter->target == client_buf.front().target )
-						{
-							if(iter->answer == "WRIT" || iter->answer == "WAIT")
-							{
-								client_buf.front().answer = "WAIT";
-								break;
-							}
-							else if(iter->answer == "READ")
-							{
-								client_buf.front().answer = "READ";
-								break;
-							}
-						}
+					else if (count == 0)
+					{ // End of file. The remote has closed the connection.
+						done = 1;
+						break;
 					}
-
-					if(secure_send(&client_buf.front()) == 0)
-						processed_client_buf.push_back(client_buf.front());
-					else
-						cerr << "ERROR in secure send";
-
-					#ifdef DEBUG
-						t = time(nullptr);
-						tm = *localtime(&t);
-						log_processing << put_time(&tm, "[%H:%M:%S %d-%m-%Y] ") << "RESPONSE to PID: " << client_buf.front().pid << " from socket " << client_buf.front().fd << ": " << client_buf.front().answer << endl;
-					#endif
+					conn->in.tail += (size_t)count;
 				}
-				else if(client_buf.front().operation == "DONE")
-				{
-					#ifdef DEBUG
-						t = time(nullptr);
-						tm = *localtime(&t);
-						log_processing << put_time(&tm, "[%H:%M:%S %d-%m-%Y] ") << "PID: " << client_buf.front().pid << " from socket " << client_buf.front().fd << " finished working with " << client_buf.front().target << endl;
-					#endif
-
-					for(auto iter = processed_client_buf.begin(); iter != processed_client_buf.end();)
-					{
-						if(iter->target == client_buf.front().target )
-						{
-							if(iter->pid == client_buf.front().pid)
-							{
-								#ifdef DEBUG
-									t = time(nullptr);
-									tm = *localtime(&t);
-									log_processing << put_time(&tm, "[%H:%M:%S %d-%m-%Y] ") << "PID: " << iter->pid << " from socket " << iter->fd << ": is DONE - SELF-DESTRUCTION" << endl;
-								#endif
-								iter = processed_client_buf.erase(iter);
-								continue;
-							}
-							else if(iter->answer == "WAIT")
-							{
-								iter->answer = "READ";
-								if(secure_send(&*iter) != 0)
-									cerr << "ERROR in secure send";
-
-								#ifdef DEBUG
-									t = time(nullptr);
-									tm = *localtime(&t);
-									log_processing << put_time(&tm, "[%H:%M:%S %d-%m-%Y] ") << "RESPONSE to PID: " << iter->pid << " from socket " << iter->fd << ": " << iter->answer << endl;
-								#endif
-							}
-						}
 
-						++iter;
-					}
+				if(parse_buffer(&conn->in, &st.client_buf, make_conn_id(my_data->id, events[i].data.fd, conn->gen)) != 0)
+				{
+					cerr << "Malformed message length on socket " << events[i].data.fd << ", closing\n";
+					trace_event(&st, TRACE_MALFORMED, make_conn_id(my_data->id, events[i].data.fd, conn->gen), 0, OP_NONE, string_view(conn->in.data.data() + conn->in.head, conn->in.tail - conn->in.head));
+					done = 1;
 				}
-				else
-					cerr << client_buf.front().operation << endl;
-
-				client_buf.pop_front();
-			}
+				st.fd_to_compact.push_back(events[i].data.fd);
 
-			#ifdef DEBUG
-			log_processing << "processed_client_buf after processing new requests \n************\n";
-			for(auto iter = processed_client_buf.begin(); iter != processed_client_buf.end(); ++iter)
-			{
-				log_processing << "PID " << iter->pid << " from socket " << iter->fd << " requested " << iter->operation << " " << iter->target << " advised " << iter->answer << endl;
+				if (done)
+					st.fd_to_remove.push_back(events[i].data.fd);
 			}
-			log_processing << "************\n end\n";
-			#endif
 		}
-		else
-			sleep(1);
-	}
 
-	for(auto iter = processed_client_buf.begin(); iter != processed_client_buf.end();)
-	{
-		iter->answer = "EXIT";
-//		cerr <<
-		secure_send(&*iter);
-		close(iter->fd);
+		mail_pending = finish_iteration(&st);
 	}
-	processed_client_buf.clear();
-
-	#ifdef DEBUG
-		log_processing.seekp(0, std::ios_base::end);
-		t = time(nullptr);
-		tm = *localtime(&t);
-		log_processing << put_time(&tm, "[%H:%M:%S %d-%m-%Y] ") << "Time to exit\n";
-		log_processing.close();
-	#endif
 
+	shutdown_connections(&st);
+	trace_event(&st, TRACE_STOP, 0, 0, OP_NONE, "");
 	pthread_exit(NULL);
 }
 
 /*!
-Initializes socket on port 'port' and waits for connections. On incomming connection sets associated socket to async mode
-and stores in fd_struct structure which is shared with processing thread.
+Initializes nonblocking socket listening on port 'port'.
+Every shard has its own listening socket with SO_REUSEPORT, so the kernel spreads connections between them.
 \param[in] port Port used to create listening socket.
-\param[in] clients queue that stores file descriptors(sockets) accepted on port 'port'.
-\returns status code
+\returns socket descriptor
 */
-int accept_connections(uint16_t port, queue <fd_struct> *clients)
+int open_listener(uint16_t port)
 {
-	std::string rcv;
-	int listen_fd, comm_fd;
+	int listen_fd;
 	struct sockaddr_in servaddr;
-	std::ofstream log_main;
-	log_main.open("incoming.log", std::ios::out | std::ios::app);
-	#ifdef DEBUG
-		auto t = time(nullptr);
-		auto tm = *localtime(&t);
-		log_main << put_time(&tm, "[%H:%M:%S %d-%m-%Y] ") << "Thread created\n";
-	#endif
 
-	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
 
 	if (listen_fd == -1)
 	{
@@ -689,15 +1435,14 @@ int accept_connections(uint16_t port, queue <fd_struct> *clients)
 		exit(1);
 	}
 
+	int reuse = 1;
+	if(setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof reuse) < 0)
+		perror("setsockopt");
+
 	memset( &servaddr, 0, sizeof(servaddr));
 	servaddr.sin_family = AF_INET;
 	servaddr.sin_addr.s_addr = htons(INADDR_ANY);
 	servaddr.sin_port = htons(port);
-	#ifdef DEBUG
-		t = time(nullptr);
-		tm = *localtime(&t);
-		log_main << put_time(&tm, "[%H:%M:%S %d-%m-%Y] ") << "Attempting to listen on " << port << " port\n";
-	#endif
 	int my_timer = 20;
 
 	while(my_timer > 0)
@@ -709,7 +1454,7 @@ int accept_connections(uint16_t port, queue <fd_struct> *clients)
 		my_timer--;
 	}
 
-	if(my_timer == 0)
+	if(my_timer == 0 || listen(listen_fd, SOMAXCONN) < 0)
 	{
 		cout << "Binding to socket error." << endl;
 		exit_code = 1;
@@ -717,116 +1462,333 @@ int accept_connections(uint16_t port, queue <fd_struct> *clients)
 		sleep(10);
 		exit(2);
 	}
-	#ifdef DEBUG
-		t = time(nullptr);
-		tm = *localtime(&t);
-		log_main << put_time(&tm, "[%H:%M:%S %d-%m-%Y] ") << "Successful bind to the socket\n";
-	#endif
 
-	fd_struct temp;
+	return listen_fd;
+}
 
-	while(!time_to_exit)
+/*!
+Opens nonblocking Unix domain socket for workers on this node, shared by all shards.
+A socket left by a previous run is replaced, any other file at the path is an error.
+\param[in] path Path of the socket.
+\returns socket descriptor, -1 on error
+*/
+int open_local_listener(const string &path)
+{
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	if(path.size() >= sizeof addr.sun_path)
 	{
-		listen(listen_fd, 60);
-		#ifdef DEBUG
-			t = time(nullptr);
-			tm = *localtime(&t);
-			log_main << put_time(&tm, "[%H:%M:%S %d-%m-%Y] ") << "Waiting for incoming connections.\n";
-			log_main.flush();
-		#endif
-		sockaddr_in clientAddr;
-		socklen_t sin_size=sizeof(struct sockaddr_in);
-		comm_fd = accept(listen_fd, (struct sockaddr*)&clientAddr, &sin_size);
+		cerr << "Socket path is too long: " << path << endl;
+		return -1;
+	}
+	memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+	struct stat info;
+	if(lstat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode))
+		unlink(path.c_str());
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd < 0 || bind(fd, (sockaddr *)&addr, sizeof addr) < 0 || listen(fd, SOMAXCONN) < 0)
+	{
+		perror(path.c_str());
+		if(fd >= 0)
+			close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*!
+Accepts every pending connection of the listening socket and registers it in epoll. Accepted sockets are already nonblocking.
+\param[in] st Scheduler state.
+\param[in] efd epoll descriptor of the shard.
+\param[in] listen_fd TCP listener of the shard or the shared Unix domain listener.
+\returns 0, or -1 if socket can not be added to epoll
+*/
+int accept_connections(scheduler_state *st, int efd, int listen_fd)
+{
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLET;
+
+	while(1)
+	{
+		int comm_fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK);
 
 		if(comm_fd == -1)
 		{
-			cout << "Connection acceptance error." << endl;
-			//		exit(3);
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if(errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("accept");
+			return 0;
 		}
-
-		#ifdef DEBUG
-			t = time(nullptr);
-			tm = *localtime(&t);
-			char loc_addr[INET_ADDRSTRLEN+1];
-			inet_ntop(AF_INET, &(clientAddr.sin_addr), loc_addr, INET_ADDRSTRLEN);
-			log_main << put_time(&tm, "[%H:%M:%S %d-%m-%Y] ") << "Incoming connenction on descriptor " << comm_fd << " from " << loc_addr << ":" << clientAddr.sin_port <<"\n";
-		#endif
-		//		make nonblocking
-		auto flags = fcntl (comm_fd, F_GETFL, 0);
-		if (flags < 0)
+		if(comm_fd > 0xFFFFFF)
 		{
-			perror ("fcntl");
-			return -1;
+			cout << "Too many open descriptors, rejecting connection." << endl;
+			close(comm_fd);
+			continue;
 		}
 
-		flags |= O_NONBLOCK;
-		auto s = fcntl (comm_fd, F_SETFL, flags);
-
-		if(s < 0)
+		auto c = register_connection(st, comm_fd);
+		event.data.fd = comm_fd;
+		if( epoll_ctl(efd, EPOLL_CTL_ADD, comm_fd, &event) == -1)
 		{
-			perror ("fcntl");
-			time_to_exit = true;
-			log_main.close();
+			perror ("epoll_ctl");
+			cerr << "EPOLL ERROR\n";
+			close(comm_fd);
+			c->open = false;
+			gauge_add(st->self->metrics.connections, -1);
 			return -1;
 		}
-		#ifdef DEBUG
-			t = time(nullptr);
-			tm = *localtime(&t);
-			log_main << put_time(&tm, "[%H:%M:%S %d-%m-%Y] ") << "Switched " << comm_fd <<" to nonblocking mode.\n";
-		#endif
-
-		temp.fd = comm_fd;
-
-		pthread_mutex_lock(&lock);
-			clients->push(temp);
-		pthread_mutex_unlock(&lock);
-		#ifdef DEBUG
-			t = time(nullptr);
-			tm = *localtime(&t);
-			log_main << put_time(&tm, "[%H:%M:%S %d-%m-%Y] ") << "Successfully pushed into queue for further processing.\n";
-		#endif
 	}
+}
 
-	#ifdef DEBUG
-	log_main.close();
-	#endif
+/*!
+Parses a number of bytes, optionally followed by one of the suffixes K, M, G or T.
+\param[in] text Value of the option.
+\param[out] bytes Parsed number.
+\returns false if the text is anything else or the number does not fit
+*/
+static bool parse_bytes(const char *text, uint64_t *bytes)
+{
+	// strtoull() would take spaces and a sign as well
+	if(*text < '0' || *text > '9')
+		return false;
+	char *unit = nullptr;
+	errno = 0;
+	uint64_t value = strtoull(text, &unit, 10);
+	if(errno == ERANGE)
+		return false;
+	const char *units = "KMGT";
+	unsigned shift = 0;
+	if(*unit != '\0')
+	{
+		const char *scale = strchr(units, *unit);
+		if(scale == nullptr || unit[1] != '\0')
+			return false;
+		shift = 10 * (unsigned)(scale - units + 1);
+	}
+	if(value > (UINT64_MAX >> shift))
+		return false;
+	*bytes = value << shift;
+	return true;
+}
 
-	return 0;
+static void usage(const char *program)
+{
+	cerr << "Usage: " << program << " [-t threads] [-p port] [-u] [-j journal_dir | -n] [-r reuse_dir] [-l lease_seconds] [-T trace_level] [-m metrics_port] [-R replica_port] [-S primary_host:replica_port] [-k read_tokens [-K wave_ms]] [-U socket_path] [-q node_writers] [-Q writers] [-B disk_budget]\n";
 }
 
 /*!
-Nothing fancy. Creates a thread and launches connection accepting function
+Nothing fancy. Opens listening socket and creates processing thread for every shard.
+Options: -t number of processing threads (shards), -p port to listen on, -u use io_uring instead of epoll,
+-j directory for journal and snapshot (current by default), -n do not keep journal,
+-r reuse directory to scan on start and watch for changes, -l writer lease in seconds (renewed by BEAT),
+-T trace level written to scheduler.trace (0 by default, SIGUSR1 switches to the next one),
+-m port of the metrics endpoint on localhost (Prometheus text format, off by default),
+-R port to stream state to a standby scheduler, -S host:port run as standby of that primary until it is lost,
+-k waiters woken by DONE at once, the rest get READ as readers send DONE, -K ms wake -k more waiters every ms instead,
+-U path of Unix domain socket for workers on this node, which may switch to shared memory with SHMR,
+-q writers at once on one node, -Q writers at once on all nodes (both unlimited by default),
+-B bytes files of ready targets may take (suffix K, M, G or T), over it idle workers get EVCT.
 \returns status code to OS
-\param clients data structure to store fd
 */
-int main()
+int main(int argc, char *argv[])
 {
-	queue <fd_struct> clients;
-	pthread_t threads[1];
+	uint16_t port = 1987;
+	int opt;
+	void *(*processing_loop)(void *) = read_and_respond;
+	string journal_dir = ".";
+	bool use_journal = true;
+	string reuse_dir;
+	uint16_t metrics_port = 0;
+	uint16_t replica_port = 0;
+	string primary;
+	string local_path;
+
+	while((opt = getopt(argc, argv, "t:p:uj:nr:l:T:m:R:S:k:K:U:q:Q:B:")) != -1)
+	{
+		switch(opt)
+		{
+			case 't':
+				shard_count = strtoul(optarg, nullptr, 10);
+				break;
+			case 'p':
+				port = (uint16_t)strtoul(optarg, nullptr, 10);
+				break;
+			case 'u':
+				if(!uring_supported())
+				{
+					cerr << "io_uring is not available\n";
+					return 1;
+				}
+				processing_loop = uring_read_and_respond;
+				break;
+			case 'j':
+				journal_dir = optarg;
+				break;
+			case 'n':
+				use_journal = false;
+				break;
+			case 'r':
+				reuse_dir = optarg;
+				break;
+			case 'l':
+				lease_ticks = strtoull(optarg, nullptr, 10) * 1000 / TIMER_TICK_MS;
+				break;
+			case 'T':
+				trace_level = std::min(atoi(optarg), (int)TRACE_ALL);
+				break;
+			case 'm':
+				metrics_port = (uint16_t)strtoul(optarg, nullptr, 10);
+				break;
+			case 'R':
+				replica_port = (uint16_t)strtoul(optarg, nullptr, 10);
+				break;
+			case 'S':
+				primary = optarg;
+				break;
+			case 'k':
+				read_tokens = strtoul(optarg, nullptr, 10);
+				break;
+			case 'K':
+				wave_ms = strtoull(optarg, nullptr, 10);
+				break;
+			case 'U':
+				local_path = optarg;
+				break;
+			case 'q':
+				quota.node_max = strtoul(optarg, nullptr, 10);
+				break;
+			case 'Q':
+				quota.total_max = strtoul(optarg, nullptr, 10);
+				break;
+			case 'B':
+				if(parse_bytes(optarg, &disk_budget))
+					break;
+				usage(argv[0]);
+				return 1;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if(shard_count < 1 || shard_count > MAX_SHARDS)
+	{
+		cerr << "Number of threads should be between 1 and " << MAX_SHARDS << endl;
+		return 1;
+	}
+	if(wave_ms != 0 && read_tokens == 0)
+	{
+		cerr << "Waves of readers (-K) need their size (-k)\n";
+		return 1;
+	}
 
+	shutdown_fd = eventfd(0, EFD_NONBLOCK);
 	signal(SIGINT, signalHandler);
+	signal(SIGALRM, alarmHandler);
+	signal(SIGUSR1, traceToggleHandler);
 
-	if (pthread_mutex_init(&lock, NULL) != 0)
-	{
-		printf("\n mutex init failed\n");
+	// Standby does not listen until the primary is lost
+	vector <string> replicated;
+	vector <taken_writer> writers;
+	if(!primary.empty() && replica_follow(primary, &replicated, &writers) != 0)
+		return exit_code;
+
+	int local_fd = -1;
+	if(!local_path.empty() && (local_fd = open_local_listener(local_path)) < 0)
 		return 1;
-	}
 
-	int rc = pthread_create(&threads[0], NULL, read_and_respond, (void *)&clients);
-	if (rc)
+	shards = new shard[shard_count];
+	for(size_t s = 0; s < shard_count; ++s)
 	{
-		cout << "Error:unable to create thread," << rc << endl;
-		exit_code = -1;
-		time_to_exit = true;
-		sleep(10);
-		return exit_code;
+		shards[s].id = s;
+		shards[s].watch_fd = -1;
+		shards[s].local_fd = local_fd;
+		shards[s].listen_fd = open_listener(port);
+		shards[s].mail_fd = eventfd(0, EFD_NONBLOCK);
+		if(shards[s].mail_fd < 0 || shutdown_fd < 0)
+		{
+			printf("\n shard init failed\n");
+			return 1;
+		}
+		shards[s].inbox.resize(shard_count);
+		for(size_t src = 0; src < shard_count; ++src)
+		{
+			if(src == s)
+				continue;
+			shards[s].inbox[src].reset(new mailbox());
+			shards[s].inbox[src]->head = 0;
+			shards[s].inbox[src]->tail = 0;
+		}
+	}
 
+	if(use_journal)
+	{
+		vector <string> ready;
+		if(journal_open(journal_dir, &ready) != 0)
+		{
+			cerr << "Can not open journal in " << journal_dir << endl;
+			return 1;
+		}
+		for(auto &name : ready)
+			shards[shard_of(name)].preload.push_back(std::move(name));
 	}
+	if(!reuse_dir.empty())
+	{
+		vector <string> found;
+		if(reuse_dir_open(reuse_dir, &found) != 0)
+		{
+			cerr << "Can not watch reuse directory " << reuse_dir << endl;
+			return 1;
+		}
+		for(auto &name : found)
+			shards[shard_of(name)].preload.push_back(std::move(name));
+		shards[0].watch_fd = reuse_dir_fd();
+	}
+	journal_import(replicated);
+	for(auto &name : replicated)
+		shards[shard_of(name)].preload.push_back(std::move(name));
+	for(auto &w : writers)
+		shards[shard_of(w.target)].preload_writers.push_back(std::move(w));
 
-	accept_connections(1987, &clients);
+	if(metrics_port != 0 && metrics_open(metrics_port) != 0)
+		return 1;
+	if(replica_port != 0 && replica_serve(replica_port) != 0)
+		return 1;
+	trace_open();
+	vector <pthread_t> threads(shard_count);
+	for(size_t s = 0; s < shard_count; ++s)
+	{
+		int rc = pthread_create(&threads[s], NULL, processing_loop, (void *)&shards[s]);
+		if (rc)
+		{
+			cout << "Error:unable to create thread," << rc << endl;
+			exit_code = -1;
+			time_to_exit = true;
+			sleep(10);
+			return exit_code;
+		}
+	}
 
-	pthread_join(rc, NULL);
-	pthread_mutex_destroy(&lock);
+	for(size_t s = 0; s < shard_count; ++s)
+		pthread_join(threads[s], NULL);
+	journal_close();
+	replica_close();
+	trace_close();
+	metrics_close();
+	for(size_t s = 0; s < shard_count; ++s)
+	{
+		close(shards[s].listen_fd);
+		close(shards[s].mail_fd);
+	}
+	if(local_fd >= 0)
+	{
+		close(local_fd);
+		unlink(local_path.c_str());
+	}
+	close(shutdown_fd);
+	delete[] shards;
 
 	return exit_code;
 }
@@ -0,0 +1,490 @@
+/** @file file_scheduler.h*/
+/** Declarations shared by the processing loops of the scheduler.
+ */
+#ifndef FILE_SCHEDULER_H
+#define FILE_SCHEDULER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <atomic>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#include "decision_engine.h"
+#include "trace.h"
+#include "wire.h"
+
+using std::string;
+using std::string_view;
+using std::vector;
+using std::deque;
+
+// One server generates around 20-25 events.
+// For 4 nodes I expect 100 events for cluster
+#define MAXEVENTS 500
+// Longest accepted message body. Anything longer means garbage in the stream.
+#define MAX_FRAME 65536
+// Initial size of per-connection receive buffer
+#define RECV_BUF_SIZE 4096
+// Client that does not read its answers is dropped when this much is waiting to be sent
+#define MAX_OUTPUT (1 << 20)
+// Upper limit of processing threads. Set of shards a connection talks to is kept in 64-bit mask.
+#define MAX_SHARDS 64
+// Capacity of a mailbox between two shards, power of two
+#define MAILBOX_SIZE 256
+// Nodes whose writers are counted separately (-q and metrics), power of two. Further nodes count towards -Q only.
+#define QUOTA_NODES 1024
+
+// Metrics: targets listed as the hottest ones, buckets of latency histograms (the last one is +Inf)
+#define HOT_TARGETS 10
+#define LATENCY_BUCKETS 16
+// Counters by operation code, unknown operations are counted as OP_OTHER
+#define METRIC_OPS (OP_OTHER + 1)
+
+/*! Parsed request.
+'operation' and 'target' point into receive buffer of the connection
+and stay valid until the buffer is compacted at the end of event loop iteration.*/
+struct client_buffer
+{
+	int pid;
+	op_code op; ///resolved from 'operation' by the parser
+	uint64_t conn; ///connection id, see make_conn_id()
+	string_view operation; ///text, for records of the replication stream and for logs
+	string_view target; ///for BTCH: operation and all targets, separated by '#'
+	uint64_t tag; ///batch and position in it, see batch_tag(); request id, see is_request_id(); 0 for a request without id
+	uint32_t node; ///node of the worker, for requests forwarded by other shards only
+	uint64_t hash; ///target given by target_hash() only, 'target' is empty then
+	uint64_t size; ///bytes of the written file told by DONE, 0 if not known
+	uint32_t hops; ///WORK: shards asked before, see dispatch_work(); never taken from the worker
+};
+
+//! Protocol of a connection, told by its first byte.
+enum wire_protocol : uint8_t
+{
+	PROTOCOL_UNKNOWN,
+	PROTOCOL_TEXT, ///"len#pid#OP#target", see parse_buffer()
+	PROTOCOL_BINARY ///wire_request, see wire.h
+};
+
+/*! Receive buffer with resumable parser state.
+Bytes [head, tail) are not consumed yet. Header of the next message is validated up to head + scan.*/
+struct recv_buffer
+{
+	vector <char> data;
+	size_t head;
+	size_t tail;
+	size_t scan; ///length prefix characters already checked
+	size_t frame_len; ///value of length prefix accumulated so far
+	wire_protocol protocol;
+};
+
+/*! Answers waiting to be sent. Bytes from head to the end of data are not sent yet.
+Everything queued during one event loop iteration is sent with one call.*/
+struct send_buffer
+{
+	vector <char> data;
+	size_t head;
+	bool queued; ///connection is in the list to flush
+	bool blocked; ///socket buffer is full, wait for EPOLLOUT
+	bool armed; ///EPOLLOUT is enabled in epoll
+	// io_uring backend: 'sending' is given to the kernel, new answers are collected in 'data' meanwhile
+	vector <char> sending;
+	size_t sent;
+	bool busy; ///send is in flight
+};
+
+/*! BTCH request waiting for answers on its targets, some of them may come from other shards.
+Answers of the batch are sent together, in one frame, when the last one is known.*/
+struct pending_batch
+{
+	uint32_t serial;
+	string answers; ///four characters per target, blank until known
+	size_t missing; ///targets without answer
+};
+
+//! Per-connection data, indexed by file descriptor.
+struct connection
+{
+	bool open;
+	uint32_t gen; ///incremented every time descriptor is reused
+	uint64_t remote_shards; ///shards that got requests from this connection
+	recv_buffer in;
+	send_buffer out;
+	vector <holding> holdings; ///one entry per role on targets of the own shard
+	vector <pending_batch> batches; ///in the order of requests, a few at most
+	uint32_t batch_serial; ///of the last BTCH request
+	uint32_t node; ///IPv4 address of the peer, shared by all workers of a node
+	bool local; ///accepted on the Unix domain socket
+	struct shm_channel *shm; ///rings shared with the worker after SHMR, nullptr for the socket
+	int shm_event; ///eventfd that wakes the worker up, valid with 'shm' only
+	// io_uring backend
+	unsigned inflight; ///submitted operations that did not complete yet
+	bool zombie; ///closed by the scheduler, descriptor is closed when the last operation completes
+	bool parse_pending; ///data was received during current iteration
+};
+
+// The index grows while requests parsed in the same iteration still point into receive buffers:
+// connections have to be moved then, a copy would free the buffers
+static_assert(std::is_nothrow_move_constructible <connection>::value, "growing the index must not copy receive buffers");
+
+enum mail_type
+{
+	MAIL_REQUEST, ///request forwarded to the shard that owns the target
+	MAIL_ANSWER, ///answer to be sent by the shard that owns the connection
+	MAIL_DISCONNECT, ///connection is closed, release everything it holds
+	MAIL_FILE_READY, ///file of the target appeared in reuse directory
+	MAIL_FILE_GONE, ///file of the target was deleted from reuse directory
+	MAIL_DEPENDENT, ///target is an input of the target with 'hash', see engine_add_dependent()
+	MAIL_INPUT_READY, ///an input of the target with 'hash' is ready, see engine_input()
+	MAIL_INPUT_GONE ///an input of the target with 'hash' is not ready anymore
+};
+
+//! Message passed between shards.
+struct mail
+{
+	mail_type type;
+	op_code op = OP_NONE; ///operation of the request, or the answer
+	uint64_t conn;
+	int pid;
+	string target; ///for answers: target of a BTCH answer, body of HINT, target of NTFY or PREF
+	uint64_t tag = 0; ///batch of the request or answer, see client_buffer
+	uint32_t node = 0; ///node of the worker that sent the request
+	uint64_t hash = 0; ///target of the request given by hash only, or the dependent target of MAIL_DEPENDENT and MAIL_INPUT_*
+	uint64_t size = 0; ///see client_buffer
+	uint32_t hops = 0; ///see client_buffer
+};
+
+/*! Lock-free single producer single consumer ring.
+Every pair of shards has its own mailbox, so no locking is needed.*/
+struct mailbox
+{
+	alignas(64) std::atomic <size_t> head; ///next slot to read, written by consumer
+	alignas(64) std::atomic <size_t> tail; ///next slot to write, written by producer
+	alignas(64) mail slots[MAILBOX_SIZE];
+};
+
+/*! Histogram of durations. Written by one processing thread only, so plain loads and stores of atomics are enough.
+Counts are kept per bucket, the metrics endpoint makes them cumulative.*/
+struct latency_histogram
+{
+	std::atomic <uint64_t> buckets[LATENCY_BUCKETS] = {};
+	std::atomic <uint64_t> sum_us = {};
+};
+
+//! Target with most requests.
+struct hot_target
+{
+	string name;
+	uint64_t requests;
+	uint64_t waits;
+};
+
+/*! Counters of one processing thread, read by the metrics endpoint.
+Only the owner thread writes them, the endpoint never blocks it: the list of hot targets
+is published with try_lock and skipped when the endpoint is reading it.*/
+struct shard_metrics
+{
+	alignas(64) std::atomic <uint64_t> requests[METRIC_OPS] = {}; ///by operation code, from own connections only
+	std::atomic <uint64_t> answers[METRIC_OPS] = {}; ///READ, WRIT, WAIT, WORK, IDLE and EVCT decisions
+	std::atomic <int64_t> connections = {};
+	std::atomic <int64_t> waiters = {}; ///updated at the end of every iteration
+	std::atomic <int64_t> targets = {}; ///updated at the end of every iteration
+	std::atomic <int64_t> deferred = {}; ///targets whose writer waits for a writer slot, also tells quota_wake() whom to wake
+	std::atomic <int64_t> ready_bytes = {}; ///see decision_engine::ready_bytes, updated at the end of every iteration
+	latency_histogram wait_read; ///WAIT until READ
+	latency_histogram wait_writ; ///WAIT until WRIT after the writer was lost
+	latency_histogram hold_done; ///WRIT until DONE
+	latency_histogram hold_lost; ///WRIT until the writer disconnected or its lease expired
+	std::mutex hot_lock;
+	vector <hot_target> hot;
+};
+
+/*! Data shared between processing thread and the rest of the program.
+Targets are distributed between shards by hash, every shard has its own epoll and listening socket.*/
+struct shard
+{
+	size_t id;
+	int listen_fd; ///nonblocking listening socket, accepted from the processing thread
+	int local_fd; ///Unix domain socket listener shared by all shards, -1 without -U
+	int mail_fd; ///eventfd signalled when other shards post mail
+	vector <std::unique_ptr <mailbox>> inbox; ///inbox[src] keeps mail from shard src
+	vector <string> preload; ///ready targets restored from journal or found on disk, moved to the table on start
+	vector <taken_writer> preload_writers; ///targets written or evicted when the former primary was lost
+	int watch_fd; ///inotify descriptor of reuse directory, handled by the first shard only, otherwise -1
+	struct trace_ring *trace; ///written by the processing thread, emptied by trace writer
+	shard_metrics metrics;
+};
+
+//! Writers of one node, shared by all shards.
+struct node_writers
+{
+	std::atomic <uint32_t> node; ///IPv4 address in network order, 0 - free entry
+	std::atomic <int64_t> writers; ///holding a writer slot now
+	std::atomic <uint64_t> granted; ///slots taken, total
+	std::atomic <uint64_t> refused; ///slots refused by -q or -Q, total, a deferred writer may be refused more than once
+};
+
+//! Writer slots of the cluster, see quota.cpp.
+struct writer_quota
+{
+	size_t node_max; ///-q, 0 - unlimited
+	size_t total_max; ///-Q, 0 - unlimited
+	alignas(64) std::atomic <int64_t> writers; ///holding a writer slot now, on all nodes
+	std::atomic <uint64_t> refused; ///slots refused by -Q, total
+	alignas(64) std::atomic <uint64_t> released; ///slots given back, total, shards compare it with their last look
+	node_writers nodes[QUOTA_NODES];
+};
+
+/*! Trace records of one processing thread, single producer single consumer.
+Records are dropped and counted when it is full.*/
+struct trace_ring
+{
+	alignas(64) std::atomic <size_t> head; ///next record to write to the file, written by trace writer
+	alignas(64) std::atomic <size_t> tail; ///next free record, written by processing thread
+	alignas(64) std::atomic <size_t> dropped;
+	trace_record records[TRACE_RING_SIZE];
+};
+
+//! Connection that is told when a target becomes ready.
+struct subscriber
+{
+	uint64_t conn;
+	uint64_t tag; ///request id of SUBS or PREF, given back with NTFY and PREF
+	uint32_t node; ///node of the worker
+	bool prefetch; ///came with PREF, may be asked to warm the page cache of its node
+};
+
+//! Subscribers of one target name or prefix.
+struct subscription
+{
+	string key; ///target name, or prefix without '*'
+	vector <subscriber> subscribers;
+};
+
+/*! Subscriptions on targets of the shard, see subscriptions.cpp. Both tables are keyed by target_hash() of the key.
+Every shard keeps every prefix: a finished target looks up the hashes of its beginnings of the lengths in use.*/
+struct subscription_table
+{
+	std::unordered_map <uint64_t, subscription> exact; ///answered once, then dropped
+	std::unordered_map <uint64_t, subscription> prefixes; ///kept until the connection is closed
+	std::map <size_t, size_t> prefix_lengths; ///prefixes of each length
+	std::unordered_map <uint64_t, size_t> counts; ///subscriptions kept for each connection
+	vector <uint32_t> prefetching; ///nodes asked to prefetch the target being notified
+};
+
+//! WRIT or WORK answer waiting until the standby scheduler has the grant.
+struct held_answer
+{
+	uint64_t conn;
+	uint64_t seq; ///replication batch with the grant
+	uint64_t tag; ///of the request, see client_buffer
+	string target; ///answers to BTCH and WORK only
+	op_code answer;
+};
+
+//! Everything the processing thread knows about targets and clients.
+struct scheduler_state
+{
+	shard *self;
+	int efd; ///epoll descriptor of the shard
+	decision_engine engine; ///targets of the shard
+	vector <connection> connections;
+	vector <int> to_flush; ///connections with queued answers
+	vector <int> shm_fds; ///connections served through shared memory
+	vector <int> shm_blocked; ///shared memory connections whose answers did not fit into the ring
+	std::unordered_map <uint64_t, vector <holding>> remote_holdings; ///roles held by connections of other shards
+	vector <deque <mail>> outbox; ///mail not yet delivered to other shards, by destination
+	struct uring *ring; ///io_uring backend, nullptr when epoll is used
+	string journal_buf; ///journal records of current iteration
+	string replica_buf; ///replication records of current iteration
+	uint64_t replica_seq; ///last replication batch handed over
+	vector <held_answer> held; ///WRIT and WORK answers waiting for the standby, oldest first
+	subscription_table subs;
+	vector <hot_target> hot; ///hottest targets, copied for the metrics endpoint from time to time
+	uint64_t hot_min; ///requests of the coldest entry in 'hot'
+	uint64_t hot_published; ///steady_us() of the last publication
+	bool hot_dirty; ///'hot' changed since the last publication
+	uint64_t quota_seen; ///writer_quota::released when deferred writers were promoted last time
+	bool quota_released; ///writer slots were given back during the iteration
+
+	// Collected during one event loop iteration
+	vector <client_buffer> client_buf; ///parsed requests
+	vector <int> fd_to_compact; ///connections whose receive buffer was parsed
+	vector <int> fd_to_remove; ///connections to close
+	vector <mail> received; ///mail from other shards
+	vector <uint64_t> conn_to_release; ///connections of other shards that were closed
+};
+
+int parse_buffer(recv_buffer *in, vector <client_buffer> *client_buf, uint64_t conn);
+int secure_send(int fd, const string &answer);
+void queue_answer(scheduler_state *st, int fd, string_view answer);
+int flush_connection(scheduler_state *st, int fd);
+connection *get_connection(scheduler_state *st, int fd);
+int deliver(scheduler_state *st, uint64_t conn, op_code answer, uint64_t tag = 0, string_view target = {});
+void dispatch_request(scheduler_state *st, const client_buffer *request);
+void release_connection(scheduler_state *st, uint64_t conn);
+void close_connection(scheduler_state *st, int fd);
+bool flush_mail(scheduler_state *st);
+void collect_mail(scheduler_state *st, vector <mail> *received);
+void compact_buffer(recv_buffer *in);
+bool finish_iteration(scheduler_state *st);
+int iteration_timeout(const scheduler_state *st);
+void shutdown_connections(scheduler_state *st);
+connection *register_connection(scheduler_state *st, int fd);
+void init_engine(scheduler_state *st);
+void file_changed(scheduler_state *st, string_view target, bool exists);
+void *read_and_respond(void * threadarg);
+int open_listener(uint16_t port);
+int open_local_listener(const string &path);
+int accept_connections(scheduler_state *st, int efd, int listen_fd);
+
+// uring_loop.cpp
+bool uring_supported();
+void *uring_read_and_respond(void * threadarg);
+int uring_flush(scheduler_state *st, int fd);
+void uring_release_socket(scheduler_state *st, int fd);
+
+// shm_channel.cpp
+void shm_attach(scheduler_state *st, const client_buffer *request);
+void shm_receive(scheduler_state *st);
+int shm_flush(scheduler_state *st, int fd);
+bool shm_idle(scheduler_state *st);
+void shm_detach(scheduler_state *st, int fd);
+
+// subscriptions.cpp
+void subscribe(scheduler_state *st, const client_buffer *request, string_view target, uint32_t node);
+void notify_subscribers(scheduler_state *st, target_entry *target);
+void unsubscribe(scheduler_state *st, uint64_t conn);
+
+// quota.cpp
+bool quota_admit(void *ctx, uint32_t node);
+void quota_leave(void *ctx, uint32_t node);
+void quota_promote(scheduler_state *st);
+void quota_wake(scheduler_state *st);
+
+// journal.cpp
+int journal_open(const string &dir, vector <string> *ready);
+void journal_close();
+void journal_import(const vector <string> &ready);
+void journal_record(scheduler_state *st, char type, string_view target);
+void journal_submit(scheduler_state *st);
+
+// replica.cpp
+int replica_serve(uint16_t port);
+void replica_close();
+void replica_record(scheduler_state *st, char type, int pid, string_view target);
+bool replica_hold(scheduler_state *st, uint64_t conn, op_code answer, uint64_t tag, string_view target);
+void replica_release(scheduler_state *st);
+void replica_submit(scheduler_state *st);
+int replica_follow(const string &primary, vector <string> *ready, vector <taken_writer> *writers);
+
+// trace.cpp
+void trace_write(shard *self, trace_type type, uint64_t conn, int pid, uint8_t op, string_view text, uint64_t arg);
+uint8_t trace_op(op_code op);
+void trace_open();
+void trace_close();
+void traceToggleHandler(int);
+
+// metrics.cpp
+uint64_t steady_us();
+void metrics_observe(latency_histogram *h, uint64_t since);
+void metrics_count_target(scheduler_state *st, target_entry *target, bool waited);
+void metrics_publish(scheduler_state *st);
+int metrics_timeout(const scheduler_state *st);
+int metrics_open(uint16_t port);
+void metrics_close();
+
+// reuse_dir.cpp
+int reuse_dir_open(string dir, vector <string> *ready);
+int reuse_dir_fd();
+void reuse_dir_events(scheduler_state *st);
+
+extern shard *shards;
+extern size_t shard_count;
+extern bool time_to_exit;
+extern int exit_code;
+extern int shutdown_fd;
+extern uint64_t lease_ticks;
+extern size_t read_tokens;
+extern uint64_t wave_ms;
+extern uint64_t disk_budget;
+extern std::atomic <int> trace_level;
+extern writer_quota quota;
+
+//! Connection id: shard in bits 56-63, descriptor generation in 24-55, descriptor in 0-23.
+static inline uint64_t make_conn_id(size_t shard_id, int fd, uint32_t gen)
+{
+	return ((uint64_t)shard_id << 56) | ((uint64_t)gen << 24) | (uint64_t)fd;
+}
+
+static inline size_t conn_shard(uint64_t conn)
+{
+	return (size_t)(conn >> 56);
+}
+
+static inline int conn_fd(uint64_t conn)
+{
+	return (int)(conn & 0xFFFFFF);
+}
+
+//! Tag of a target in BTCH request: serial of the batch on its connection in bits 32-63, position + 1 in 0-31.
+static inline uint64_t batch_tag(uint32_t serial, size_t position)
+{
+	return ((uint64_t)serial << 32) | (uint64_t)(position + 1);
+}
+
+//! Tag that is a request id given by the worker. Serials of batches start at 1, so their tags never fit into 32 bits.
+static inline bool is_request_id(uint64_t tag)
+{
+	return tag != 0 && (tag >> 32) == 0;
+}
+
+//! SUBS or PREF of every target whose name starts with the text before the final '*'.
+static inline bool is_prefix_subscription(const client_buffer *request)
+{
+	return (request->op == OP_SUBS || request->op == OP_PREF) && !request->target.empty() && request->target.back() == '*';
+}
+
+//! Answers that are followed by text: HINT by its body, NTFY, PREF, WORK and EVCT by the target name.
+static inline bool answer_has_body(op_code answer)
+{
+	return answer == OP_HINT || answer == OP_NTFY || answer == OP_PREF || answer == OP_WORK || answer == OP_EVCT;
+}
+
+/*!
+Adds to counter of the own shard. Single writer, so no read-modify-write instruction is needed.
+*/
+static inline void metric_add(std::atomic <uint64_t> &counter, uint64_t n = 1)
+{
+	counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+static inline void gauge_add(std::atomic <int64_t> &gauge, int64_t n)
+{
+	gauge.store(gauge.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+/*!
+Traces event if current trace level includes it. Costs one relaxed load when tracing is off.
+\param[in] st Scheduler state.
+\param[in] type Event.
+\param[in] conn Connection id.
+\param[in] pid Worker process id.
+\param[in] op Operation or answer.
+\param[in] text Target name or other text.
+\param[in] arg Size, hash or count that goes with the event, see trace_record.
+*/
+static inline void trace_event(scheduler_state *st, trace_type type, uint64_t conn, int pid, op_code op, string_view text, uint64_t arg = 0)
+{
+	if(trace_level.load(std::memory_order_relaxed) >= (type >= TRACE_REQUEST ? TRACE_ALL : TRACE_DECISIONS))
+		trace_write(st->self, type, conn, pid, trace_op(op), text, arg);
+}
+
+#endif
@@ -0,0 +1,365 @@
+/** @file journal.cpp*/
+/** Write-ahead journal of target state transitions.
+**
+** Processing threads append records to their own buffer during an iteration and hand it
+** over at the end of the iteration. Journal thread collects buffers of all shards,
+** writes them with one write and one fdatasync (group commit), so the request path never waits for the disk.
+** Records of the last JOURNAL_INTERVAL_MS may be lost on crash - at worst such a file is generated again.
+**
+** Record format is the same as for requests: len#T#target, where len counts the bytes after the first '#'
+** and T is one of W (writer granted), E (worker deletes the file of an evicted target), D (writer finished,
+** file is ready), L (writer lost, or the evicting worker is done), F (file was deleted, target is forgotten).
+** Snapshot keeps one D record per ready target. When journal grows over JOURNAL_COMPACT_SIZE
+** a new snapshot is written to a temporary file, renamed over the old one and journal is truncated.
+ */
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include "file_scheduler.h"
+
+using std::cerr;
+using std::endl;
+
+// Group commit period
+#define JOURNAL_INTERVAL_MS 10
+// Journal is compacted into snapshot when it grows over this size
+#define JOURNAL_COMPACT_SIZE (16 << 20)
+
+//! Records handed over by one processing thread.
+struct journal_slot
+{
+	std::mutex lock;
+	string pending;
+};
+
+//! State of the journal thread.
+struct journal
+{
+	string dir;
+	int fd; ///journal file, opened for append
+	size_t size; ///bytes in journal since last snapshot
+	string unsaved; ///records of a commit that failed, written again with the next one
+	bool failing; ///the last commit failed
+	std::unordered_set <string> ready; ///mirror of ready targets, source of snapshots
+	vector <journal_slot> slots; ///one per shard
+	std::mutex lock;
+	std::condition_variable wake;
+	bool stop;
+	std::thread thread;
+};
+
+static journal *wal = nullptr;
+
+static string journal_path()
+{
+	return wal->dir + "/scheduler.journal";
+}
+
+static string snapshot_path()
+{
+	return wal->dir + "/scheduler.snapshot";
+}
+
+static int write_all(int fd, const char *data, size_t len)
+{
+	while(len > 0)
+	{
+		auto written = write(fd, data, len);
+		if(written < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		data += written;
+		len -= (size_t)written;
+	}
+	return 0;
+}
+
+/*!
+Reads whole file into memory.
+\param[in] path File name.
+\param[out] data File content.
+\returns 0 on success or if file does not exist, -1 on error
+*/
+static int read_file(const string &path, string *data)
+{
+	data->clear();
+	int fd = open(path.c_str(), O_RDONLY);
+	if(fd < 0)
+		return errno == ENOENT ? 0 : -1;
+	struct stat sb;
+	if(fstat(fd, &sb) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+	data->resize((size_t)sb.st_size);
+	size_t done = 0;
+	while(done < data->size())
+	{
+		auto got = read(fd, &(*data)[done], data->size() - done);
+		if(got < 0 && errno == EINTR)
+			continue;
+		if(got <= 0)
+			break;
+		done += (size_t)got;
+	}
+	data->resize(done);
+	close(fd);
+	return 0;
+}
+
+/*!
+Applies records to the set of ready targets. Stops at the first broken record, which is a torn write of the last commit.
+\param[in] data Records.
+\param[out] ready Ready targets.
+\returns length of the valid prefix
+*/
+static size_t replay(string_view data, std::unordered_set <string> *ready)
+{
+	size_t pos = 0;
+	while(pos < data.size())
+	{
+		size_t len = 0;
+		auto res = std::from_chars(data.data() + pos, data.data() + data.size(), len);
+		if(res.ec != std::errc() || res.ptr == data.data() + data.size() || *res.ptr != '#')
+			break;
+		size_t body = (size_t)(res.ptr - data.data()) + 1;
+		if(len < 2 || len > MAX_FRAME || body + len > data.size() || data[body + 1] != '#')
+			break;
+		string_view target = data.substr(body + 2, len - 2);
+		if(data[body] == 'D')
+			ready->emplace(target);
+		else if(data[body] == 'F')
+			ready->erase(string(target));
+		else if(data[body] != 'W' && data[body] != 'E' && data[body] != 'L')
+			break;
+		pos = body + len;
+	}
+	return pos;
+}
+
+static void append_record(string *out, char type, string_view target)
+{
+	*out += std::to_string(target.size() + 2);
+	*out += '#';
+	*out += type;
+	*out += '#';
+	out->append(target.data(), target.size());
+}
+
+/*!
+Writes ready targets to a new snapshot and empties the journal. Snapshot is complete or absent: it is written to a temporary file first.
+\returns 0 on success
+*/
+static int write_snapshot()
+{
+	string data;
+	for(auto &target : wal->ready)
+		append_record(&data, 'D', target);
+
+	string tmp = snapshot_path() + ".tmp";
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0 || write_all(fd, data.data(), data.size()) != 0 || fsync(fd) != 0)
+	{
+		perror("snapshot");
+		if(fd >= 0)
+			close(fd);
+		return -1;
+	}
+	close(fd);
+	if(rename(tmp.c_str(), snapshot_path().c_str()) != 0)
+	{
+		perror("snapshot rename");
+		return -1;
+	}
+	int dir_fd = open(wal->dir.c_str(), O_RDONLY | O_DIRECTORY);
+	if(dir_fd >= 0)
+	{
+		fsync(dir_fd);
+		close(dir_fd);
+	}
+	// Snapshot already has everything, replaying the old journal on top of it changes nothing
+	if(ftruncate(wal->fd, 0) != 0)
+	{
+		perror("journal truncate");
+		return -1;
+	}
+	wal->size = 0;
+	return 0;
+}
+
+/*!
+Collects records of all shards and commits them to disk. Records are known to be durable only after fdatasync,
+so a batch that failed is kept for the next commit and neither the mirror nor the snapshot sees it until then.
+*/
+static void commit()
+{
+	string batch = std::move(wal->unsaved);
+	wal->unsaved.clear();
+	for(auto &slot : wal->slots)
+	{
+		std::lock_guard <std::mutex> guard(slot.lock);
+		batch += slot.pending;
+		slot.pending.clear();
+	}
+	if(batch.empty())
+		return;
+
+	if(write_all(wal->fd, batch.data(), batch.size()) != 0 || fdatasync(wal->fd) != 0)
+	{
+		// Complain once per outage, the journal thread tries again every JOURNAL_INTERVAL_MS
+		if(!wal->failing)
+			perror("journal write");
+		wal->failing = true;
+		// Part of the batch may be in the file, the whole batch is appended again
+		if(ftruncate(wal->fd, (off_t)wal->size) != 0)
+			perror("journal truncate");
+		wal->unsaved = std::move(batch);
+		return;
+	}
+	if(wal->failing)
+		cerr << "Journal is written again\n";
+	wal->failing = false;
+	wal->size += batch.size();
+	replay(batch, &wal->ready);
+	if(wal->size > JOURNAL_COMPACT_SIZE)
+		write_snapshot();
+}
+
+static void journal_loop()
+{
+	std::unique_lock <std::mutex> guard(wal->lock);
+	while(!wal->stop)
+	{
+		wal->wake.wait_for(guard, std::chrono::milliseconds(JOURNAL_INTERVAL_MS));
+		guard.unlock();
+		commit();
+		guard.lock();
+	}
+	guard.unlock();
+	commit();
+}
+
+/*!
+Restores ready targets from snapshot and journal and starts journal thread.
+\param[in] dir Directory with journal files.
+\param[out] ready Targets that were generated before restart.
+\returns 0 on success
+*/
+int journal_open(const string &dir, vector <string> *ready)
+{
+	wal = new journal();
+	wal->dir = dir;
+	wal->size = 0;
+	wal->failing = false;
+	wal->stop = false;
+	wal->slots = vector <journal_slot>(shard_count);
+
+	string data;
+	if(read_file(snapshot_path(), &data) != 0)
+	{
+		perror("snapshot read");
+		return -1;
+	}
+	if(replay(data, &wal->ready) != data.size())
+		cerr << "Snapshot is damaged, using its valid part\n";
+	if(read_file(journal_path(), &data) != 0)
+	{
+		perror("journal read");
+		return -1;
+	}
+	size_t valid = replay(data, &wal->ready);
+
+	wal->fd = open(journal_path().c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if(wal->fd < 0)
+	{
+		perror("journal open");
+		return -1;
+	}
+	if(valid != data.size())
+	{
+		cerr << "Journal has " << data.size() - valid << " bytes of incomplete record, dropping them\n";
+		if(ftruncate(wal->fd, (off_t)valid) != 0)
+			perror("journal truncate");
+	}
+	wal->size = valid;
+
+	ready->assign(wal->ready.begin(), wal->ready.end());
+	cerr << "Restored " << ready->size() << " ready targets\n";
+	wal->thread = std::thread(journal_loop);
+	return 0;
+}
+
+/*!
+Stops journal thread after the last commit.
+*/
+void journal_close()
+{
+	if(!wal)
+		return;
+	{
+		std::lock_guard <std::mutex> guard(wal->lock);
+		wal->stop = true;
+	}
+	wal->wake.notify_one();
+	wal->thread.join();
+	if(!wal->unsaved.empty())
+		cerr << "Journal lost " << wal->unsaved.size() << " bytes of records that could not be written\n";
+	close(wal->fd);
+	delete wal;
+	wal = nullptr;
+}
+
+/*!
+Journals ready targets taken over from the former primary, so they are still ready after restart.
+\param[in] ready Target names.
+*/
+void journal_import(const vector <string> &ready)
+{
+	if(!wal)
+		return;
+	auto &slot = wal->slots[0];
+	std::lock_guard <std::mutex> guard(slot.lock);
+	for(auto &name : ready)
+		append_record(&slot.pending, 'D', name);
+}
+
+/*!
+Appends state transition to the records of the current iteration.
+\param[in] st Scheduler state.
+\param[in] type W, D, L or F.
+\param[in] target Target name.
+*/
+void journal_record(scheduler_state *st, char type, string_view target)
+{
+	if(wal)
+		append_record(&st->journal_buf, type, target);
+}
+
+/*!
+Hands records of the iteration over to the journal thread. Called once per iteration, never waits for the disk.
+\param[in] st Scheduler state.
+*/
+void journal_submit(scheduler_state *st)
+{
+	if(st->journal_buf.empty())
+		return;
+	auto &slot = wal->slots[st->self->id];
+	{
+		std::lock_guard <std::mutex> guard(slot.lock);
+		slot.pending += st->journal_buf;
+	}
+	st->journal_buf.clear();
+}
@@ -0,0 +1,817 @@
+/** @file load_generator.cpp*/
+/** Load generator for the scheduler.
+**
+** Simulates N nodes with M workers each, every worker has its own connection and
+** behaves like a pssc worker: asks for a target, waits for READ if somebody else
+** writes it, generates the file when told WRIT and reports DONE. Two latencies are
+** measured: from request to the first answer (decision of the server) and to the
+** final one (READ or WRIT after WAIT).
+**
+** Options: -h host, -p port, -n nodes, -c workers per node, -d duration in seconds,
+** -t number of targets, -z Zipf exponent of target popularity (0 - uniform),
+** -w fraction of WRIT requests, -W mean time to generate a file in milliseconds
+** (exponentially distributed, 0 - DONE right away), -x probability that a writer
+** crashes instead of DONE (its connection is dropped and opened again), -b number of
+** targets asked for with one BTCH request (1 - single requests). With -b latencies are
+** those of whole batches: the batch answer, and the last READ or WRIT after WAIT.
+** -B speaks the binary protocol (wire.h) instead of the text one: the same load shows
+** what parsing and building of text messages costs. -U connects to the Unix domain socket of the
+** scheduler at the given path instead of TCP, -M moves requests and answers of such connections to shared
+** memory (shm_channel.h) after SHMR. -P keeps that many requests in flight on the connection of every
+** worker, each with its own id; answers are matched by id in whatever order they come.
+ */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "decision_engine.h"
+#include "shm_channel.h"
+#include "wire.h"
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+typedef std::chrono::steady_clock steady;
+
+// Empty answer ring is checked this many times before the worker sleeps on its eventfd
+#define SHM_SPINS 100
+
+//! Settings and results of one worker.
+struct client_data
+{
+	int node;
+	int id;
+	vector <double> latency; ///microseconds from request to the first answer
+	vector <double> settled; ///microseconds from request to the final answer
+	size_t waits;
+	size_t writes;
+	size_t crashes;
+	size_t errors;
+	size_t decided; ///targets answered, more than requests with -b
+};
+
+static const char *host = "127.0.0.1";
+static uint16_t port = 1987;
+static int nodes = 1;
+static int node_workers = 16;
+static int duration = 5;
+static unsigned targets = 1000;
+static double zipf_exponent = 0;
+static double write_fraction = 0.1;
+static double write_ms = 0;
+static double crash_rate = 0;
+static unsigned batch_size = 1;
+static bool binary = false;
+static const char *local_path = nullptr;
+static bool shared_memory = false;
+static unsigned pipeline = 1;
+//! Operations of the binary protocol by op_code
+static const char *const op_names[] = {"", "READ", "WRIT", "WAIT", "DONE", "BEAT", "EXIT", "HINT", "BTCH", "SHMR", "SUBS", "PREF", "NTFY"};
+static std::atomic <bool> stop(false);
+//! Cumulative popularity of targets for Zipf distribution, empty for uniform one
+static vector <double> popularity;
+
+//! Shared memory of the connection of this worker thread, 'ch' is nullptr when the socket is used.
+struct shm_link
+{
+	shm_channel *ch;
+	int answers_fd; ///signalled by the scheduler when the worker waits for answers
+	int wake_fd; ///wakes the processing thread of the scheduler
+};
+
+static thread_local shm_link shm = {nullptr, -1, -1};
+
+static bool send_all(int fd, const char *data, size_t len)
+{
+	if(shm.ch == nullptr)
+	{
+		size_t sent = 0;
+		while(sent < len)
+		{
+			auto n = send(fd, data + sent, len - sent, MSG_NOSIGNAL);
+			if(n <= 0)
+				return false;
+			sent += (size_t)n;
+		}
+		return true;
+	}
+
+	size_t sent = 0;
+	while(1)
+	{
+		sent += shm_write(&shm.ch->requests, data + sent, len - sent);
+		if(shm_should_wake(&shm.ch->requests))
+		{
+			uint64_t one = 1;
+			if(write(shm.wake_fd, &one, sizeof one) < 0)
+				return false;
+		}
+		if(sent == len)
+			return true;
+		// Ring is full, the scheduler is busy with this worker's requests
+		sched_yield();
+	}
+}
+
+static bool recv_all(int fd, char *buf, size_t len)
+{
+	size_t got = 0;
+	if(shm.ch == nullptr)
+	{
+		while(got < len)
+		{
+			auto n = recv(fd, buf + got, len - got, 0);
+			if(n <= 0)
+				return false;
+			got += (size_t)n;
+		}
+		return true;
+	}
+
+	int spins = 0;
+	while(got < len)
+	{
+		size_t n = shm_read(&shm.ch->answers, buf + got, len - got);
+		got += n;
+		if(n != 0 || ++spins < SHM_SPINS)
+		{
+			if(n == 0)
+				sched_yield();
+			continue;
+		}
+		spins = 0;
+		if(shm_prepare_wait(&shm.ch->answers))
+		{
+			// Nothing is sent on the socket anymore, it becomes readable when the scheduler is gone
+			pollfd fds[2] = {{shm.answers_fd, POLLIN, 0}, {fd, POLLIN, 0}};
+			if(poll(fds, 2, -1) < 0 || fds[1].revents != 0)
+				return false;
+			uint64_t counter;
+			if(fds[0].revents != 0 && read(shm.answers_fd, &counter, sizeof counter) < 0)
+				return false;
+		}
+		shm.ch->answers.waiting.store(0, std::memory_order_relaxed);
+	}
+	return true;
+}
+
+/*!
+Asks for SHMR on a fresh Unix domain connection and maps the rings that come with the answer.
+\returns true if the connection uses shared memory from now on
+*/
+static bool attach_shared_memory(int fd, int pid)
+{
+	string message;
+	if(binary)
+	{
+		wire_request req = {WIRE_MAGIC, OP_SHMR, 0, pid, 1, 0, 0};
+		message.assign((const char *)&req, sizeof req);
+	}
+	else
+	{
+		string body = std::to_string(pid) + "#SHMR";
+		message = std::to_string(body.size()) + "#" + body;
+	}
+	if(!send_all(fd, message.data(), message.size()))
+		return false;
+
+	char answer[sizeof(wire_answer)];
+	int fds[SHM_FDS];
+	iovec iov = {answer, binary ? sizeof(wire_answer) : 4};
+	msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof fds)];
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof control;
+	if(recvmsg(fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC) != (ssize_t)iov.iov_len)
+		return false;
+	cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+	if(cm == nullptr || cm->cmsg_type != SCM_RIGHTS || cm->cmsg_len != CMSG_LEN(sizeof fds))
+	{
+		cerr << "SHMR refused\n";
+		return false;
+	}
+	memcpy(fds, CMSG_DATA(cm), sizeof fds);
+	void *p = mmap(nullptr, sizeof(shm_channel), PROT_READ | PROT_WRITE, MAP_SHARED, fds[SHM_FD_CHANNEL], 0);
+	close(fds[SHM_FD_CHANNEL]);
+	if(p == MAP_FAILED)
+	{
+		close(fds[SHM_FD_ANSWERS]);
+		close(fds[SHM_FD_REQUESTS]);
+		return false;
+	}
+	shm = {(shm_channel *)p, fds[SHM_FD_ANSWERS], fds[SHM_FD_REQUESTS]};
+	return true;
+}
+
+static void drop_connection(int fd)
+{
+	if(shm.ch != nullptr)
+	{
+		munmap(shm.ch, sizeof(shm_channel));
+		close(shm.answers_fd);
+		close(shm.wake_fd);
+		shm = {nullptr, -1, -1};
+	}
+	close(fd);
+}
+
+static int open_connection(int pid)
+{
+	if(local_path != nullptr)
+	{
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(fd < 0)
+			return -1;
+		sockaddr_un addr;
+		memset(&addr, 0, sizeof addr);
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, local_path, sizeof addr.sun_path - 1);
+		if(connect(fd, (sockaddr *)&addr, sizeof addr) < 0 || (shared_memory && !attach_shared_memory(fd, pid)))
+		{
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(fd < 0)
+		return -1;
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if(inet_pton(AF_INET, host, &addr.sin_addr) != 1 || connect(fd, (sockaddr *)&addr, sizeof addr) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+	int nodelay = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof nodelay);
+	return fd;
+}
+
+static uint64_t fnv(const string &s)
+{
+	uint64_t h = 14695981039346656037ull;
+	for(char c : s)
+	{
+		h ^= (unsigned char)c;
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+//! Binary requests name the target with READ and WRIT only, DONE refers to it by hash.
+static string wire_message(int pid, const char *operation, const string &target, uint32_t id)
+{
+	uint8_t op = 0;
+	while(op < sizeof op_names / sizeof op_names[0] && strcmp(op_names[op], operation) != 0)
+		++op;
+	bool named = strcmp(operation, "DONE") != 0;
+	wire_request req = {WIRE_MAGIC, op, (uint16_t)(named ? target.size() : 0), pid, id, 0, fnv(target)};
+	string message((const char *)&req, sizeof req);
+	if(named)
+		message += target;
+	return message;
+}
+
+static bool send_request(int fd, int pid, const char *operation, const string &target, uint32_t id = 0)
+{
+	string message;
+	if(binary)
+		message = wire_message(pid, operation, target, id);
+	else
+	{
+		string body = std::to_string(pid) + "#" + operation + "#" + target;
+		// Text requests carry ids only when pipelined, otherwise their answers are four characters
+		if(pipeline > 1 && id != 0)
+			body += "#" + std::to_string(id);
+		message = std::to_string(body.size()) + "#" + body;
+	}
+	return send_all(fd, message.data(), message.size());
+}
+
+//! Answers are four characters without framing, or wire_answer with the id of the request.
+static bool read_answer(int fd, char answer[5], uint32_t id = 0)
+{
+	if(binary)
+	{
+		wire_answer a;
+		if(!recv_all(fd, (char *)&a, sizeof a) || a.magic != WIRE_MAGIC || a.len != 0 || a.op >= sizeof op_names / sizeof op_names[0]
+			|| (a.id != id && a.op != OP_EXIT))
+			return false;
+		memcpy(answer, op_names[a.op], 5);
+		return true;
+	}
+	if(!recv_all(fd, answer, 4))
+		return false;
+	answer[4] = '\0';
+	return true;
+}
+
+//! Answers to BTCH are framed: "len#BTCH#answers" or "len#ANSWER#target" for a target that was told WAIT.
+static bool read_frame(int fd, string *body)
+{
+	size_t len = 0;
+	char ch;
+	while(1)
+	{
+		if(!recv_all(fd, &ch, 1))
+			return false;
+		if(ch == '#')
+			break;
+		if(ch < '0' || ch > '9')
+			return false;
+		len = len * 10 + (size_t)(ch - '0');
+	}
+	body->resize(len);
+	return recv_all(fd, &(*body)[0], len);
+}
+
+//! Answer to a request with id: wire_answer, or "len#ANSWER#id" of the text protocol.
+static bool read_tagged_answer(int fd, char answer[5], uint32_t *id)
+{
+	if(binary)
+	{
+		wire_answer a;
+		if(!recv_all(fd, (char *)&a, sizeof a) || a.magic != WIRE_MAGIC || a.len != 0 || a.op >= sizeof op_names / sizeof op_names[0])
+			return false;
+		memcpy(answer, op_names[a.op], 5);
+		*id = a.id;
+		return true;
+	}
+	string body;
+	if(!read_frame(fd, &body) || body.size() < 6 || body[4] != '#')
+		return false;
+	memcpy(answer, body.data(), 4);
+	answer[4] = '\0';
+	*id = (uint32_t)strtoul(body.c_str() + 5, nullptr, 10);
+	return true;
+}
+
+/*!
+Prepares cumulative distribution of Zipf law: target k is requested with probability proportional to 1/(k+1)^s.
+*/
+static void init_popularity()
+{
+	if(zipf_exponent <= 0)
+		return;
+	popularity.resize(targets);
+	double total = 0;
+	for(unsigned k = 0; k < targets; ++k)
+	{
+		total += 1.0 / pow((double)k + 1.0, zipf_exponent);
+		popularity[k] = total;
+	}
+	for(auto &p : popularity)
+		p /= total;
+}
+
+static unsigned pick_target(std::mt19937 &rng)
+{
+	if(popularity.empty())
+		return std::uniform_int_distribution <unsigned>(0, targets - 1)(rng);
+	double p = std::uniform_real_distribution <double>(0.0, 1.0)(rng);
+	return (unsigned)std::min((size_t)(std::lower_bound(popularity.begin(), popularity.end(), p) - popularity.begin()), (size_t)targets - 1);
+}
+
+static double elapsed_us(steady::time_point start)
+{
+	return std::chrono::duration <double, std::micro>(steady::now() - start).count();
+}
+
+static void *run_client(void *arg)
+{
+	auto data = (client_data *)arg;
+	std::mt19937 rng((unsigned)(data->node * 100003 + data->id) * 7919u + 1u);
+	std::uniform_real_distribution <double> chance(0.0, 1.0);
+	std::exponential_distribution <double> write_time(write_ms > 0 ? 1.0 / write_ms : 1.0);
+	// Workers of different nodes have different pids, as real ones do
+	int pid = (data->node + 1) * 100000 + data->id;
+	char answer[5];
+	uint32_t id = 0;
+
+	int fd = open_connection(pid);
+	if(fd < 0)
+	{
+		perror("connect");
+		++data->errors;
+		return NULL;
+	}
+
+	while(!stop)
+	{
+		string target = "/reuse/target_" + std::to_string(pick_target(rng));
+		const char *operation = chance(rng) < write_fraction ? "WRIT" : "READ";
+		auto start = steady::now();
+		++id;
+		if(!send_request(fd, pid, operation, target, id) || !read_answer(fd, answer, id))
+		{
+			++data->errors;
+			break;
+		}
+		data->latency.push_back(elapsed_us(start));
+		++data->decided;
+		// Writer of this target is someone else, READ comes after its DONE, or WRIT if it crashed
+		if(strcmp(answer, "WAIT") == 0)
+		{
+			++data->waits;
+			if(!read_answer(fd, answer, id))
+			{
+				++data->errors;
+				break;
+			}
+		}
+		data->settled.push_back(elapsed_us(start));
+
+		if(strcmp(answer, "EXIT") == 0)
+			break;
+		if(strcmp(answer, "WRIT") == 0)
+		{
+			++data->writes;
+			if(chance(rng) < crash_rate)
+			{
+				// Worker dies in the middle of writing, the server has to hand the target over
+				++data->crashes;
+				drop_connection(fd);
+				fd = open_connection(pid);
+				if(fd < 0)
+				{
+					perror("connect");
+					++data->errors;
+					return NULL;
+				}
+				continue;
+			}
+			if(write_ms > 0)
+				usleep((useconds_t)(write_time(rng) * 1000));
+		}
+		if(!send_request(fd, pid, "DONE", target, id))
+		{
+			++data->errors;
+			break;
+		}
+	}
+	drop_connection(fd);
+	return NULL;
+}
+
+/*!
+Worker that asks for batch_size targets with one BTCH request, like a job phase that needs many reuse files.
+Targets told WAIT are settled by separate answers, written targets are reported DONE together.
+*/
+static void *run_batch_client(void *arg)
+{
+	auto data = (client_data *)arg;
+	std::mt19937 rng((unsigned)(data->node * 100003 + data->id) * 7919u + 1u);
+	std::uniform_real_distribution <double> chance(0.0, 1.0);
+	std::exponential_distribution <double> write_time(write_ms > 0 ? 1.0 / write_ms : 1.0);
+	int pid = (data->node + 1) * 100000 + data->id;
+	string body;
+	vector <string> names(batch_size);
+
+	int fd = open_connection(pid);
+	if(fd < 0)
+	{
+		perror("connect");
+		++data->errors;
+		return NULL;
+	}
+
+	while(!stop)
+	{
+		const char *operation = chance(rng) < write_fraction ? "WRIT" : "READ";
+		string list = operation;
+		for(size_t k = 0; k < names.size(); ++k)
+		{
+			// The same target twice would make the worker wait for itself
+			do
+				names[k] = "/reuse/target_" + std::to_string(pick_target(rng));
+			while(std::find(names.begin(), names.begin() + (ptrdiff_t)k, names[k]) != names.begin() + (ptrdiff_t)k);
+			list += "#" + names[k];
+		}
+		auto start = steady::now();
+		if(!send_request(fd, pid, "BTCH", list) || !read_frame(fd, &body) || body.compare(0, 5, "BTCH#") != 0
+			|| body.size() != 5 + 4 * (size_t)batch_size)
+		{
+			++data->errors;
+			break;
+		}
+		data->latency.push_back(elapsed_us(start));
+		data->decided += batch_size;
+
+		size_t waits = 0, writes = 0;
+		for(unsigned k = 0; k < batch_size; ++k)
+		{
+			if(body.compare(5 + 4 * k, 4, "WAIT") == 0)
+				++waits;
+			else if(body.compare(5 + 4 * k, 4, "WRIT") == 0)
+				++writes;
+		}
+		data->waits += waits;
+		string answer;
+		for(; waits > 0; --waits)
+		{
+			// "ANSWER#target" of a target that was told WAIT
+			if(!read_frame(fd, &answer) || answer.size() < 5)
+			{
+				++data->errors;
+				break;
+			}
+			if(answer.compare(0, 4, "WRIT") == 0)
+				++writes;
+		}
+		if(waits > 0)
+			break;
+		data->settled.push_back(elapsed_us(start));
+
+		data->writes += writes;
+		if(writes > 0 && chance(rng) < crash_rate)
+		{
+			++data->crashes;
+			drop_connection(fd);
+			fd = open_connection(pid);
+			if(fd < 0)
+			{
+				perror("connect");
+				++data->errors;
+				return NULL;
+			}
+			continue;
+		}
+		if(writes > 0 && write_ms > 0)
+			usleep((useconds_t)(write_time(rng) * 1000));
+		// Readers are released as well, so every target gets DONE
+		bool sent = true;
+		for(size_t k = 0; sent && k < names.size(); ++k)
+			sent = send_request(fd, pid, "DONE", names[k]);
+		if(!sent)
+		{
+			++data->errors;
+			break;
+		}
+	}
+	drop_connection(fd);
+	return NULL;
+}
+
+//! Request of a pipelining worker waiting for its final answer.
+struct in_flight
+{
+	string target;
+	steady::time_point start;
+	bool waited; ///told WAIT, first answer is already counted
+};
+
+/*!
+Worker that keeps 'pipeline' requests in flight on one connection. Answers come in any order and are
+matched by id, WAIT is settled later by READ or WRIT with the same id. Every target is reported DONE
+as soon as it is settled, so the worker does not wait for its own writes.
+*/
+static void *run_pipelined_client(void *arg)
+{
+	auto data = (client_data *)arg;
+	std::mt19937 rng((unsigned)(data->node * 100003 + data->id) * 7919u + 1u);
+	std::uniform_real_distribution <double> chance(0.0, 1.0);
+	std::exponential_distribution <double> write_time(write_ms > 0 ? 1.0 / write_ms : 1.0);
+	int pid = (data->node + 1) * 100000 + data->id;
+	std::unordered_map <uint32_t, in_flight> requests;
+	uint32_t id = 0;
+	char answer[5];
+
+	int fd = open_connection(pid);
+	if(fd < 0)
+	{
+		perror("connect");
+		++data->errors;
+		return NULL;
+	}
+
+	while(!stop)
+	{
+		bool sent = true;
+		while(sent && requests.size() < pipeline)
+		{
+			if(++id == 0)
+				++id;
+			string target = "/reuse/target_" + std::to_string(pick_target(rng));
+			const char *operation = chance(rng) < write_fraction ? "WRIT" : "READ";
+			sent = send_request(fd, pid, operation, target, id);
+			requests[id] = {target, steady::now(), false};
+		}
+		uint32_t answered;
+		if(!sent || !read_tagged_answer(fd, answer, &answered))
+		{
+			++data->errors;
+			break;
+		}
+		auto request = requests.find(answered);
+		if(request == requests.end())
+		{
+			if(strcmp(answer, "EXIT") != 0)
+				++data->errors;
+			break;
+		}
+		if(!request->second.waited)
+		{
+			data->latency.push_back(elapsed_us(request->second.start));
+			++data->decided;
+		}
+		if(strcmp(answer, "WAIT") == 0)
+		{
+			++data->waits;
+			request->second.waited = true;
+			continue;
+		}
+		data->settled.push_back(elapsed_us(request->second.start));
+
+		if(strcmp(answer, "WRIT") == 0)
+		{
+			++data->writes;
+			if(chance(rng) < crash_rate)
+			{
+				// Everything in flight is lost together with the connection
+				++data->crashes;
+				requests.clear();
+				drop_connection(fd);
+				fd = open_connection(pid);
+				if(fd < 0)
+				{
+					perror("connect");
+					++data->errors;
+					return NULL;
+				}
+				continue;
+			}
+			if(write_ms > 0)
+				usleep((useconds_t)(write_time(rng) * 1000));
+		}
+		if(!send_request(fd, pid, "DONE", request->second.target))
+		{
+			++data->errors;
+			break;
+		}
+		requests.erase(request);
+	}
+	drop_connection(fd);
+	return NULL;
+}
+
+static double percentile(const vector <double> &sorted, double p)
+{
+	if(sorted.empty())
+		return 0;
+	size_t index = std::min(sorted.size() - 1, (size_t)(p * (double)sorted.size()));
+	return sorted[index];
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	while((opt = getopt(argc, argv, "h:p:n:c:d:t:z:w:W:x:b:BU:MP:")) != -1)
+	{
+		switch(opt)
+		{
+			case 'h':
+				host = optarg;
+				break;
+			case 'p':
+				port = (uint16_t)strtoul(optarg, nullptr, 10);
+				break;
+			case 'n':
+				nodes = atoi(optarg);
+				break;
+			case 'c':
+				node_workers = atoi(optarg);
+				break;
+			case 'd':
+				duration = atoi(optarg);
+				break;
+			case 't':
+				targets = (unsigned)strtoul(optarg, nullptr, 10);
+				break;
+			case 'z':
+				zipf_exponent = atof(optarg);
+				break;
+			case 'w':
+				write_fraction = atof(optarg);
+				break;
+			case 'W':
+				write_ms = atof(optarg);
+				break;
+			case 'x':
+				crash_rate = atof(optarg);
+				break;
+			case 'b':
+				batch_size = (unsigned)strtoul(optarg, nullptr, 10);
+				break;
+			case 'B':
+				binary = true;
+				break;
+			case 'U':
+				local_path = optarg;
+				break;
+			case 'M':
+				shared_memory = true;
+				break;
+			case 'P':
+				pipeline = (unsigned)strtoul(optarg, nullptr, 10);
+				break;
+			default:
+				cerr << "Usage: " << argv[0] << " [-h host] [-p port] [-n nodes] [-c workers per node] [-d seconds] [-t targets]"
+					" [-z zipf exponent] [-w write fraction] [-W write ms] [-x crash rate] [-b batch size | -B] [-U socket path [-M]] [-P requests in flight]\n";
+				return 1;
+		}
+	}
+	if(nodes < 1 || node_workers < 1 || duration < 1 || targets < 1 || batch_size < 1 || pipeline < 1)
+	{
+		cerr << "Nodes, workers, duration, targets, batch size and requests in flight should be positive\n";
+		return 1;
+	}
+	if(binary && batch_size > 1)
+	{
+		cerr << "Batches are not a part of the binary protocol\n";
+		return 1;
+	}
+	if(pipeline > 1 && batch_size > 1)
+	{
+		cerr << "Batches (-b) are not pipelined (-P)\n";
+		return 1;
+	}
+	if(shared_memory && local_path == nullptr)
+	{
+		cerr << "Shared memory (-M) is given on the Unix domain socket (-U) only\n";
+		return 1;
+	}
+	init_popularity();
+
+	int workers = nodes * node_workers;
+	vector <client_data> clients((size_t)workers);
+	vector <pthread_t> threads((size_t)workers);
+	for(int i = 0; i < workers; ++i)
+	{
+		clients[(size_t)i].node = i / node_workers;
+		clients[(size_t)i].id = i % node_workers;
+		clients[(size_t)i].waits = clients[(size_t)i].writes = 0;
+		clients[(size_t)i].crashes = clients[(size_t)i].errors = 0;
+		clients[(size_t)i].decided = 0;
+		if(pthread_create(&threads[(size_t)i], NULL, batch_size > 1 ? run_batch_client : pipeline > 1 ? run_pipelined_client : run_client, &clients[(size_t)i]) != 0)
+		{
+			cerr << "Unable to create thread\n";
+			return 1;
+		}
+	}
+	sleep((unsigned)duration);
+	stop = true;
+
+	vector <double> all, settled;
+	size_t errors = 0, waits = 0, writes = 0, crashes = 0, decided = 0;
+	for(int i = 0; i < workers; ++i)
+	{
+		auto &c = clients[(size_t)i];
+		pthread_join(threads[(size_t)i], NULL);
+		all.insert(all.end(), c.latency.begin(), c.latency.end());
+		settled.insert(settled.end(), c.settled.begin(), c.settled.end());
+		errors += c.errors;
+		waits += c.waits;
+		writes += c.writes;
+		crashes += c.crashes;
+		decided += c.decided;
+	}
+	std::sort(all.begin(), all.end());
+	std::sort(settled.begin(), settled.end());
+
+	printf("requests: %zu  errors: %zu  rate: %.0f req/s  WAIT: %zu  WRIT: %zu  crashes: %zu\n",
+		all.size(), errors, (double)all.size() / duration, waits, writes, crashes);
+	if(batch_size > 1)
+		printf("targets: %zu  rate: %.0f targets/s in batches of %u\n", decided, (double)decided / duration, batch_size);
+	printf("answer   p50: %.1f us  p99: %.1f us  p999: %.1f us  max: %.1f us\n",
+		percentile(all, 0.5), percentile(all, 0.99), percentile(all, 0.999), all.empty() ? 0.0 : all.back());
+	printf("settled  p50: %.1f us  p99: %.1f us  p999: %.1f us  max: %.1f us\n",
+		percentile(settled, 0.5), percentile(settled, 0.99), percentile(settled, 0.999), settled.empty() ? 0.0 : settled.back());
+	return errors == 0 ? 0 : 2;
+}
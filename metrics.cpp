@@ -0,0 +1,431 @@
+/** @file metrics.cpp*/
+/** Metrics endpoint in Prometheus text format.
+**
+** Every processing thread counts requests, decisions and durations in its own shard_metrics,
+** the endpoint thread (-m port, bound to localhost only) sums them up when scraped.
+** Counters are written by a single thread, so they are plain relaxed stores and the request path
+** never waits for a scrape. Hottest targets are tracked by every thread in a short list and
+** copied for the endpoint at most once per METRICS_PUBLISH_US.
+ */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include "file_scheduler.h"
+
+using std::cerr;
+using std::endl;
+
+// How often the list of hot targets is copied for the endpoint
+#define METRICS_PUBLISH_US 1000000
+// Scraper that does not send its request or read the answer in time is dropped
+#define METRICS_IO_TIMEOUT_S 1
+
+//! Upper bounds of histogram buckets in microseconds, the last bucket is +Inf.
+static const uint64_t bucket_bounds[LATENCY_BUCKETS - 1] = {
+	1000, 5000, 10000, 50000, 100000, 500000, 1000000, 5000000,
+	10000000, 30000000, 60000000, 300000000, 600000000, 1800000000, 3600000000ull};
+
+//! State of the endpoint thread.
+struct metrics_server
+{
+	int listen_fd = -1;
+	std::thread thread;
+};
+
+static metrics_server server;
+
+/*!
+\returns microseconds of steady clock
+*/
+uint64_t steady_us()
+{
+	return (uint64_t)std::chrono::duration_cast <std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*!
+Adds duration from 'since' till now to the histogram of the own shard.
+\param[in] h Histogram.
+\param[in] since Start, see steady_us().
+*/
+void metrics_observe(latency_histogram *h, uint64_t since)
+{
+	uint64_t us = steady_us() - since;
+	size_t bucket = (size_t)(std::lower_bound(bucket_bounds, bucket_bounds + LATENCY_BUCKETS - 1, us) - bucket_bounds);
+	metric_add(h->buckets[bucket]);
+	metric_add(h->sum_us, us);
+}
+
+static void update_hot_min(scheduler_state *st)
+{
+	st->hot_min = 0;
+	if(st->hot.size() == HOT_TARGETS)
+		st->hot_min = std::min_element(st->hot.begin(), st->hot.end(), [](const hot_target &a, const hot_target &b) { return a.requests < b.requests; })->requests;
+}
+
+/*!
+Counts READ or WRIT request on the target and keeps the list of hottest targets.
+Only a target that gets ahead of the coldest listed one costs more than an increment.
+\param[in] st Scheduler state of the owner shard.
+\param[in] target Requested target.
+\param[in] waited Request was answered WAIT.
+*/
+void metrics_count_target(scheduler_state *st, target_entry *target, bool waited)
+{
+	auto &ts = target->second;
+	++ts.requests;
+	if(waited)
+		++ts.waits;
+	if(ts.requests <= st->hot_min)
+		return;
+
+	auto found = std::find_if(st->hot.begin(), st->hot.end(), [target](const hot_target &h) { return h.name == target->first; });
+	if(found == st->hot.end())
+	{
+		if(st->hot.size() < HOT_TARGETS)
+			found = st->hot.insert(st->hot.end(), hot_target());
+		else
+			found = std::min_element(st->hot.begin(), st->hot.end(), [](const hot_target &a, const hot_target &b) { return a.requests < b.requests; });
+		found->name = string(target->first);
+		found->requests = found->waits = 0;
+	}
+	// Target forgotten in the meantime starts counting from zero, the list keeps its old numbers until then
+	found->requests = std::max(found->requests, ts.requests);
+	found->waits = std::max(found->waits, ts.waits);
+	update_hot_min(st);
+	st->hot_dirty = true;
+}
+
+/*!
+Updates gauges of the shard and copies the list of hot targets for the endpoint when it is due.
+Never waits: when the endpoint is reading the previous copy, publication is tried again next iteration.
+\param[in] st Scheduler state.
+*/
+void metrics_publish(scheduler_state *st)
+{
+	auto &m = st->self->metrics;
+	m.targets.store((int64_t)st->engine.targets.size(), std::memory_order_relaxed);
+	m.waiters.store((int64_t)st->engine.waiters, std::memory_order_relaxed);
+	m.ready_bytes.store((int64_t)st->engine.ready_bytes, std::memory_order_relaxed);
+	if(!st->hot_dirty)
+		return;
+	uint64_t now = steady_us();
+	if(now - st->hot_published < METRICS_PUBLISH_US)
+		return;
+	std::unique_lock <std::mutex> guard(m.hot_lock, std::try_to_lock);
+	if(!guard.owns_lock())
+		return;
+	m.hot = st->hot;
+	st->hot_published = now;
+	st->hot_dirty = false;
+}
+
+/*!
+\returns milliseconds until the list of hot targets is due for publication, -1 if it did not change
+*/
+int metrics_timeout(const scheduler_state *st)
+{
+	if(!st->hot_dirty)
+		return -1;
+	uint64_t elapsed = steady_us() - st->hot_published;
+	return elapsed >= METRICS_PUBLISH_US ? 1 : (int)((METRICS_PUBLISH_US - elapsed) / 1000 + 1);
+}
+
+static void escape_label(string *out, string_view value)
+{
+	for(char c : value)
+	{
+		if(c == '\\' || c == '"')
+			*out += '\\';
+		if(c == '\n')
+		{
+			*out += "\\n";
+			continue;
+		}
+		*out += c;
+	}
+}
+
+static void put_header(string *out, const char *name, const char *type, const char *help)
+{
+	*out += "# HELP ";
+	*out += name;
+	*out += ' ';
+	*out += help;
+	*out += "\n# TYPE ";
+	*out += name;
+	*out += ' ';
+	*out += type;
+	*out += '\n';
+}
+
+static void put_value(string *out, const char *name, const char *labels, uint64_t value)
+{
+	*out += name;
+	*out += labels;
+	*out += ' ';
+	*out += std::to_string(value);
+	*out += '\n';
+}
+
+static int64_t sum(std::atomic <int64_t> shard_metrics::*gauge)
+{
+	int64_t total = 0;
+	for(size_t s = 0; s < shard_count; ++s)
+		total += (shards[s].metrics.*gauge).load(std::memory_order_relaxed);
+	return total;
+}
+
+static uint64_t sum_ops(std::atomic <uint64_t> (shard_metrics::*counters)[METRIC_OPS], op_code op)
+{
+	uint64_t total = 0;
+	for(size_t s = 0; s < shard_count; ++s)
+		total += (shards[s].metrics.*counters)[op].load(std::memory_order_relaxed);
+	return total;
+}
+
+static void put_histogram(string *out, const char *name, const char *label, latency_histogram shard_metrics::*histogram)
+{
+	uint64_t counts[LATENCY_BUCKETS] = {};
+	uint64_t sum_us = 0;
+	for(size_t s = 0; s < shard_count; ++s)
+	{
+		auto &h = shards[s].metrics.*histogram;
+		for(size_t b = 0; b < LATENCY_BUCKETS; ++b)
+			counts[b] += h.buckets[b].load(std::memory_order_relaxed);
+		sum_us += h.sum_us.load(std::memory_order_relaxed);
+	}
+
+	uint64_t cumulative = 0;
+	char line[256];
+	for(size_t b = 0; b < LATENCY_BUCKETS; ++b)
+	{
+		cumulative += counts[b];
+		if(b + 1 < LATENCY_BUCKETS)
+			snprintf(line, sizeof line, "%s_bucket{%s,le=\"%g\"} %llu\n", name, label, (double)bucket_bounds[b] / 1e6, (unsigned long long)cumulative);
+		else
+			snprintf(line, sizeof line, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, label, (unsigned long long)cumulative);
+		*out += line;
+	}
+	snprintf(line, sizeof line, "%s_sum{%s} %.6f\n%s_count{%s} %llu\n", name, label, (double)sum_us / 1e6, name, label, (unsigned long long)cumulative);
+	*out += line;
+}
+
+/*!
+Writers of every node seen so far: slots held now, taken and refused.
+*/
+static void put_node_writers(string *out)
+{
+	struct node_line
+	{
+		string labels;
+		const node_writers *n;
+	};
+	vector <node_line> nodes;
+	for(auto &n : quota.nodes)
+	{
+		uint32_t node = n.node.load(std::memory_order_acquire);
+		if(node == 0)
+			continue;
+		char text[INET_ADDRSTRLEN] = "";
+		inet_ntop(AF_INET, &node, text, sizeof text);
+		nodes.push_back({string("{node=\"") + text + "\"}", &n});
+	}
+
+	put_header(out, "scheduler_node_writers", "gauge", "Workers holding a writer slot, by node.");
+	for(auto &l : nodes)
+		put_value(out, "scheduler_node_writers", l.labels.c_str(), (uint64_t)std::max(l.n->writers.load(std::memory_order_relaxed), (int64_t)0));
+	put_header(out, "scheduler_node_writer_slots_total", "counter", "Writer slots taken, by node.");
+	for(auto &l : nodes)
+		put_value(out, "scheduler_node_writer_slots_total", l.labels.c_str(), l.n->granted.load(std::memory_order_relaxed));
+	put_header(out, "scheduler_node_writer_slots_refused_total", "counter", "Writer slots refused by -q or -Q, by node. Deferred writers are asked again when slots are given back.");
+	for(auto &l : nodes)
+		put_value(out, "scheduler_node_writer_slots_refused_total", l.labels.c_str(), l.n->refused.load(std::memory_order_relaxed));
+}
+
+/*!
+\returns all metrics in Prometheus text exposition format
+*/
+static string render()
+{
+	string out;
+
+	put_header(&out, "scheduler_requests_total", "counter", "Requests received from clients, by operation.");
+	for(op_code op : {OP_READ, OP_WRIT, OP_DONE, OP_BEAT, OP_HINT, OP_BTCH, OP_SHMR, OP_SUBS, OP_PREF, OP_DEPS, OP_WORK, OP_OTHER})
+		put_value(&out, "scheduler_requests_total", (string("{op=\"") + (op == OP_OTHER ? "other" : op_name(op)) + "\"}").c_str(), sum_ops(&shard_metrics::requests, op));
+
+	put_header(&out, "scheduler_decisions_total", "counter", "Answers given to workers.");
+	for(op_code op : {OP_READ, OP_WRIT, OP_WAIT, OP_WORK, OP_IDLE, OP_EVCT})
+		put_value(&out, "scheduler_decisions_total", (string("{answer=\"") + op_name(op) + "\"}").c_str(), sum_ops(&shard_metrics::answers, op));
+
+	put_header(&out, "scheduler_connected_clients", "gauge", "Open client connections.");
+	put_value(&out, "scheduler_connected_clients", "", (uint64_t)std::max(sum(&shard_metrics::connections), (int64_t)0));
+	put_header(&out, "scheduler_waiters", "gauge", "Workers told to WAIT that did not get their answer yet.");
+	put_value(&out, "scheduler_waiters", "", (uint64_t)std::max(sum(&shard_metrics::waiters), (int64_t)0));
+	put_header(&out, "scheduler_targets", "gauge", "Targets kept in memory, ready or held by somebody.");
+	put_value(&out, "scheduler_targets", "", (uint64_t)std::max(sum(&shard_metrics::targets), (int64_t)0));
+
+	put_header(&out, "scheduler_writers", "gauge", "Workers holding a writer slot, on all nodes.");
+	put_value(&out, "scheduler_writers", "", (uint64_t)std::max(quota.writers.load(std::memory_order_relaxed), (int64_t)0));
+	put_header(&out, "scheduler_deferred_targets", "gauge", "Targets whose next writer waits for a writer slot (-q, -Q).");
+	put_value(&out, "scheduler_deferred_targets", "", (uint64_t)std::max(sum(&shard_metrics::deferred), (int64_t)0));
+	put_header(&out, "scheduler_writer_slots_refused_total", "counter", "Writer slots refused because all -Q slots were taken.");
+	put_value(&out, "scheduler_writer_slots_refused_total", "", quota.refused.load(std::memory_order_relaxed));
+	put_node_writers(&out);
+
+	put_header(&out, "scheduler_ready_bytes", "gauge", "Size of the files of ready targets, as told by DONE.");
+	put_value(&out, "scheduler_ready_bytes", "", (uint64_t)std::max(sum(&shard_metrics::ready_bytes), (int64_t)0));
+	put_header(&out, "scheduler_disk_budget_bytes", "gauge", "Bytes the files may take before idle workers are told to evict some (-B), 0 - no limit.");
+	put_value(&out, "scheduler_disk_budget_bytes", "", disk_budget);
+	put_header(&out, "scheduler_evictions_total", "counter", "Cold targets handed to idle workers for deletion (EVCT).");
+	put_value(&out, "scheduler_evictions_total", "", sum_ops(&shard_metrics::answers, OP_EVCT));
+
+	put_header(&out, "scheduler_wait_seconds", "histogram", "Time from WAIT until the worker got READ or WRIT.");
+	put_histogram(&out, "scheduler_wait_seconds", "answer=\"READ\"", &shard_metrics::wait_read);
+	put_histogram(&out, "scheduler_wait_seconds", "answer=\"WRIT\"", &shard_metrics::wait_writ);
+	put_header(&out, "scheduler_writer_hold_seconds", "histogram", "Time from WRIT until DONE or until the writer was lost.");
+	put_histogram(&out, "scheduler_writer_hold_seconds", "outcome=\"done\"", &shard_metrics::hold_done);
+	put_histogram(&out, "scheduler_writer_hold_seconds", "outcome=\"lost\"", &shard_metrics::hold_lost);
+
+	vector <hot_target> hot;
+	for(size_t s = 0; s < shard_count; ++s)
+	{
+		std::lock_guard <std::mutex> guard(shards[s].metrics.hot_lock);
+		hot.insert(hot.end(), shards[s].metrics.hot.begin(), shards[s].metrics.hot.end());
+	}
+	std::sort(hot.begin(), hot.end(), [](const hot_target &a, const hot_target &b) { return a.requests > b.requests; });
+	if(hot.size() > HOT_TARGETS)
+		hot.resize(HOT_TARGETS);
+	put_header(&out, "scheduler_hot_target_requests", "gauge", "READ and WRIT requests of the hottest targets.");
+	for(auto &h : hot)
+	{
+		string labels = "{target=\"";
+		escape_label(&labels, h.name);
+		labels += "\"}";
+		put_value(&out, "scheduler_hot_target_requests", labels.c_str(), h.requests);
+	}
+	put_header(&out, "scheduler_hot_target_waits", "gauge", "WAIT answers of the hottest targets.");
+	for(auto &h : hot)
+	{
+		string labels = "{target=\"";
+		escape_label(&labels, h.name);
+		labels += "\"}";
+		put_value(&out, "scheduler_hot_target_waits", labels.c_str(), h.waits);
+	}
+	return out;
+}
+
+/*!
+Answers one scrape. Whatever was asked, the answer is the full set of metrics.
+\param[in] fd Accepted socket, blocking with timeouts.
+*/
+static void serve(int fd)
+{
+	// Request line and headers are not needed, only wait until they are complete
+	string request;
+	char buf[1024];
+	while(request.find("\r\n\r\n") == string::npos && request.find("\n\n") == string::npos && request.size() < 8192)
+	{
+		auto got = read(fd, buf, sizeof buf);
+		if(got < 0 && errno == EINTR)
+			continue;
+		if(got <= 0)
+			return;
+		request.append(buf, (size_t)got);
+	}
+
+	string body = render();
+	string answer = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+		std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+	size_t done = 0;
+	while(done < answer.size())
+	{
+		auto sent = send(fd, answer.data() + done, answer.size() - done, MSG_NOSIGNAL);
+		if(sent < 0 && errno == EINTR)
+			continue;
+		if(sent <= 0)
+			return;
+		done += (size_t)sent;
+	}
+}
+
+static void metrics_loop()
+{
+	pollfd fds[2] = {{server.listen_fd, POLLIN, 0}, {shutdown_fd, POLLIN, 0}};
+	while(!time_to_exit)
+	{
+		if(poll(fds, 2, -1) < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			perror("metrics poll");
+			return;
+		}
+		if(fds[1].revents)
+			return;
+		if(!(fds[0].revents & POLLIN))
+			continue;
+		int fd = accept4(server.listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+		if(fd < 0)
+			continue;
+		timeval timeout = {METRICS_IO_TIMEOUT_S, 0};
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+		serve(fd);
+		close(fd);
+	}
+}
+
+/*!
+Starts metrics endpoint on localhost.
+\param[in] port Port of the endpoint.
+\returns 0 on success
+*/
+int metrics_open(uint16_t port)
+{
+	server.listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(server.listen_fd < 0)
+	{
+		perror("metrics socket");
+		return -1;
+	}
+	int reuse = 1;
+	if(setsockopt(server.listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse) < 0)
+		perror("setsockopt");
+
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if(bind(server.listen_fd, (sockaddr *)&addr, sizeof addr) < 0 || listen(server.listen_fd, 16) < 0)
+	{
+		cerr << "Can not listen for metrics on port " << port << ": " << strerror(errno) << endl;
+		close(server.listen_fd);
+		server.listen_fd = -1;
+		return -1;
+	}
+	server.thread = std::thread(metrics_loop);
+	return 0;
+}
+
+/*!
+Waits for the endpoint thread, which stops together with the processing threads.
+*/
+void metrics_close()
+{
+	if(server.listen_fd < 0)
+		return;
+	server.thread.join();
+	close(server.listen_fd);
+	server.listen_fd = -1;
+}
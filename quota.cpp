@@ -0,0 +1,152 @@
+/** @file quota.cpp*/
+/** Writer quotas: at most -q writers on one node and -Q writers on all nodes at once.
+**
+** Engines of all shards take a writer slot before they answer WRIT or WORK (engine_hooks::admit).
+** Slots are counted in atomics shared by all shards, per node in a small open-addressing table keyed
+** by the address of the worker. A worker that gets no slot is told WAIT and gets WRIT later.
+** A shard that gives slots back bumps 'released' and wakes up the shards that have deferred writers,
+** they call engine_promote() when they see the change. Counters are kept without quotas as well,
+** the metrics endpoint reports writers of every node.
+ */
+#include <unistd.h>
+#include <cstdio>
+#include "file_scheduler.h"
+
+writer_quota quota;
+
+/*!
+Finds the counters of a node, a new node takes a free entry.
+\param[in] node IPv4 address in network order.
+\returns nullptr for an unknown node (0) or when the table is full: such writers count towards -Q only
+*/
+static node_writers *node_entry(uint32_t node)
+{
+	if(node == 0)
+		return nullptr;
+	size_t i = (size_t)(node * 2654435761u) & (QUOTA_NODES - 1);
+	for(size_t probe = 0; probe < QUOTA_NODES; ++probe, i = (i + 1) & (QUOTA_NODES - 1))
+	{
+		auto &n = quota.nodes[i];
+		uint32_t owner = n.node.load(std::memory_order_acquire);
+		if(owner == 0 && n.node.compare_exchange_strong(owner, node, std::memory_order_acq_rel))
+			return &n;
+		if(owner == node)
+			return &n;
+	}
+	return nullptr;
+}
+
+/*!
+Takes a slot of a counter unless it has 'limit' taken already.
+*/
+static bool take(std::atomic <int64_t> &writers, size_t limit)
+{
+	int64_t now = writers.load(std::memory_order_relaxed);
+	do
+	{
+		if(limit != 0 && now >= (int64_t)limit)
+			return false;
+	}
+	while(!writers.compare_exchange_weak(now, now + 1, std::memory_order_relaxed));
+	return true;
+}
+
+/*!
+Gives a slot back and tells the shards with deferred writers, see quota_wake().
+*/
+static void give_back(scheduler_state *st, std::atomic <int64_t> &writers)
+{
+	writers.fetch_sub(1, std::memory_order_relaxed);
+	quota.released.fetch_add(1, std::memory_order_seq_cst);
+	st->quota_released = true;
+}
+
+/*!
+engine_hooks::admit of every shard.
+\param[in] ctx Scheduler state.
+\param[in] node Node of the writer.
+\returns true if the writer took a slot of its node and a slot of the cluster
+*/
+bool quota_admit(void *ctx, uint32_t node)
+{
+	auto st = (scheduler_state *)ctx;
+	node_writers *n = node_entry(node);
+	// Full counters are seen without taking anything, so a refusal does not look like a release to other shards
+	bool node_full = n != nullptr && quota.node_max != 0 && n->writers.load(std::memory_order_relaxed) >= (int64_t)quota.node_max;
+	bool total_full = quota.total_max != 0 && quota.writers.load(std::memory_order_relaxed) >= (int64_t)quota.total_max;
+	if(!node_full && !total_full && (n == nullptr || take(n->writers, quota.node_max)))
+	{
+		if(take(quota.writers, quota.total_max))
+		{
+			if(n != nullptr)
+				n->granted.fetch_add(1, std::memory_order_relaxed);
+			return true;
+		}
+		// Lost the last slot to another shard, somebody may have been refused the node slot meanwhile
+		if(n != nullptr)
+			give_back(st, n->writers);
+		total_full = true;
+	}
+	if(n != nullptr)
+		n->refused.fetch_add(1, std::memory_order_relaxed);
+	if(total_full)
+		quota.refused.fetch_add(1, std::memory_order_relaxed);
+	return false;
+}
+
+/*!
+engine_hooks::leave of every shard.
+\param[in] ctx Scheduler state.
+\param[in] node Node of the writer.
+*/
+void quota_leave(void *ctx, uint32_t node)
+{
+	auto st = (scheduler_state *)ctx;
+	node_writers *n = node_entry(node);
+	if(n != nullptr)
+		n->writers.fetch_sub(1, std::memory_order_relaxed);
+	give_back(st, quota.writers);
+}
+
+/*!
+Called after requests of the iteration were decided: announces how many targets of the shard wait for a slot
+and gives WRIT to them if some slots were given back since the last look.
+The announcement and the look are ordered against give_back() and quota_wake(), so a release is never missed.
+\param[in] st Scheduler state.
+*/
+void quota_promote(scheduler_state *st)
+{
+	auto &deferred = st->self->metrics.deferred;
+	if(st->engine.deferred.empty())
+	{
+		if(deferred.load(std::memory_order_relaxed) != 0)
+			deferred.store(0, std::memory_order_relaxed);
+		return;
+	}
+	deferred.store((int64_t)st->engine.deferred.size(), std::memory_order_seq_cst);
+	uint64_t released = quota.released.load(std::memory_order_seq_cst);
+	if(released == st->quota_seen)
+		return;
+	st->quota_seen = released;
+	engine_promote(&st->engine);
+	deferred.store((int64_t)st->engine.deferred.size(), std::memory_order_relaxed);
+}
+
+/*!
+Wakes up every shard with deferred writers, this one included, if the iteration gave slots back.
+\param[in] st Scheduler state.
+*/
+void quota_wake(scheduler_state *st)
+{
+	if(!st->quota_released)
+		return;
+	st->quota_released = false;
+	for(size_t s = 0; s < shard_count; ++s)
+	{
+		if(shards[s].metrics.deferred.load(std::memory_order_seq_cst) == 0)
+			continue;
+		uint64_t one = 1;
+		if(write(shards[s].mail_fd, &one, sizeof one) < 0)
+			perror("quota wake");
+	}
+}
@@ -0,0 +1,584 @@
+/** @file replica.cpp*/
+/** Hot standby: the primary streams state transitions, the standby takes over when they stop.
+**
+** Processing threads append records to their own buffer during an iteration and hand it over
+** at the end of the iteration, the same way as for the journal. Replication thread of the primary
+** keeps a mirror of ready and written targets, sends it to a standby that connects (-R port)
+** and then forwards every new batch, followed by a sync record that the standby acknowledges.
+** Records use the request format: len#pid#T#target, T is W, E, D, L or F as in the journal,
+** pid is the writer for W and E. H is a heartbeat, S#n asks for acknowledgement A#n.
+**
+** A WRIT answer is held back until the standby has acknowledged the grant, so the standby never
+** gives WRIT for a target the primary gave to somebody else. READ and WAIT are sent right away:
+** a DONE lost on failover only makes waiters wait for the lease (-l) or for the file to appear in -r.
+** Standby (-S host:port) neither listens nor decides until the primary is silent for
+** REPLICA_TIMEOUT_MS or the connection breaks. Then it starts as a normal server with the
+** mirror: writers of the primary keep WRIT and are recognized by pid when they reconnect.
+ */
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include "file_scheduler.h"
+
+using std::cerr;
+using std::endl;
+
+// Records without WRIT answers waiting for them are forwarded at least this often
+#define REPLICA_INTERVAL_MS 10
+// Primary sends a heartbeat when it had nothing to send for this long
+#define REPLICA_HEARTBEAT_MS 200
+// Standby takes over when it heard nothing from the primary for this long
+#define REPLICA_TIMEOUT_MS 1000
+
+//! Ready targets and current writers, rebuilt from records.
+struct replica_mirror
+{
+	std::unordered_set <string> ready;
+	std::unordered_map <string, int> writing; ///target - writer pid
+	std::unordered_set <string> evicting; ///targets of 'writing' whose worker deletes the file
+};
+
+//! Records handed over by one processing thread.
+struct replica_slot
+{
+	std::mutex lock;
+	string pending;
+	uint64_t submitted; ///number of the last batch handed over
+	bool urgent; ///some WRIT answers wait for the pending batch
+	std::atomic <uint64_t> acked; ///number of the last batch the standby has, or that needs no standby
+};
+
+//! Batches of every shard covered by one sync record.
+struct replica_sync
+{
+	uint64_t number;
+	vector <uint64_t> batches; ///by shard
+};
+
+//! State of the replication thread of the primary.
+struct replica_server
+{
+	int listen_fd;
+	int standby_fd; ///-1 when no standby is connected
+	int wake_fd; ///eventfd, signalled for urgent batches and on stop
+	std::atomic <bool> attached; ///standby is connected, WRIT answers are held
+	bool stop;
+	replica_mirror mirror;
+	vector <replica_slot> slots; ///one per shard
+	vector <uint64_t> collected; ///last batch taken from every slot
+	vector <uint64_t> urgent; ///last batch of every slot that had WRIT answers waiting for it
+	deque <replica_sync> unacked;
+	uint64_t syncs; ///sync records sent
+	uint64_t last_send; ///steady_us()
+	recv_buffer in; ///acknowledgements
+	std::thread thread;
+};
+
+static replica_server *rep = nullptr;
+
+static void append_record(string *out, char type, int pid, string_view target)
+{
+	string pid_text = std::to_string(pid);
+	*out += std::to_string(pid_text.size() + 3 + target.size());
+	*out += '#';
+	*out += pid_text;
+	*out += '#';
+	*out += type;
+	*out += '#';
+	out->append(target.data(), target.size());
+}
+
+static void apply(replica_mirror *m, char type, int pid, string_view target)
+{
+	string name(target);
+	if(type == 'W' || type == 'E')
+	{
+		m->writing[name] = pid;
+		if(type == 'E')
+			m->evicting.insert(std::move(name));
+		else
+			m->evicting.erase(name);
+	}
+	else if(type == 'D')
+	{
+		m->writing.erase(name);
+		m->evicting.erase(name);
+		m->ready.insert(std::move(name));
+	}
+	else if(type == 'L')
+	{
+		m->writing.erase(name);
+		m->evicting.erase(name);
+	}
+	else if(type == 'F')
+		m->ready.erase(name);
+}
+
+static int send_all(int fd, const string &data)
+{
+	size_t done = 0;
+	while(done < data.size())
+	{
+		auto sent = send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+		if(sent < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		done += (size_t)sent;
+	}
+	return 0;
+}
+
+static void wake_shard(size_t s)
+{
+	uint64_t one = 1;
+	if(write(shards[s].mail_fd, &one, sizeof one) < 0)
+		perror("replica wake");
+}
+
+/*!
+Marks batches as safe and wakes up shards whose WRIT answers were waiting for them.
+*/
+static void release_batches(const vector <uint64_t> &batches)
+{
+	for(size_t s = 0; s < shard_count; ++s)
+	{
+		uint64_t acked = rep->slots[s].acked.load(std::memory_order_relaxed);
+		if(batches[s] <= acked)
+			continue;
+		rep->slots[s].acked.store(batches[s], std::memory_order_release);
+		if(rep->urgent[s] > acked)
+			wake_shard(s);
+	}
+}
+
+static void drop_standby(const char *why)
+{
+	cerr << "Standby scheduler disconnected: " << why << endl;
+	close(rep->standby_fd);
+	rep->standby_fd = -1;
+	rep->attached = false;
+	rep->unacked.clear();
+	release_batches(rep->collected);
+}
+
+static void send_sync(string *out)
+{
+	++rep->syncs;
+	append_record(out, 'S', 0, std::to_string(rep->syncs));
+	if(send_all(rep->standby_fd, *out) != 0)
+	{
+		drop_standby(strerror(errno));
+		return;
+	}
+	rep->unacked.push_back({rep->syncs, rep->collected});
+	rep->last_send = steady_us();
+}
+
+/*!
+Takes batches of all shards, applies them to the mirror and passes them to the standby.
+Without standby the batches are acknowledged right away.
+*/
+static void forward()
+{
+	string batch;
+	bool fresh = false;
+	for(size_t s = 0; s < shard_count; ++s)
+	{
+		auto &slot = rep->slots[s];
+		std::lock_guard <std::mutex> guard(slot.lock);
+		fresh |= slot.submitted != rep->collected[s];
+		batch += slot.pending;
+		slot.pending.clear();
+		rep->collected[s] = slot.submitted;
+		if(slot.urgent)
+			rep->urgent[s] = slot.submitted;
+		slot.urgent = false;
+	}
+
+	// Records are written by this program, so they are not validated again
+	size_t pos = 0;
+	while(pos < batch.size())
+	{
+		size_t len = 0;
+		auto res = std::from_chars(batch.data() + pos, batch.data() + batch.size(), len);
+		size_t body = (size_t)(res.ptr - batch.data()) + 1;
+		string_view record(batch.data() + body, len);
+		size_t first = record.find('#');
+		int pid = 0;
+		std::from_chars(record.data(), record.data() + first, pid);
+		apply(&rep->mirror, record[first + 1], pid, record.substr(first + 3));
+		pos = body + len;
+	}
+
+	if(rep->standby_fd < 0)
+		release_batches(rep->collected);
+	else if(fresh)
+		send_sync(&batch);
+	else if(steady_us() - rep->last_send >= REPLICA_HEARTBEAT_MS * 1000)
+	{
+		append_record(&batch, 'H', 0, "");
+		if(send_all(rep->standby_fd, batch) != 0)
+			drop_standby(strerror(errno));
+		rep->last_send = steady_us();
+	}
+}
+
+/*!
+Accepts standby and sends it the whole mirror. Only one standby is served at a time.
+*/
+static void accept_standby()
+{
+	int fd = accept4(rep->listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+	if(fd < 0)
+		return;
+	if(rep->standby_fd >= 0)
+	{
+		cerr << "Standby scheduler is already connected, rejecting another one\n";
+		close(fd);
+		return;
+	}
+	int nodelay = 1;
+	if(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof nodelay) < 0)
+		perror("setsockopt");
+	// Standby that does not take the stream must not stall WRIT answers for long
+	struct timeval timeout = {REPLICA_TIMEOUT_MS / 1000, (REPLICA_TIMEOUT_MS % 1000) * 1000};
+	if(setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout) < 0)
+		perror("setsockopt");
+
+	forward();
+	rep->standby_fd = fd;
+	rep->in = recv_buffer();
+	string snapshot;
+	for(auto &name : rep->mirror.ready)
+		append_record(&snapshot, 'D', 0, name);
+	for(auto &w : rep->mirror.writing)
+		append_record(&snapshot, rep->mirror.evicting.count(w.first) != 0 ? 'E' : 'W', w.second, w.first);
+	rep->attached = true;
+	send_sync(&snapshot);
+	if(rep->standby_fd >= 0)
+		cerr << "Standby scheduler connected, sent " << rep->mirror.ready.size() << " ready and "
+			<< rep->mirror.writing.size() << " written targets\n";
+}
+
+/*!
+Reads acknowledgements of the standby and releases the batches they cover.
+*/
+static void read_acks()
+{
+	auto &in = rep->in;
+	if(in.data.size() == in.tail)
+		in.data.resize(std::max(in.data.size() * 2, (size_t)RECV_BUF_SIZE));
+	auto got = recv(rep->standby_fd, in.data.data() + in.tail, in.data.size() - in.tail, MSG_DONTWAIT);
+	if(got < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if(got <= 0)
+	{
+		drop_standby(got == 0 ? "connection closed" : strerror(errno));
+		return;
+	}
+	in.tail += (size_t)got;
+
+	vector <client_buffer> acks;
+	if(parse_buffer(&in, &acks, 0) != 0)
+	{
+		drop_standby("malformed acknowledgement");
+		return;
+	}
+	for(auto &ack : acks)
+	{
+		uint64_t number = 0;
+		std::from_chars(ack.target.data(), ack.target.data() + ack.target.size(), number);
+		while(!rep->unacked.empty() && rep->unacked.front().number <= number)
+		{
+			release_batches(rep->unacked.front().batches);
+			rep->unacked.pop_front();
+		}
+	}
+	compact_buffer(&in);
+}
+
+static void replica_loop()
+{
+	while(!rep->stop)
+	{
+		pollfd fds[3] = {{rep->wake_fd, POLLIN, 0}, {rep->listen_fd, POLLIN, 0}, {rep->standby_fd, POLLIN, 0}};
+		int n = poll(fds, rep->standby_fd < 0 ? 2 : 3, REPLICA_INTERVAL_MS);
+		if(n < 0 && errno != EINTR)
+		{
+			perror("replica poll");
+			break;
+		}
+		uint64_t counter;
+		if(fds[0].revents && read(rep->wake_fd, &counter, sizeof counter) < 0)
+			perror("replica wake");
+		if(fds[1].revents)
+			accept_standby();
+		if(fds[2].revents && rep->standby_fd >= 0)
+			read_acks();
+		forward();
+	}
+	forward();
+	if(rep->standby_fd >= 0)
+		close(rep->standby_fd);
+}
+
+/*!
+Starts replication thread of the primary. The mirror starts with targets preloaded into shards.
+\param[in] port Port the standby connects to.
+\returns 0 on success
+*/
+int replica_serve(uint16_t port)
+{
+	rep = new replica_server();
+	rep->standby_fd = -1;
+	rep->attached = false;
+	rep->stop = false;
+	rep->syncs = 0;
+	rep->last_send = 0;
+	rep->slots = vector <replica_slot>(shard_count);
+	rep->collected.assign(shard_count, 0);
+	rep->urgent.assign(shard_count, 0);
+	for(auto &slot : rep->slots)
+	{
+		slot.submitted = 0;
+		slot.urgent = false;
+		slot.acked = 0;
+	}
+	for(size_t s = 0; s < shard_count; ++s)
+	{
+		for(auto &name : shards[s].preload)
+			rep->mirror.ready.insert(name);
+		for(auto &w : shards[s].preload_writers)
+		{
+			rep->mirror.writing[w.target] = w.pid;
+			if(w.evicting)
+				rep->mirror.evicting.insert(w.target);
+		}
+	}
+
+	rep->wake_fd = eventfd(0, EFD_NONBLOCK);
+	rep->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	int reuse = 1;
+	struct sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if(rep->wake_fd < 0 || rep->listen_fd < 0
+		|| setsockopt(rep->listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse) < 0
+		|| bind(rep->listen_fd, (sockaddr *)&addr, sizeof addr) < 0 || listen(rep->listen_fd, 4) < 0)
+	{
+		perror("replication socket");
+		return -1;
+	}
+	rep->thread = std::thread(replica_loop);
+	return 0;
+}
+
+/*!
+Stops replication thread after passing the last records to the standby.
+*/
+void replica_close()
+{
+	if(!rep)
+		return;
+	rep->stop = true;
+	uint64_t one = 1;
+	if(write(rep->wake_fd, &one, sizeof one) < 0)
+		perror("replica wake");
+	rep->thread.join();
+	close(rep->listen_fd);
+	close(rep->wake_fd);
+	delete rep;
+	rep = nullptr;
+}
+
+/*!
+Appends state transition to the replication records of the current iteration.
+\param[in] st Scheduler state.
+\param[in] type W, D, L or F.
+\param[in] pid Writer process id.
+\param[in] target Target name.
+*/
+void replica_record(scheduler_state *st, char type, int pid, string_view target)
+{
+	if(rep)
+		append_record(&st->replica_buf, type, pid, target);
+}
+
+/*!
+Holds WRIT, WORK or EVCT answer back until the standby acknowledges the batch of the current iteration.
+\param[in] st Scheduler state.
+\param[in] conn Connection id.
+\param[in] answer OP_WRIT, OP_WORK or OP_EVCT.
+\param[in] tag Tag of the request.
+\param[in] target Target name, needed by answers to BTCH, WORK and EVCT.
+\returns true if the answer is held, false if it has to be sent now
+*/
+bool replica_hold(scheduler_state *st, uint64_t conn, op_code answer, uint64_t tag, string_view target)
+{
+	if(!rep || !rep->attached.load(std::memory_order_relaxed))
+		return false;
+	bool named = answer_has_body(answer) || (tag != 0 && !is_request_id(tag));
+	st->held.push_back({conn, st->replica_seq + 1, tag, named ? string(target) : string(), answer});
+	return true;
+}
+
+/*!
+Sends held WRIT, WORK and EVCT answers whose grants the standby already has.
+\param[in] st Scheduler state.
+*/
+void replica_release(scheduler_state *st)
+{
+	if(st->held.empty())
+		return;
+	uint64_t acked = rep->slots[st->self->id].acked.load(std::memory_order_acquire);
+	// Batches are acknowledged in order, so released answers are always the oldest ones
+	size_t released = 0;
+	for(; released < st->held.size() && st->held[released].seq <= acked; ++released)
+	{
+		auto &h = st->held[released];
+		deliver(st, h.conn, h.answer, h.tag, h.target); // worker may be gone meanwhile, its WRIT was already taken back then
+	}
+	st->held.erase(st->held.begin(), st->held.begin() + (ptrdiff_t)released);
+}
+
+/*!
+Hands records of the iteration over to the replication thread, waking it up when WRIT answers wait for them.
+\param[in] st Scheduler state.
+*/
+void replica_submit(scheduler_state *st)
+{
+	bool urgent = !st->held.empty() && st->held.back().seq > st->replica_seq;
+	if(!rep || (st->replica_buf.empty() && !urgent))
+		return;
+	auto &slot = rep->slots[st->self->id];
+	{
+		std::lock_guard <std::mutex> guard(slot.lock);
+		slot.pending += st->replica_buf;
+		slot.submitted = ++st->replica_seq;
+		slot.urgent |= urgent;
+	}
+	st->replica_buf.clear();
+	uint64_t one = 1;
+	if(urgent && write(rep->wake_fd, &one, sizeof one) < 0)
+		perror("replica wake");
+}
+
+static int connect_primary(const string &primary)
+{
+	size_t colon = primary.rfind(':');
+	if(colon == string::npos)
+		return -1;
+	string host = primary.substr(0, colon);
+	string port = primary.substr(colon + 1);
+	addrinfo hints = {};
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo *list;
+	if(getaddrinfo(host.c_str(), port.c_str(), &hints, &list) != 0)
+		return -1;
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd >= 0 && connect(fd, list->ai_addr, list->ai_addrlen) != 0)
+	{
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(list);
+	return fd;
+}
+
+/*!
+Follows the primary as standby until it is lost. Waits for the primary if it is not running yet.
+\param[in] primary host:port of the replication port of the primary.
+\param[out] ready Ready targets known to the primary.
+\param[out] writers Targets being written or evicted, with writer pid.
+\returns 0 when the standby has to take over, -1 on exit signal
+*/
+int replica_follow(const string &primary, vector <string> *ready, vector <taken_writer> *writers)
+{
+	if(primary.find(':') == string::npos)
+	{
+		cerr << "Primary should be given as host:port\n";
+		return -1;
+	}
+	int fd;
+	while((fd = connect_primary(primary)) < 0)
+	{
+		pollfd stop = {shutdown_fd, POLLIN, 0};
+		if(poll(&stop, 1, REPLICA_TIMEOUT_MS) != 0 || time_to_exit)
+			return -1;
+	}
+	cerr << "Following primary scheduler " << primary << endl;
+
+	replica_mirror mirror;
+	recv_buffer in = {};
+	vector <client_buffer> records;
+	const char *why = "connection closed";
+	while(!time_to_exit)
+	{
+		pollfd fds[2] = {{fd, POLLIN, 0}, {shutdown_fd, POLLIN, 0}};
+		int n = poll(fds, 2, REPLICA_TIMEOUT_MS);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(fds[1].revents || time_to_exit)
+		{
+			close(fd);
+			return -1;
+		}
+		if(n == 0)
+		{
+			why = "no heartbeat";
+			break;
+		}
+
+		if(in.data.size() == in.tail)
+			in.data.resize(std::max(in.data.size() * 2, (size_t)RECV_BUF_SIZE));
+		auto got = recv(fd, in.data.data() + in.tail, in.data.size() - in.tail, 0);
+		if(got < 0 && errno == EINTR)
+			continue;
+		if(got <= 0)
+			break;
+		in.tail += (size_t)got;
+		if(parse_buffer(&in, &records, 0) != 0)
+		{
+			why = "malformed stream";
+			break;
+		}
+		string acks;
+		for(auto &r : records)
+		{
+			if(r.operation == "S")
+				append_record(&acks, 'A', 0, r.target);
+			else if(r.operation.size() == 1)
+				apply(&mirror, r.operation[0], r.pid, r.target);
+		}
+		records.clear();
+		compact_buffer(&in);
+		if(!acks.empty() && send_all(fd, acks) != 0)
+			break;
+	}
+	close(fd);
+
+	cerr << "Primary scheduler lost (" << why << "), taking over with " << mirror.ready.size() << " ready and "
+		<< mirror.writing.size() << " written targets\n";
+	ready->assign(mirror.ready.begin(), mirror.ready.end());
+	for(auto &w : mirror.writing)
+		writers->push_back({w.first, w.second, mirror.evicting.count(w.first) != 0});
+	return 0;
+}
@@ -0,0 +1,222 @@
+/** @file reuse_dir.cpp*/
+/** Knowledge about reuse files that are already on disk.
+**
+** With -r the reuse directory is scanned on start by several threads, every file found
+** is a ready target. Target name is the path of the file, so the directory has to be given
+** the same way workers see it. Afterwards files written or moved in are marked ready and deleted
+** files are forgotten, as reported by inotify. Events are read by the first shard and
+** passed to owners of the targets.
+ */
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <mutex>
+#include <thread>
+#include "file_scheduler.h"
+
+using std::cerr;
+using std::endl;
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_CREATE | IN_DELETE_SELF)
+
+//! Directories watched by inotify.
+struct reuse_watch
+{
+	int fd = -1;
+	std::mutex lock; ///taken while directories are added from several threads
+	std::unordered_map <int, string> dirs; ///watch descriptor -> directory path
+};
+
+static reuse_watch watch;
+
+//! Work shared by scanning threads.
+struct scan_queue
+{
+	std::mutex lock;
+	std::condition_variable changed;
+	vector <string> dirs; ///directories not scanned yet
+	size_t busy; ///threads scanning a directory right now
+	vector <string> files;
+};
+
+static void add_watch(const string &dir)
+{
+	int wd = inotify_add_watch(watch.fd, dir.c_str(), WATCH_EVENTS | IN_ONLYDIR);
+	if(wd < 0)
+	{
+		cerr << "Can not watch " << dir << ": " << strerror(errno) << endl;
+		return;
+	}
+	std::lock_guard <std::mutex> guard(watch.lock);
+	watch.dirs[wd] = dir;
+}
+
+/*!
+Lists one directory. Watch is added before reading, so a file created meanwhile is reported by inotify at least.
+\param[in] dir Directory path.
+\param[out] files Files found.
+\param[out] subdirs Directories found.
+*/
+static void scan_dir(const string &dir, vector <string> *files, vector <string> *subdirs)
+{
+	add_watch(dir);
+	DIR *d = opendir(dir.c_str());
+	if(d == nullptr)
+	{
+		cerr << "Can not open " << dir << ": " << strerror(errno) << endl;
+		return;
+	}
+	while(auto entry = readdir(d))
+	{
+		if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+		string path = dir == "/" ? dir + entry->d_name : dir + "/" + entry->d_name;
+		unsigned char type = entry->d_type;
+		if(type == DT_UNKNOWN)
+		{
+			struct stat sb;
+			if(fstatat(dirfd(d), entry->d_name, &sb, AT_SYMLINK_NOFOLLOW) != 0)
+				continue;
+			type = S_ISDIR(sb.st_mode) ? DT_DIR : DT_REG;
+		}
+		if(type == DT_DIR)
+			subdirs->push_back(std::move(path));
+		else if(type == DT_REG || type == DT_LNK)
+			files->push_back(std::move(path));
+	}
+	closedir(d);
+}
+
+static void scan_worker(scan_queue *queue)
+{
+	std::unique_lock <std::mutex> guard(queue->lock);
+	while(true)
+	{
+		queue->changed.wait(guard, [queue] { return !queue->dirs.empty() || queue->busy == 0; });
+		if(queue->dirs.empty())
+			return;
+		string dir = std::move(queue->dirs.back());
+		queue->dirs.pop_back();
+		++queue->busy;
+		guard.unlock();
+
+		vector <string> files, subdirs;
+		scan_dir(dir, &files, &subdirs);
+
+		guard.lock();
+		--queue->busy;
+		std::move(files.begin(), files.end(), std::back_inserter(queue->files));
+		std::move(subdirs.begin(), subdirs.end(), std::back_inserter(queue->dirs));
+		queue->changed.notify_all();
+	}
+}
+
+/*!
+Starts watching reuse directory and lists files already there.
+\param[in] dir Reuse directory.
+\param[out] ready Files found.
+\returns 0 on success
+*/
+int reuse_dir_open(string dir, vector <string> *ready)
+{
+	while(dir.size() > 1 && dir.back() == '/')
+		dir.pop_back();
+	watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(watch.fd < 0)
+	{
+		perror("inotify_init1");
+		return -1;
+	}
+
+	scan_queue queue;
+	queue.busy = 0;
+	queue.dirs.push_back(dir);
+	size_t thread_count = std::max(2u, std::thread::hardware_concurrency());
+	vector <std::thread> threads;
+	for(size_t i = 0; i < thread_count; ++i)
+		threads.emplace_back(scan_worker, &queue);
+	for(auto &thread : threads)
+		thread.join();
+
+	cerr << "Found " << queue.files.size() << " files in " << watch.dirs.size() << " directories of " << dir << endl;
+	std::move(queue.files.begin(), queue.files.end(), std::back_inserter(*ready));
+	return 0;
+}
+
+/*!
+\returns inotify descriptor, -1 if reuse directory is not watched
+*/
+int reuse_dir_fd()
+{
+	return watch.fd;
+}
+
+/*!
+Reads pending inotify events and reports files that appeared or disappeared.
+New directories are watched and scanned right away, since files may already be inside.
+\param[in] st Scheduler state of the first shard.
+*/
+void reuse_dir_events(scheduler_state *st)
+{
+	alignas(inotify_event) char buf[16384];
+	while(true)
+	{
+		auto len = read(watch.fd, buf, sizeof buf);
+		if(len < 0 && errno == EINTR)
+			continue;
+		if(len <= 0)
+		{
+			if(len < 0 && errno != EAGAIN)
+				perror("inotify read");
+			return;
+		}
+
+		for(char *ptr = buf; ptr < buf + len;)
+		{
+			auto event = (inotify_event *)ptr;
+			ptr += sizeof(inotify_event) + event->len;
+
+			if(event->mask & IN_Q_OVERFLOW)
+				cerr << "inotify queue overflow, some changes in reuse directory are missed\n";
+			if(event->mask & IN_IGNORED)
+			{
+				watch.dirs.erase(event->wd);
+				continue;
+			}
+			auto dir = watch.dirs.find(event->wd);
+			if(dir == watch.dirs.end() || event->len == 0)
+				continue;
+			string path = dir->second == "/" ? dir->second + event->name : dir->second + "/" + event->name;
+
+			if(event->mask & IN_ISDIR)
+			{
+				if(event->mask & (IN_CREATE | IN_MOVED_TO))
+				{
+					vector <string> files, subdirs = {path};
+					while(!subdirs.empty())
+					{
+						string next = std::move(subdirs.back());
+						subdirs.pop_back();
+						scan_dir(next, &files, &subdirs);
+					}
+					for(auto &file : files)
+						file_changed(st, file, true);
+				}
+			}
+			// File is complete only when its writer closes it, creation alone does not count
+			else if(event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+				file_changed(st, path, true);
+			else if(event->mask & (IN_DELETE | IN_MOVED_FROM))
+				file_changed(st, path, false);
+		}
+	}
+}
@@ -0,0 +1,216 @@
+/** @file shm_channel.cpp*/
+/** Shared memory connections of workers on the scheduler's node.
+**
+** A connection on the Unix domain socket (-U) may ask for SHMR: its requests and answers then go through
+** a pair of rings in memory shared with the worker, see shm_channel.h. The rings are read at the start of every
+** iteration of the processing loop and written when answers are flushed. Neither side makes a system call
+** while the other one is busy; eventfds wake up only a side that announced it is going to sleep.
+ */
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include "file_scheduler.h"
+#include "shm_channel.h"
+
+using std::cerr;
+using std::endl;
+
+static void wake(int fd)
+{
+	uint64_t one = 1;
+	if(write(fd, &one, sizeof one) < 0)
+		perror("eventfd write");
+}
+
+/*!
+Answers SHMR: maps new rings for the connection and passes them to the worker together with
+its eventfd and the eventfd of this processing thread. The answer is SHMR in the protocol of the connection.
+Without descriptors attached it means the request is refused (TCP connection, or answers and roles outstanding),
+the worker keeps using the socket then. A connection that has the rings already gets plain SHMR through them.
+\param[in] st Scheduler state.
+\param[in] request SHMR request of an own connection.
+*/
+void shm_attach(scheduler_state *st, const client_buffer *request)
+{
+	int fd = conn_fd(request->conn);
+	auto c = get_connection(st, fd);
+	wire_answer a = {WIRE_MAGIC, OP_SHMR, 0, (uint32_t)request->tag};
+	string_view answer = c->in.protocol == PROTOCOL_BINARY ? string_view((const char *)&a, sizeof a) : op_name(OP_SHMR);
+
+	int fds[SHM_FDS] = {-1, -1, st->self->mail_fd};
+	shm_channel *ch = nullptr;
+	bool granted = c->local && c->shm == nullptr && c->out.data.empty() && !c->out.busy && c->holdings.empty() && c->remote_shards == 0;
+	if(granted)
+	{
+		fds[SHM_FD_CHANNEL] = memfd_create("file_scheduler", MFD_CLOEXEC);
+		fds[SHM_FD_ANSWERS] = eventfd(0, EFD_CLOEXEC);
+		granted = fds[SHM_FD_CHANNEL] >= 0 && fds[SHM_FD_ANSWERS] >= 0 && ftruncate(fds[SHM_FD_CHANNEL], sizeof(shm_channel)) == 0;
+		if(granted)
+		{
+			void *p = mmap(nullptr, sizeof(shm_channel), PROT_READ | PROT_WRITE, MAP_SHARED, fds[SHM_FD_CHANNEL], 0);
+			granted = p != MAP_FAILED;
+			ch = granted ? (shm_channel *)p : nullptr;
+		}
+		if(!granted)
+			perror("shared memory");
+	}
+	if(!granted)
+	{
+		if(fds[SHM_FD_CHANNEL] >= 0)
+			close(fds[SHM_FD_CHANNEL]);
+		if(fds[SHM_FD_ANSWERS] >= 0)
+			close(fds[SHM_FD_ANSWERS]);
+		queue_answer(st, fd, answer);
+		return;
+	}
+
+	// Sent directly: nothing else is queued or in flight, so the socket buffer is empty
+	iovec iov = {(void *)answer.data(), answer.size()};
+	msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof fds)] = {};
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof control;
+	cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof fds);
+	memcpy(CMSG_DATA(cm), fds, sizeof fds);
+	bool sent = sendmsg(fd, &msg, MSG_NOSIGNAL) == (ssize_t)iov.iov_len;
+
+	// The mapping keeps the memory, the worker has its own copies of descriptors
+	close(fds[SHM_FD_CHANNEL]);
+	if(!sent)
+	{
+		cerr << "Can not answer SHMR on socket " << fd << endl;
+		munmap(ch, sizeof(shm_channel));
+		close(fds[SHM_FD_ANSWERS]);
+		c->open = false;
+		st->fd_to_remove.push_back(fd);
+		return;
+	}
+	c->shm = ch;
+	c->shm_event = fds[SHM_FD_ANSWERS];
+	st->shm_fds.push_back(fd);
+}
+
+/*!
+Moves requests written into the rings to receive buffers and parses them, like data received from sockets.
+A buffer that still has requests of this iteration parsed from the socket is left for the next one.
+Answers that did not fit into rings last time are queued for flushing again.
+\param[in] st Scheduler state.
+*/
+void shm_receive(scheduler_state *st)
+{
+	for(int fd : st->shm_fds)
+	{
+		auto c = get_connection(st, fd);
+		auto &in = c->in;
+		c->shm->requests.waiting.store(0, std::memory_order_relaxed);
+		if(!c->open || in.head != 0 || shm_empty(&c->shm->requests))
+			continue;
+		if(shm_broken(&c->shm->requests))
+		{
+			cerr << "Broken request ring in shared memory of socket " << fd << ", closing\n";
+			trace_event(st, TRACE_MALFORMED, make_conn_id(st->self->id, fd, c->gen), 0, OP_NONE, "shm");
+			st->fd_to_remove.push_back(fd);
+			continue;
+		}
+
+		if(in.data.size() - in.tail < SHM_RING_SIZE)
+			in.data.resize(in.tail + SHM_RING_SIZE);
+		in.tail += shm_read(&c->shm->requests, in.data.data() + in.tail, in.data.size() - in.tail);
+		uint64_t conn = make_conn_id(st->self->id, fd, c->gen);
+		if(parse_buffer(&in, &st->client_buf, conn) != 0)
+		{
+			cerr << "Malformed message length in shared memory of socket " << fd << ", closing\n";
+			trace_event(st, TRACE_MALFORMED, conn, 0, OP_NONE, string_view(in.data.data() + in.head, in.tail - in.head));
+			st->fd_to_remove.push_back(fd);
+		}
+		st->fd_to_compact.push_back(fd);
+	}
+
+	for(int fd : st->shm_blocked)
+	{
+		auto &out = get_connection(st, fd)->out;
+		if(!out.queued)
+		{
+			out.queued = true;
+			st->to_flush.push_back(fd);
+		}
+	}
+	st->shm_blocked.clear();
+}
+
+/*!
+Writes queued answers into the answer ring and wakes the worker if it sleeps. What does not fit is retried next iteration.
+\param[in] st Scheduler state.
+\param[in] fd Socket descriptor of a shared memory connection.
+\returns 0 on success, -1 if the worker does not read its answers or broke the ring
+*/
+int shm_flush(scheduler_state *st, int fd)
+{
+	auto c = get_connection(st, fd);
+	auto &out = c->out;
+	if(shm_broken(&c->shm->answers))
+	{
+		cerr << "Broken answer ring in shared memory of socket " << fd << endl;
+		return -1;
+	}
+	size_t n = shm_write(&c->shm->answers, out.data.data() + out.head, out.data.size() - out.head);
+	out.head += n;
+	if(n != 0 && shm_should_wake(&c->shm->answers))
+		wake(c->shm_event);
+
+	if(out.head == out.data.size())
+	{
+		out.data.clear();
+		out.head = 0;
+		return 0;
+	}
+	if(out.data.size() - out.head > MAX_OUTPUT)
+	{
+		cerr << "Client on socket " << fd << " does not read answers\n";
+		return -1;
+	}
+	st->shm_blocked.push_back(fd);
+	return 0;
+}
+
+/*!
+Called before the processing thread goes to sleep: workers are asked to signal its eventfd from now on.
+Requests that came meanwhile wake the thread up at once.
+\param[in] st Scheduler state.
+\returns true if some answers wait for space in a ring, so the sleep has to be short
+*/
+bool shm_idle(scheduler_state *st)
+{
+	bool pending = false;
+	for(int fd : st->shm_fds)
+		if(!shm_prepare_wait(&get_connection(st, fd)->shm->requests))
+			pending = true;
+	if(pending)
+		wake(st->self->mail_fd);
+	return !st->shm_blocked.empty();
+}
+
+/*!
+Unmaps the rings of a closed connection.
+\param[in] st Scheduler state.
+\param[in] fd Socket descriptor.
+*/
+void shm_detach(scheduler_state *st, int fd)
+{
+	auto c = get_connection(st, fd);
+	munmap(c->shm, sizeof(shm_channel));
+	close(c->shm_event);
+	c->shm = nullptr;
+	st->shm_fds.erase(std::remove(st->shm_fds.begin(), st->shm_fds.end(), fd), st->shm_fds.end());
+	st->shm_blocked.erase(std::remove(st->shm_blocked.begin(), st->shm_blocked.end(), fd), st->shm_blocked.end());
+}
@@ -0,0 +1,115 @@
+/** @file shm_channel.h*/
+/** Shared memory transport of workers on the scheduler's node, shared with load_generator.
+**
+** A worker connected to the Unix domain socket (-U) sends SHMR as its first request. The answer (SHMR)
+** comes with three descriptors: memfd with shm_channel, eventfd that wakes the worker when answers
+** are written, and eventfd that wakes the processing thread. After that requests and answers are the
+** same bytes as on the socket (text or binary protocol), written into the rings instead.
+** The socket stays open and carries nothing else: closing it is the end of the connection.
+** A consumer that is about to sleep sets 'waiting' and checks the ring once more; a producer signals
+** the consumer's eventfd only when 'waiting' is set, so busy peers do not make system calls at all.
+ */
+#ifndef SHM_CHANNEL_H
+#define SHM_CHANNEL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+
+// Bytes of one direction, power of two
+#define SHM_RING_SIZE 65536
+// Descriptors passed with the SHMR answer, in this order
+#define SHM_FD_CHANNEL 0
+#define SHM_FD_ANSWERS 1
+#define SHM_FD_REQUESTS 2
+#define SHM_FDS 3
+
+//! Byte stream with one producer and one consumer. Positions only grow, offset in data is position % SHM_RING_SIZE.
+struct shm_ring
+{
+	alignas(64) std::atomic <uint64_t> head; ///bytes consumed, written by consumer
+	alignas(64) std::atomic <uint64_t> tail; ///bytes produced, written by producer
+	alignas(64) std::atomic <uint32_t> waiting; ///consumer sleeps on its eventfd
+	alignas(64) char data[SHM_RING_SIZE];
+};
+
+//! Mapped by both sides, zero-filled memory is the empty state.
+struct shm_channel
+{
+	shm_ring requests; ///worker to scheduler
+	shm_ring answers; ///scheduler to worker
+};
+
+static_assert(std::atomic <uint64_t>::is_always_lock_free, "ring positions are shared between processes");
+
+/*!
+Copies as much as fits into the ring. Positions written by the peer are not trusted: nothing is copied
+when they are more than the ring apart, see shm_broken().
+\returns bytes written
+*/
+static inline size_t shm_write(shm_ring *r, const char *data, size_t len)
+{
+	uint64_t tail = r->tail.load(std::memory_order_relaxed);
+	uint64_t head = r->head.load(std::memory_order_acquire);
+	uint64_t room = tail - head > SHM_RING_SIZE ? 0 : SHM_RING_SIZE - (tail - head);
+	size_t n = len < room ? len : (size_t)room;
+	size_t offset = (size_t)(tail % SHM_RING_SIZE);
+	size_t first = n < SHM_RING_SIZE - offset ? n : SHM_RING_SIZE - offset;
+	memcpy(r->data + offset, data, first);
+	memcpy(r->data, data + first, n - first);
+	r->tail.store(tail + n, std::memory_order_release);
+	return n;
+}
+
+/*!
+Takes up to 'len' bytes out of the ring, never more than the ring holds.
+\returns bytes read
+*/
+static inline size_t shm_read(shm_ring *r, char *data, size_t len)
+{
+	uint64_t head = r->head.load(std::memory_order_relaxed);
+	uint64_t tail = r->tail.load(std::memory_order_acquire);
+	uint64_t used = tail - head < SHM_RING_SIZE ? tail - head : SHM_RING_SIZE;
+	size_t n = len < used ? len : (size_t)used;
+	size_t offset = (size_t)(head % SHM_RING_SIZE);
+	size_t first = n < SHM_RING_SIZE - offset ? n : SHM_RING_SIZE - offset;
+	memcpy(data, r->data + offset, first);
+	memcpy(data + first, r->data, n - first);
+	r->head.store(head + n, std::memory_order_release);
+	return n;
+}
+
+/*!
+\returns true if the positions are more than the ring apart: the peer wrote garbage into them
+*/
+static inline bool shm_broken(const shm_ring *r)
+{
+	return r->tail.load(std::memory_order_acquire) - r->head.load(std::memory_order_acquire) > SHM_RING_SIZE;
+}
+
+static inline bool shm_empty(const shm_ring *r)
+{
+	return r->head.load(std::memory_order_relaxed) == r->tail.load(std::memory_order_acquire);
+}
+
+/*!
+Producer side of the wake-up: after writing, tells whether the consumer has to be signalled.
+*/
+static inline bool shm_should_wake(shm_ring *r)
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	return r->waiting.load(std::memory_order_relaxed) != 0;
+}
+
+/*!
+Consumer side of the wake-up: announces sleep and checks the ring once more.
+\returns true if the ring is still empty, so the consumer may wait on its eventfd
+*/
+static inline bool shm_prepare_wait(shm_ring *r)
+{
+	r->waiting.store(1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	return shm_empty(r);
+}
+
+#endif
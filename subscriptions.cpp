@@ -0,0 +1,149 @@
+/** @file subscriptions.cpp*/
+/** Workers told when targets become ready, without asking for them.
+**
+** "len#pid#SUBS#target" asks for "len#NTFY#target" when the target is finished (DONE of its writer, or its file
+** appeared in the reuse directory); right away if it is ready already. Such a subscription is answered once.
+** "len#pid#SUBS#prefix*" is kept until the connection is closed and answers every target with that prefix.
+** PREF instead of SUBS subscribes the same way, but the worker may also get "len#PREF#target": the file is ready,
+** its node does not have it cached and nobody else on that node was asked yet, so it should read the file
+** ahead and warm the page cache for the others. Request ids and the binary protocol work as for other requests.
+** Exact subscriptions are kept by the shard that owns the target, prefixes by every shard.
+ */
+#include <algorithm>
+#include <iostream>
+#include "file_scheduler.h"
+
+using std::cerr;
+
+/*!
+Tells one subscriber that the target is ready. The first prefetching subscriber of each node that has no copy gets PREF.
+\param[in] st Scheduler state.
+\param[in] target Ready target.
+\param[in] s Subscriber.
+*/
+static void notify(scheduler_state *st, const target_entry *target, const subscriber &s)
+{
+	auto &ts = target->second;
+	auto &chosen = st->subs.prefetching;
+	bool cached = std::find(ts.nodes, ts.nodes + ts.node_count, s.node) != ts.nodes + ts.node_count;
+	bool prefetch = s.prefetch && s.node != 0 && !cached && std::find(chosen.begin(), chosen.end(), s.node) == chosen.end();
+	if(prefetch)
+		chosen.push_back(s.node);
+	deliver(st, s.conn, prefetch ? OP_PREF : OP_NTFY, s.tag, target->first);
+}
+
+/*!
+Subscribes connection to a target of this shard, or to a prefix. A ready target is answered at once instead.
+\param[in] st Scheduler state.
+\param[in] request SUBS or PREF.
+\param[in] target Target name, or prefix followed by '*'.
+\param[in] node Node of the worker.
+*/
+void subscribe(scheduler_state *st, const client_buffer *request, string_view target, uint32_t node)
+{
+	auto &subs = st->subs;
+	subscriber s = {request->conn, request->tag, node, request->op == OP_PREF};
+	bool prefix = is_prefix_subscription(request);
+	if(!prefix)
+	{
+		auto found = st->engine.targets.find(target);
+		if(found != st->engine.targets.end() && found->second.ready)
+		{
+			subs.prefetching.clear();
+			notify(st, &*found, s);
+			return;
+		}
+	}
+
+	string_view key = prefix ? target.substr(0, target.size() - 1) : target;
+	auto inserted = (prefix ? subs.prefixes : subs.exact).try_emplace(target_hash(key));
+	auto &group = inserted.first->second;
+	if(inserted.second)
+	{
+		group.key = string(key);
+		if(prefix)
+			++subs.prefix_lengths[key.size()];
+	}
+	else if(group.key != key)
+	{
+		cerr << "Subscription to " << key << " collides with " << group.key << ", ignored\n";
+		return;
+	}
+	group.subscribers.push_back(s);
+	++subs.counts[s.conn];
+}
+
+/*!
+Answers subscriptions on a target that has just become ready: the exact ones, which are dropped then, and every matching prefix.
+\param[in] st Scheduler state.
+\param[in] target Ready target.
+*/
+void notify_subscribers(scheduler_state *st, target_entry *target)
+{
+	auto &subs = st->subs;
+	if(subs.exact.empty() && subs.prefixes.empty())
+		return;
+	string_view name = target->first;
+	subs.prefetching.clear();
+
+	auto found = subs.exact.find(target->second.hash);
+	if(found != subs.exact.end() && found->second.key == name)
+	{
+		for(auto &s : found->second.subscribers)
+		{
+			notify(st, target, s);
+			auto count = subs.counts.find(s.conn);
+			if(--count->second == 0)
+				subs.counts.erase(count);
+		}
+		subs.exact.erase(found);
+	}
+
+	// Hashes of the beginnings of the name are computed on the way, one lookup per length in use
+	uint64_t h = TARGET_HASH_BASIS;
+	size_t len = 0;
+	for(auto &length : subs.prefix_lengths)
+	{
+		if(length.first > name.size())
+			break;
+		for(; len < length.first; ++len)
+			h = target_hash_step(h, name[len]);
+		auto group = subs.prefixes.find(h);
+		if(group != subs.prefixes.end() && group->second.key == name.substr(0, len))
+			for(auto &s : group->second.subscribers)
+				notify(st, target, s);
+	}
+}
+
+/*!
+Drops subscriptions of a closed connection. Costs a pass over the tables, connections without subscriptions cost nothing.
+\param[in] st Scheduler state.
+\param[in] conn Closed connection id.
+*/
+void unsubscribe(scheduler_state *st, uint64_t conn)
+{
+	auto &subs = st->subs;
+	if(subs.counts.erase(conn) == 0)
+		return;
+
+	auto drop = [conn](subscription &group)
+	{
+		auto &v = group.subscribers;
+		v.erase(std::remove_if(v.begin(), v.end(), [conn](const subscriber &s) { return s.conn == conn; }), v.end());
+		return v.empty();
+	};
+	for(auto group = subs.exact.begin(); group != subs.exact.end();)
+		group = drop(group->second) ? subs.exact.erase(group) : std::next(group);
+	for(auto group = subs.prefixes.begin(); group != subs.prefixes.end();)
+	{
+		if(!drop(group->second))
+		{
+			++group;
+			continue;
+		}
+		auto length = subs.prefix_lengths.find(group->second.key.size());
+		if(--length->second == 0)
+			subs.prefix_lengths.erase(length);
+		group = subs.prefixes.erase(group);
+	}
+}
@@ -0,0 +1,155 @@
+/** @file timer_wheel.cpp*/
+/** Hierarchical timer wheel for writer leases.
+**
+** WHEEL_LEVELS levels of WHEEL_SIZE slots, one tick is TIMER_TICK_MS.
+** Level L keeps timers that expire in less than WHEEL_SIZE^(L+1) ticks, a slot is a
+** doubly linked list, so adding and removing a timer is O(1). When level 0 wraps around
+** the current slot of the next level is cascaded down. Timers further away than the last level
+** are kept in its farthest slot and put back when they come down.
+ */
+#include <algorithm>
+#include <chrono>
+#include "decision_engine.h"
+
+static inline size_t slot_index(uint64_t tick, int level)
+{
+	return (size_t)(tick >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+}
+
+static void link_timer(wheel_timer *head, wheel_timer *t)
+{
+	t->prev = head->prev;
+	t->next = head;
+	head->prev->next = t;
+	head->prev = t;
+}
+
+/*!
+Prepares empty wheel.
+\param[out] w Wheel.
+\param[in] now Current tick.
+*/
+void wheel_init(timer_wheel *w, uint64_t now)
+{
+	for(int level = 0; level < WHEEL_LEVELS; ++level)
+		for(size_t i = 0; i < WHEEL_SIZE; ++i)
+			w->slots[level][i].prev = w->slots[level][i].next = &w->slots[level][i];
+	w->now = now;
+	w->count = 0;
+}
+
+static void place(timer_wheel *w, wheel_timer *t)
+{
+	// Cascaded timer of the current tick goes to the slot processed right after cascading
+	uint64_t delta = t->expires > w->now ? t->expires - w->now : 0;
+	for(int level = 0; level < WHEEL_LEVELS; ++level)
+	{
+		if(delta < (1ull << (WHEEL_BITS * (level + 1))))
+		{
+			link_timer(&w->slots[level][slot_index(std::max(t->expires, w->now), level)], t);
+			return;
+		}
+	}
+	// Too far - wait in the farthest slot of the last level, placed again on cascade
+	uint64_t farthest = w->now + (1ull << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+	link_timer(&w->slots[WHEEL_LEVELS - 1][slot_index(farthest, WHEEL_LEVELS - 1)], t);
+}
+
+/*!
+Schedules timer.
+\param[in] w Wheel.
+\param[in] t Timer, not scheduled yet.
+\param[in] expires Tick when the timer fires.
+\param[in] now Current tick.
+*/
+void wheel_add(timer_wheel *w, wheel_timer *t, uint64_t expires, uint64_t now)
+{
+	// Nobody advanced idle wheel, there is nothing to fire in the gap
+	if(w->count == 0)
+		w->now = std::max(w->now, now);
+	// Slot of the current tick is already processed
+	t->expires = std::max(expires, w->now + 1);
+	place(w, t);
+	++w->count;
+}
+
+/*!
+Cancels timer. Does nothing if it is not scheduled.
+\param[in] w Wheel.
+\param[in] t Timer.
+*/
+void wheel_remove(timer_wheel *w, wheel_timer *t)
+{
+	if(t->next == nullptr)
+		return;
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->prev = t->next = nullptr;
+	--w->count;
+}
+
+static void cascade(timer_wheel *w, int level)
+{
+	wheel_timer *head = &w->slots[level][slot_index(w->now, level)];
+	wheel_timer list = *head;
+	if(list.next == head)
+		return;
+	// Detach the whole slot first, timers may come back to it
+	list.next->prev = &list;
+	list.prev->next = &list;
+	head->prev = head->next = head;
+	while(list.next != &list)
+	{
+		wheel_timer *t = list.next;
+		list.next = t->next;
+		t->next->prev = &list;
+		place(w, t);
+	}
+}
+
+/*!
+Advances wheel to the current time and collects expired timers.
+\param[in] w Wheel.
+\param[in] target Current tick.
+\param[out] expired Timers that fired, already removed from the wheel.
+*/
+void wheel_advance(timer_wheel *w, uint64_t target, vector <wheel_timer *> *expired)
+{
+	if(w->count == 0)
+	{
+		w->now = std::max(w->now, target);
+		return;
+	}
+	while(w->now < target && w->count > 0)
+	{
+		++w->now;
+		if(slot_index(w->now, 0) == 0)
+		{
+			for(int level = 1; level < WHEEL_LEVELS; ++level)
+			{
+				cascade(w, level);
+				if(slot_index(w->now, level) != 0)
+					break;
+			}
+		}
+		wheel_timer *head = &w->slots[0][slot_index(w->now, 0)];
+		while(head->next != head)
+		{
+			wheel_timer *t = head->next;
+			wheel_remove(w, t);
+			expired->push_back(t);
+		}
+	}
+	w->now = std::max(w->now, target);
+}
+
+/*!
+\returns milliseconds until the next tick, -1 if there are no timers
+*/
+int wheel_timeout(const timer_wheel *w)
+{
+	if(w->count == 0)
+		return -1;
+	auto ms = std::chrono::duration_cast <std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	return (int)(TIMER_TICK_MS - (uint64_t)ms % TIMER_TICK_MS);
+}
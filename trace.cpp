@@ -0,0 +1,196 @@
+/** @file trace.cpp*/
+/** Binary trace of processing threads.
+**
+** Every processing thread writes fixed-size records into its own ring, which is
+** emptied into scheduler.trace by a background thread every TRACE_FLUSH_MS.
+** A full ring drops records instead of waiting, the number of dropped records is traced too.
+** Level is set with -T and switched at run time with SIGUSR1: 0 - off, 1 - connections
+** and decisions, 2 - every request as well. The file is rendered as text by trace_decode.
+ */
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include "file_scheduler.h"
+
+using std::cerr;
+
+// How often rings are emptied into the file
+#define TRACE_FLUSH_MS 100
+
+std::atomic <int> trace_level(0);
+
+//! State of the thread that writes the trace file.
+struct trace_writer
+{
+	FILE *file; ///opened with the first record
+	std::mutex lock;
+	std::condition_variable wake;
+	bool stop;
+	std::thread thread;
+};
+
+static trace_writer writer;
+
+/*!
+Appends record to the ring of the shard. Never waits: when the ring is full the record is counted as dropped.
+\param[in] self Shard of the calling thread.
+\param[in] type Event.
+\param[in] conn Connection id.
+\param[in] pid Worker process id, or event specific number.
+\param[in] op Operation or answer, see trace_op.
+\param[in] text Target name or other text, only its beginning is kept.
+\param[in] arg Number that goes with the event, see trace_record.
+*/
+void trace_write(shard *self, trace_type type, uint64_t conn, int pid, uint8_t op, string_view text, uint64_t arg)
+{
+	trace_ring *ring = self->trace;
+	size_t tail = ring->tail.load(std::memory_order_relaxed);
+	if(tail - ring->head.load(std::memory_order_acquire) == TRACE_RING_SIZE)
+	{
+		ring->dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	trace_record &r = ring->records[tail & (TRACE_RING_SIZE - 1)];
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	r.time_ns = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+	r.hash = text.empty() ? 0 : target_hash(text);
+	r.conn = conn;
+	r.pid = pid;
+	r.type = (uint8_t)type;
+	r.op = op;
+	r.shard = (uint8_t)self->id;
+	r.text_len = (uint8_t)std::min(text.size(), (size_t)255);
+	r.arg = arg;
+	size_t copied = std::min(text.size(), sizeof r.text);
+	memcpy(r.text, text.data(), copied);
+	memset(r.text + copied, 0, sizeof r.text - copied);
+	ring->tail.store(tail + 1, std::memory_order_release);
+}
+
+/*!
+\returns code of operation or answer kept in trace records
+*/
+uint8_t trace_op(op_code op)
+{
+	return op < OP_OTHER ? (uint8_t)op : TRACE_OP_OTHER;
+}
+
+static void put_record(const trace_record &r)
+{
+	if(writer.file == nullptr)
+	{
+		writer.file = fopen("scheduler.trace", "ab");
+		if(writer.file == nullptr)
+		{
+			perror("scheduler.trace");
+			return;
+		}
+		// Every run starts with a header, so the decoder can check the format of appended traces
+		trace_record header;
+		memset(&header, 0, sizeof header);
+		header.time_ns = r.time_ns;
+		header.type = TRACE_HEADER;
+		header.pid = (int)getpid();
+		header.conn = shard_count;
+		header.op = TRACE_VERSION;
+		strncpy(header.text, TRACE_MAGIC, sizeof header.text);
+		header.text_len = (uint8_t)strlen(TRACE_MAGIC);
+		fwrite(&header, sizeof header, 1, writer.file);
+	}
+	fwrite(&r, sizeof r, 1, writer.file);
+}
+
+static void drain()
+{
+	for(size_t s = 0; s < shard_count; ++s)
+	{
+		trace_ring *ring = shards[s].trace;
+		size_t head = ring->head.load(std::memory_order_relaxed);
+		size_t tail = ring->tail.load(std::memory_order_acquire);
+		for(; head != tail; ++head)
+			put_record(ring->records[head & (TRACE_RING_SIZE - 1)]);
+		ring->head.store(head, std::memory_order_release);
+
+		size_t dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+		if(dropped > 0)
+		{
+			trace_record r;
+			memset(&r, 0, sizeof r);
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			r.time_ns = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+			r.type = TRACE_DROPPED;
+			r.shard = (uint8_t)s;
+			r.pid = (int)std::min(dropped, (size_t)INT32_MAX);
+			put_record(r);
+		}
+	}
+	if(writer.file)
+		fflush(writer.file);
+}
+
+static void trace_loop()
+{
+	std::unique_lock <std::mutex> guard(writer.lock);
+	while(!writer.stop)
+	{
+		writer.wake.wait_for(guard, std::chrono::milliseconds(TRACE_FLUSH_MS));
+		drain();
+	}
+	drain();
+}
+
+/*!
+Creates rings of all shards and starts the thread that writes them to the file.
+*/
+void trace_open()
+{
+	for(size_t s = 0; s < shard_count; ++s)
+	{
+		shards[s].trace = new trace_ring();
+		shards[s].trace->head = 0;
+		shards[s].trace->tail = 0;
+		shards[s].trace->dropped = 0;
+	}
+	writer.file = nullptr;
+	writer.stop = false;
+	writer.thread = std::thread(trace_loop);
+}
+
+/*!
+Writes what is left in the rings and stops the writer.
+*/
+void trace_close()
+{
+	{
+		std::lock_guard <std::mutex> guard(writer.lock);
+		writer.stop = true;
+	}
+	writer.wake.notify_one();
+	writer.thread.join();
+	if(writer.file)
+		fclose(writer.file);
+	for(size_t s = 0; s < shard_count; ++s)
+		delete shards[s].trace;
+}
+
+/*!
+Switches to the next trace level, 0 after the last one. Called from the signal handler.
+*/
+void traceToggleHandler(int)
+{
+	int level = (trace_level.load(std::memory_order_relaxed) + 1) % (TRACE_ALL + 1);
+	trace_level.store(level, std::memory_order_relaxed);
+	const char msg[] = "Trace level switched\n";
+	if(write(STDERR_FILENO, msg, sizeof msg - 1) < 0)
+		return;
+}
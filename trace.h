@@ -0,0 +1,58 @@
+/** @file trace.h*/
+/** Format of the binary trace written by processing threads, shared with trace_decode.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_MAGIC "PSSC scheduler trace"
+#define TRACE_VERSION 2
+// Records kept by one processing thread until the writer takes them, power of two
+#define TRACE_RING_SIZE 16384
+// Operation that is none of the known ones
+#define TRACE_OP_OTHER 255
+
+//! Levels switched by SIGUSR1.
+enum trace_levels
+{
+	TRACE_OFF,
+	TRACE_DECISIONS, ///connections, answers, lost writers
+	TRACE_ALL ///every request as well
+};
+
+enum trace_type : uint8_t
+{
+	TRACE_HEADER = 1, ///starts every run, text is TRACE_MAGIC, op is TRACE_VERSION, pid is server pid, conn is number of shards
+	TRACE_DROPPED, ///pid is the number of records lost because the ring was full
+	TRACE_START, ///processing thread started
+	TRACE_STOP, ///processing thread exits
+	TRACE_CONNECT, ///text is the remote address
+	TRACE_CLOSE, ///connection closed
+	TRACE_MALFORMED, ///broken message, text is its beginning
+	TRACE_DECISION, ///op is the answer given to pid
+	TRACE_LEASE_EXPIRED, ///writer pid did not send BEAT in time
+	// Types from here on are traced at TRACE_ALL only
+	TRACE_REQUEST = 64, ///op is the requested operation, every request of a BTCH is traced as well
+	TRACE_INPUT, ///DEPS: text is the target, arg is target_hash() of its input, see engine_add_input()
+	TRACE_DEPENDENT ///DEPS: text is the input, arg is target_hash() of the target that needs it, see engine_add_dependent()
+};
+
+//! One event, 64 bytes.
+struct trace_record
+{
+	uint64_t time_ns; ///CLOCK_REALTIME
+	uint64_t hash; ///target id, hash of the full text
+	uint64_t conn; ///connection id: shard, descriptor generation, descriptor
+	int32_t pid;
+	uint8_t type; ///trace_type
+	uint8_t op; ///op_code of decision_engine.h, TRACE_OP_OTHER
+	uint8_t shard;
+	uint8_t text_len; ///length of the full text, only 24 bytes are kept
+	uint64_t arg; ///DONE: bytes of the written file, WORK: shards asked before, see trace_type for the rest
+	char text[24];
+};
+
+static_assert(sizeof(trace_record) == 64, "trace record must stay 64 bytes");
+
+#endif
@@ -0,0 +1,103 @@
+/** @file trace_decode.cpp*/
+/** Renders binary trace of the scheduler (scheduler.trace) as text, one event per line.
+**
+** Usage: trace_decode [trace file]
+ */
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include "trace.h"
+
+static const char *op_name(uint8_t op)
+{
+	// Order of op_code in decision_engine.h
+	static const char *names[] = {"-", "READ", "WRIT", "WAIT", "DONE", "BEAT", "EXIT", "HINT", "BTCH", "SHMR", "SUBS", "PREF", "NTFY",
+		"DEPS", "WORK", "IDLE", "EVCT"};
+	if(op < sizeof names / sizeof names[0])
+		return names[op];
+	return op == TRACE_OP_OTHER ? "?" : "-";
+}
+
+static const char *type_name(uint8_t type)
+{
+	switch(type)
+	{
+		case TRACE_HEADER: return "TRACE";
+		case TRACE_DROPPED: return "DROPPED";
+		case TRACE_START: return "START";
+		case TRACE_STOP: return "STOP";
+		case TRACE_CONNECT: return "CONNECT";
+		case TRACE_CLOSE: return "CLOSE";
+		case TRACE_MALFORMED: return "MALFORMED";
+		case TRACE_DECISION: return "ANSWER";
+		case TRACE_LEASE_EXPIRED: return "EXPIRED";
+		case TRACE_REQUEST: return "REQUEST";
+		case TRACE_INPUT: return "INPUT";
+		case TRACE_DEPENDENT: return "DEPENDENT";
+		default: return "UNKNOWN";
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = argc > 1 ? argv[1] : "scheduler.trace";
+	FILE *file = fopen(path, "rb");
+	if(file == nullptr)
+	{
+		perror(path);
+		return 1;
+	}
+
+	trace_record r;
+	bool valid = false;
+	while(fread(&r, sizeof r, 1, file) == 1)
+	{
+		if(r.type == TRACE_HEADER)
+		{
+			valid = strncmp(r.text, TRACE_MAGIC, sizeof r.text) == 0 && r.op == TRACE_VERSION;
+			if(!valid)
+				fprintf(stderr, "Unknown trace format, skipping until the next header\n");
+		}
+		if(!valid)
+			continue;
+
+		time_t sec = (time_t)(r.time_ns / 1000000000ull);
+		struct tm tm;
+		localtime_r(&sec, &tm);
+		char stamp[32];
+		strftime(stamp, sizeof stamp, "%Y-%m-%d %H:%M:%S", &tm);
+		printf("[%s.%06u] shard %u %-9s", stamp, (unsigned)(r.time_ns % 1000000000ull / 1000), (unsigned)r.shard, type_name(r.type));
+
+		if(r.conn != 0 && r.type != TRACE_HEADER)
+			printf(" conn %u/%u", (unsigned)(r.conn & 0xFFFFFF), (unsigned)((r.conn >> 24) & 0xFFFFFFFF));
+		if(r.type == TRACE_DROPPED)
+			printf(" %d records", r.pid);
+		else if(r.pid != 0)
+			printf(" pid %d", r.pid);
+		bool has_target = r.type == TRACE_REQUEST || r.type == TRACE_DECISION || r.type == TRACE_LEASE_EXPIRED
+			|| r.type == TRACE_INPUT || r.type == TRACE_DEPENDENT;
+		if(r.type == TRACE_HEADER)
+			printf(" version %u, %u shards", (unsigned)r.op, (unsigned)r.conn);
+		else if(r.op != 0)
+			printf(" %s", op_name(r.op));
+		if(r.text_len > 0)
+		{
+			int shown = r.text_len < sizeof r.text ? r.text_len : (int)sizeof r.text;
+			printf(" %.*s%s", shown, r.text, r.text_len > sizeof r.text ? "..." : "");
+			if(has_target)
+				printf(" #%016" PRIx64, r.hash);
+		}
+		if(r.type == TRACE_INPUT)
+			printf(" needs #%016" PRIx64, r.arg);
+		else if(r.type == TRACE_DEPENDENT)
+			printf(" needed by #%016" PRIx64, r.arg);
+		else if(r.type == TRACE_REQUEST && strcmp(op_name(r.op), "DONE") == 0 && r.arg != 0)
+			printf(" size %" PRIu64, r.arg);
+		else if(r.type == TRACE_REQUEST && strcmp(op_name(r.op), "WORK") == 0)
+			printf(" hops %" PRIu64, r.arg);
+		printf("\n");
+	}
+	fclose(file);
+	return 0;
+}
@@ -0,0 +1,574 @@
+/** @file uring_loop.cpp*/
+/** io_uring backend of the processing loop.
+**
+** Same work as read_and_respond, but without a syscall per socket:
+** connections are accepted by one multishot accept, data is received by multishot recv
+** into buffers provided by the ring, and all answers of one iteration are submitted
+** together with the next wait. Decisions are made by the same code as with epoll.
+**
+** Selected with -u. Can be left out of the build with IO_URING=0.
+ */
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <iostream>
+#include "file_scheduler.h"
+
+using std::cerr;
+using std::cout;
+using std::endl;
+
+#ifndef NO_IO_URING
+
+// Submission queue size. Completion queue is four times bigger.
+#define URING_ENTRIES 1024
+// Buffers provided to the kernel for multishot recv
+#define URING_BUFFERS 512
+#define URING_BUFFER_SIZE 4096
+#define URING_BUFFER_GROUP 0
+
+//! What operation a completion belongs to. Kept in the top byte of user_data, descriptor in the rest.
+enum uring_op
+{
+	OP_ACCEPT = 1,
+	OP_RECV,
+	OP_SEND,
+	OP_MAIL,
+	OP_SHUTDOWN,
+	OP_FILES,
+	OP_CANCEL,
+	OP_PROVIDE
+};
+
+//! Mapped rings of one io_uring instance.
+struct uring
+{
+	int fd;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_array;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned sqe_tail; ///local tail, published on submit
+	io_uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	io_uring_cqe *cqes;
+	void *sq_ptr;
+	size_t sq_size;
+	void *cq_ptr;
+	size_t cq_size;
+	size_t sqes_size;
+
+	char *buffers; ///provided to the kernel for recv, URING_BUFFER_SIZE each
+
+};
+
+static inline uint64_t pack_user_data(uring_op op, int fd)
+{
+	return ((uint64_t)op << 56) | (uint32_t)fd;
+}
+
+static inline uring_op user_data_op(uint64_t data)
+{
+	return (uring_op)(data >> 56);
+}
+
+static inline int user_data_fd(uint64_t data)
+{
+	return (int)(data & 0xFFFFFFFF);
+}
+
+/*!
+Publishes prepared submissions and optionally waits for completions.
+\param[in] r Ring.
+\param[in] wait_nr How many completions to wait for.
+\param[in] timeout_ms Longest wait in milliseconds, -1 - no limit.
+\returns result of io_uring_enter
+*/
+static int uring_submit(uring *r, unsigned wait_nr, int timeout_ms = -1)
+{
+	unsigned to_submit = r->sqe_tail - *r->sq_tail;
+	__atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+	unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+	__kernel_timespec ts;
+	io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof arg);
+	if(wait_nr > 0 && timeout_ms >= 0)
+	{
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+		arg.ts = (uint64_t)&ts;
+		flags |= IORING_ENTER_EXT_ARG;
+	}
+	int ret = (int)syscall(__NR_io_uring_enter, r->fd, to_submit, wait_nr, flags, (flags & IORING_ENTER_EXT_ARG) ? &arg : NULL, sizeof arg);
+	if(ret < 0 && errno != EINTR && errno != EBUSY && errno != ETIME)
+		perror("io_uring_enter");
+	return ret;
+}
+
+/*!
+Returns next free submission entry, submitting the queue first if it is full.
+\param[in] r Ring.
+\returns zeroed submission entry
+*/
+static io_uring_sqe *uring_get_sqe(uring *r)
+{
+	unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	while(r->sqe_tail - head >= r->sq_entries)
+	{
+		uring_submit(r, 0);
+		head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	}
+	unsigned index = r->sqe_tail & r->sq_mask;
+	io_uring_sqe *sqe = &r->sqes[index];
+	memset(sqe, 0, sizeof *sqe);
+	r->sq_array[index] = index;
+	++r->sqe_tail;
+	return sqe;
+}
+
+/*!
+Gives receive buffers back to the kernel. Submitted together with the next wait, completion is reported only on failure.
+\param[in] r Ring.
+\param[in] bid First buffer.
+\param[in] count Number of consecutive buffers.
+*/
+static void provide_buffers(uring *r, unsigned short bid, unsigned count)
+{
+	io_uring_sqe *sqe = uring_get_sqe(r);
+	sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+	sqe->fd = (int)count;
+	sqe->addr = (uint64_t)(r->buffers + (size_t)bid * URING_BUFFER_SIZE);
+	sqe->len = URING_BUFFER_SIZE;
+	sqe->off = bid;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+	sqe->user_data = pack_user_data(OP_PROVIDE, 0);
+}
+
+/*!
+Creates the ring, maps its queues and provides buffers for recv.
+\param[out] r Ring to initialize.
+\returns 0 on success
+*/
+static int uring_init(uring *r)
+{
+	io_uring_params p;
+	memset(&p, 0, sizeof p);
+	memset(r, 0, sizeof *r);
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+	p.cq_entries = URING_ENTRIES * 4;
+	r->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if(r->fd < 0)
+	{
+		perror("io_uring_setup");
+		return -1;
+	}
+	if(!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG))
+	{
+		cerr << "io_uring: kernel is too old\n";
+		close(r->fd);
+		return -1;
+	}
+
+	r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	if(r->cq_size > r->sq_size)
+		r->sq_size = r->cq_size;
+	r->cq_size = r->sq_size;
+	r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	r->cq_ptr = r->sq_ptr;
+	r->sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+	r->sqes = (io_uring_sqe *)mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if(r->sq_ptr == MAP_FAILED || r->sqes == MAP_FAILED)
+	{
+		perror("mmap");
+		close(r->fd);
+		return -1;
+	}
+
+	char *sq = (char *)r->sq_ptr;
+	r->sq_head = (unsigned *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_entries = p.sq_entries;
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	r->sqe_tail = *r->sq_tail;
+	char *cq = (char *)r->cq_ptr;
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	r->buffers = (char *)mmap(NULL, (size_t)URING_BUFFERS * URING_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(r->buffers == MAP_FAILED)
+	{
+		perror("mmap");
+		close(r->fd);
+		return -1;
+	}
+	provide_buffers(r, 0, URING_BUFFERS);
+	if(uring_submit(r, 0) < 0)
+	{
+		close(r->fd);
+		return -1;
+	}
+	return 0;
+}
+
+static void uring_destroy(uring *r)
+{
+	munmap(r->sqes, r->sqes_size);
+	munmap(r->sq_ptr, r->sq_size);
+	munmap(r->buffers, (size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+	close(r->fd);
+}
+
+static void arm_accept(uring *r, int listen_fd)
+{
+	io_uring_sqe *sqe = uring_get_sqe(r);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = listen_fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK;
+	sqe->user_data = pack_user_data(OP_ACCEPT, listen_fd);
+}
+
+static void arm_recv(scheduler_state *st, int fd)
+{
+	io_uring_sqe *sqe = uring_get_sqe(st->ring);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	sqe->user_data = pack_user_data(OP_RECV, fd);
+	++get_connection(st, fd)->inflight;
+}
+
+static void arm_poll(uring *r, int fd, uring_op op)
+{
+	io_uring_sqe *sqe = uring_get_sqe(r);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = pack_user_data(op, fd);
+}
+
+static void submit_send(scheduler_state *st, int fd)
+{
+	auto c = get_connection(st, fd);
+	io_uring_sqe *sqe = uring_get_sqe(st->ring);
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(c->out.sending.data() + c->out.sent);
+	sqe->len = (uint32_t)(c->out.sending.size() - c->out.sent);
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = pack_user_data(OP_SEND, fd);
+	c->out.busy = true;
+	++c->inflight;
+}
+
+/*!
+Starts sending queued answers. While one send is in flight new answers are collected in the other buffer,
+so the memory given to the kernel never moves.
+\param[in] st Scheduler state.
+\param[in] fd Socket descriptor.
+\returns 0 on success, -1 if client does not read its answers
+*/
+int uring_flush(scheduler_state *st, int fd)
+{
+	auto &out = get_connection(st, fd)->out;
+	if(out.busy)
+	{
+		if(out.data.size() > MAX_OUTPUT)
+		{
+			cerr << "Client on socket " << fd << " does not read answers\n";
+			return -1;
+		}
+		return 0;
+	}
+	if(out.data.empty())
+		return 0;
+	out.sending.swap(out.data);
+	out.data.clear();
+	out.sent = 0;
+	submit_send(st, fd);
+	return 0;
+}
+
+static void forget_operation(scheduler_state *st, int fd)
+{
+	auto c = get_connection(st, fd);
+	if(--c->inflight == 0 && c->zombie)
+	{
+		c->zombie = false;
+		close(fd);
+	}
+}
+
+/*!
+Cancels operations of a closed connection. Descriptor is closed only after the last of them completes,
+so its number is not reused while the kernel may still report on it.
+\param[in] st Scheduler state.
+\param[in] fd Socket descriptor.
+*/
+void uring_release_socket(scheduler_state *st, int fd)
+{
+	auto c = get_connection(st, fd);
+	if(c->inflight == 0)
+	{
+		close(fd);
+		return;
+	}
+	c->zombie = true;
+	io_uring_sqe *sqe = uring_get_sqe(st->ring);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = fd;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+	sqe->user_data = pack_user_data(OP_CANCEL, fd);
+}
+
+static void close_later(scheduler_state *st, int fd)
+{
+	auto c = get_connection(st, fd);
+	if(c->open)
+	{
+		c->open = false;
+		st->fd_to_remove.push_back(fd);
+	}
+}
+
+static void handle_recv(scheduler_state *st, io_uring_cqe *cqe, vector <int> *to_parse)
+{
+	int fd = user_data_fd(cqe->user_data);
+	auto c = get_connection(st, fd);
+
+	if(cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER))
+	{
+		unsigned short bid = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+		if(c->open)
+		{
+			auto &in = c->in;
+			size_t len = (size_t)cqe->res;
+			if(in.data.size() < in.tail + len)
+				in.data.resize(std::max(in.data.size() * 2, std::max(in.tail + len, (size_t)RECV_BUF_SIZE)));
+			memcpy(in.data.data() + in.tail, st->ring->buffers + (size_t)bid * URING_BUFFER_SIZE, len);
+			in.tail += len;
+			if(!c->parse_pending)
+			{
+				c->parse_pending = true;
+				to_parse->push_back(fd);
+			}
+		}
+		provide_buffers(st->ring, bid, 1);
+	}
+	else if(cqe->res == 0)
+		close_later(st, fd); // End of file. The remote has closed the connection.
+	else if(cqe->res != -ENOBUFS && cqe->res != -ECANCELED)
+	{
+		cerr << "Count error on socket " << fd << ": " << strerror(-cqe->res) << endl;
+		close_later(st, fd);
+	}
+
+	if(!(cqe->flags & IORING_CQE_F_MORE))
+	{
+		forget_operation(st, fd);
+		// Multishot recv stops when provided buffers run out, start it again
+		if(c->open && cqe->res != 0)
+			arm_recv(st, fd);
+	}
+}
+
+static void handle_send(scheduler_state *st, io_uring_cqe *cqe)
+{
+	int fd = user_data_fd(cqe->user_data);
+	auto c = get_connection(st, fd);
+	auto &out = c->out;
+	out.busy = false;
+	forget_operation(st, fd);
+
+	if(cqe->res < 0)
+	{
+		if(c->open)
+			cerr << "Error on socket " << fd << endl;
+		close_later(st, fd);
+		return;
+	}
+	if(!c->open)
+		return;
+
+	out.sent += (size_t)cqe->res;
+	if(out.sent < out.sending.size())
+		submit_send(st, fd);
+	else if(!out.data.empty() && uring_flush(st, fd) != 0)
+		close_later(st, fd);
+}
+
+/*!
+Processing loop of one shard on top of io_uring. Does the same as read_and_respond.
+\param[in] threadarg Shard served by this thread.
+*/
+void *uring_read_and_respond(void * threadarg)
+{
+	auto my_data = (shard *) threadarg;
+	uring ring;
+	scheduler_state st;
+	st.self = my_data;
+	st.efd = -1;
+	st.outbox.resize(shard_count);
+	st.hot_min = st.hot_published = 0;
+	st.hot_dirty = false;
+	init_engine(&st);
+	trace_event(&st, TRACE_START, 0, 0, OP_NONE, "io_uring");
+	vector <int> to_parse;
+	bool mail_pending = false;
+
+	if(uring_init(&ring) != 0)
+	{
+		time_to_exit = true;
+		pthread_exit(NULL);
+	}
+	st.ring = &ring;
+
+	arm_accept(&ring, my_data->listen_fd);
+	if(my_data->local_fd >= 0)
+		arm_accept(&ring, my_data->local_fd);
+	arm_poll(&ring, my_data->mail_fd, OP_MAIL);
+	arm_poll(&ring, shutdown_fd, OP_SHUTDOWN);
+	if(my_data->watch_fd >= 0)
+		arm_poll(&ring, my_data->watch_fd, OP_FILES);
+
+	while(!time_to_exit)
+	{
+		// Mail that did not fit into a full mailbox is retried soon, otherwise sleep until something happens or a lease runs out
+		uring_submit(&ring, 1, mail_pending ? 1 : iteration_timeout(&st));
+
+		unsigned head = *ring.cq_head;
+		unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		for(; head != tail; ++head)
+		{
+			io_uring_cqe *cqe = &ring.cqes[head & ring.cq_mask];
+			int fd = user_data_fd(cqe->user_data);
+
+			switch(user_data_op(cqe->user_data))
+			{
+				case OP_ACCEPT:
+					if(cqe->res >= 0)
+					{
+						if(cqe->res > 0xFFFFFF)
+						{
+							cout << "Too many open descriptors, rejecting connection." << endl;
+							close(cqe->res);
+						}
+						else
+						{
+							register_connection(&st, cqe->res);
+							arm_recv(&st, cqe->res);
+						}
+					}
+					else if(cqe->res != -EAGAIN && cqe->res != -EINTR && cqe->res != -ECONNABORTED)
+						cerr << "Connection acceptance error: " << strerror(-cqe->res) << endl;
+					if(!(cqe->flags & IORING_CQE_F_MORE))
+						arm_accept(&ring, fd);
+					break;
+				case OP_RECV:
+					handle_recv(&st, cqe, &to_parse);
+					break;
+				case OP_SEND:
+					handle_send(&st, cqe);
+					break;
+				case OP_MAIL:
+					collect_mail(&st, &st.received);
+					if(!(cqe->flags & IORING_CQE_F_MORE))
+						arm_poll(&ring, fd, OP_MAIL);
+					break;
+				case OP_FILES:
+					reuse_dir_events(&st);
+					if(!(cqe->flags & IORING_CQE_F_MORE))
+						arm_poll(&ring, fd, OP_FILES);
+					break;
+				case OP_SHUTDOWN:
+				case OP_CANCEL:
+					break;
+				case OP_PROVIDE:
+					cerr << "Can not provide receive buffers: " << strerror(-cqe->res) << endl;
+					break;
+			}
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+		// Every connection is parsed once per iteration: requests refer to its buffer until it is compacted
+		for(unsigned j = 0; j < to_parse.size(); ++j)
+		{
+			int fd = to_parse[j];
+			auto c = get_connection(&st, fd);
+			c->parse_pending = false;
+			if(!c->open)
+				continue;
+			if(parse_buffer(&c->in, &st.client_buf, make_conn_id(my_data->id, fd, c->gen)) != 0)
+			{
+				cerr << "Malformed message length on socket " << fd << ", closing\n";
+				trace_event(&st, TRACE_MALFORMED, make_conn_id(my_data->id, fd, c->gen), 0, OP_NONE, string_view(c->in.data.data() + c->in.head, c->in.tail - c->in.head));
+				close_later(&st, fd);
+			}
+			st.fd_to_compact.push_back(fd);
+		}
+		to_parse.clear();
+
+		mail_pending = finish_iteration(&st);
+	}
+
+	shutdown_connections(&st);
+	uring_destroy(&ring);
+	trace_event(&st, TRACE_STOP, 0, 0, OP_NONE, "");
+	pthread_exit(NULL);
+}
+
+/*!
+Checks that io_uring with all features used by the backend can be created.
+\returns true if -u can be used
+*/
+bool uring_supported()
+{
+	uring probe;
+	if(uring_init(&probe) != 0)
+		return false;
+	uring_destroy(&probe);
+	return true;
+}
+
+#else
+
+bool uring_supported()
+{
+	cerr << "Built without io_uring support (IO_URING=0).\n";
+	return false;
+}
+
+void *uring_read_and_respond(void *)
+{
+	return NULL;
+}
+
+int uring_flush(scheduler_state *, int)
+{
+	return -1;
+}
+
+void uring_release_socket(scheduler_state *, int fd)
+{
+	close(fd);
+}
+
+#endif
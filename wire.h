@@ -0,0 +1,50 @@
+/** @file wire.h*/
+/** Binary protocol of workers, shared with load_generator.
+**
+** A connection speaks it when its first byte is WIRE_MAGIC, text messages start with a digit.
+** Every message starts with a fixed little-endian header, numbers need no parsing and answers no building.
+ */
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stdint.h>
+
+// First byte of every binary message
+#define WIRE_MAGIC 0xB1
+// wire_request::flags of DONE: the name is followed by the size of the written file, uint64_t
+#define WIRE_DONE_SIZE 1
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "binary protocol is little-endian, headers are copied as they are"
+#endif
+
+/*! Request, followed by 'name_len' bytes of the target name.
+The name may be left out (DONE, BEAT, HINT) when the target was named before: then it is found by 'hash'.
+READ, WRIT, SUBS, PREF and DEPS always carry the name, a name of SUBS or PREF that ends with '*' is a prefix,
+DEPS carries "target#input#input...". WORK needs no name. Batches (BTCH) are a feature of the text protocol only.*/
+struct wire_request
+{
+	uint8_t magic; ///WIRE_MAGIC
+	uint8_t op; ///op_code: 1 READ, 2 WRIT, 4 DONE, 5 BEAT, 7 HINT, 9 SHMR, 10 SUBS, 11 PREF, 13 DEPS, 14 WORK
+	uint16_t name_len;
+	int32_t pid;
+	uint32_t id; ///chosen by the worker, given back with every answer to this request
+	uint32_t flags; ///0, or WIRE_DONE_SIZE
+	uint64_t hash; ///64-bit FNV-1a of the name, used only when the name is left out
+};
+
+/*! Answer, followed by 'len' bytes: nothing for decisions, the text of the text protocol after "len#HINT#" for HINT,
+the target name for NTFY, PREF, WORK and EVCT. WAIT is followed by READ or WRIT with the same id later,
+NTFY and PREF carry the id of SUBS or PREF that asked for them.*/
+struct wire_answer
+{
+	uint8_t magic; ///WIRE_MAGIC
+	uint8_t op; ///op_code: 1 READ, 2 WRIT, 3 WAIT, 6 EXIT, 7 HINT, 9 SHMR, 11 PREF, 12 NTFY, 14 WORK, 15 IDLE, 16 EVCT
+	uint16_t len;
+	uint32_t id; ///of the request, 0 for EXIT
+};
+
+static_assert(sizeof(wire_request) == 24, "binary request header must stay 24 bytes");
+static_assert(sizeof(wire_answer) == 8, "binary answer header must stay 8 bytes");
+
+#endif